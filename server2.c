@@ -4,25 +4,77 @@
 // - Sin warnings con -Wall -Wextra -pedantic
 // - Cierre ordenado con SIGINT
 // - Sección one-shot al final (comentada) para Valgrind
+// - Mantenimiento en reposo (poll con timeout) con tope de CPU
+// - Compilar con -pthread -lm (hilo de liberación diferida, HyperLogLog)
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
 #include <signal.h>
 #include <errno.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define PORT 5000
 #define BUFFER_SIZE 1024
+#define RESPONSE_SIZE 4096             // respuesta armada en run_request (STATS es la más larga)
+#define LISTEN_BACKLOG 128
+#define ACCEPT_BATCH 16            // conexiones aceptadas por listener en cada vuelta
 
 typedef enum {
     CMD_INVALID = 0,
     CMD_SET,
     CMD_GET,
-    CMD_DEL
+    CMD_DEL,
+    CMD_HOTKEYS,
+    CMD_MEMORY_STATS,
+    CMD_MEMORY_USAGE,
+    CMD_TRACKING,
+    CMD_STATS,
+    CMD_MGET,
+    CMD_RELOAD,
+    CMD_SNAPSHOT,
+    CMD_SNAPGET,
+    CMD_RELEASE,
+    CMD_EXPORT,
+    CMD_UNLINK,
+    CMD_FLUSHALL,
+    CMD_DELPREFIX,
+    CMD_DELRANGE,
+    CMD_PFADD,
+    CMD_PFCOUNT,
+    CMD_PFMERGE,
+    CMD_SETBIT,
+    CMD_GETBIT,
+    CMD_BITCOUNT,
+    CMD_BITOP,
+    CMD_CDCREAD,
+    CMD_CDCCOMMIT,
+    CMD_CDCINFO
 } Command;
 
 typedef struct {
@@ -31,9 +83,158 @@ typedef struct {
     char value[BUFFER_SIZE];       // usado en SET
 } Request;
 
+// Opciones de línea de comandos del modo servidor.
+typedef struct {
+    int mc_port;             // 0 = sin listener memcached
+    int http_port;           // 0 = sin gateway HTTP
+    int tfo_qlen;            // > 0: TCP Fast Open en los listeners
+    int defer_accept;        // > 0: TCP_DEFER_ACCEPT (segundos)
+    int zc_threshold;        // > 0: MSG_ZEROCOPY para respuestas de al menos N bytes
+    size_t cache_bytes;      // tope de la caché de valores (0 = sin caché)
+    int busy_poll_us;        // > 0: el bucle gira sin dormir hasta N µs después del último evento
+    int writeback_ms;        // > 0: los SET quedan en memoria y se persisten cada N ms
+    int tier_promote;        // > 0: caché en dos niveles; el valor sube en la N-ésima lectura del disco
+    int dedup_min;           // > 0: los valores de al menos N bytes se guardan una vez por contenido
+    const char *ro_path;     // != NULL: se sirve este dataset de solo lectura
+    bool ehash;              // crear el índice en disco si no existe (--engine=ehash)
+    int cdc_mb;              // > 0: registro de cambios en .cdc/ con retención de N MB
+    int port;                // puerto del protocolo nativo
+    const char *raft_peers;  // != NULL: grupo Raft con estos puertos nativos
+    int raft_snap;           // entradas aplicadas entre snapshots de Raft
+} Config;
+
+static Config g_cfg = { .mc_port = 0, .http_port = 0, .tfo_qlen = 0, .defer_accept = 0, .zc_threshold = 0,
+                        .cache_bytes = 64u << 20, .busy_poll_us = 0,
+                        .writeback_ms = 0, .tier_promote = 0, .dedup_min = 0, .ro_path = NULL, .ehash = false,
+                        .cdc_mb = 0, .port = PORT, .raft_peers = NULL, .raft_snap = 10000 };
+
+// Estadísticas de MSG_ZEROCOPY (comando STATS)
+static uint64_t g_zc_sends = 0, g_zc_bytes = 0, g_zc_completions = 0, g_zc_copied = 0, g_zc_fallbacks = 0;
+// Estadísticas del modo --busy-poll: vueltas sin dormir, vueltas con eventos y vueltas a bloquear
+static uint64_t g_bp_spins = 0, g_bp_hits = 0, g_bp_sleeps = 0;
+
 static volatile sig_atomic_t g_stop = 0;
 static void on_sigint(int sig) { (void)sig; g_stop = 1; }
 
+// ---------- contabilidad de memoria ----------
+// Cada estructura dinámica del servidor suma en g_mem_used[categoría] lo que
+// realmente reserva el allocator (malloc_usable_size), no lo pedido.
+typedef enum {
+    MEM_INDEX = 0,      // índice hash de claves
+    MEM_KEYS,           // copias de claves
+    MEM_VALUES,         // valores en memoria
+    MEM_CONN_BUFFERS,   // buffers de lectura por conexión
+    MEM_OUTPUT,         // colas/buffers de salida
+    MEM_REPL_BACKLOG,   // backlog de replicación
+    MEM_TRACKING,       // tabla de claves seguidas por clientes (TRACKING)
+    MEM_VERSIONS,       // versiones guardadas para los snapshots (MVCC)
+    MEM_OTHER,
+    MEM_CAT_COUNT
+} MemCategory;
+
+static const char *const g_mem_names[MEM_CAT_COUNT] = {
+    "hash_index", "keys", "values", "conn_buffers", "output", "repl_backlog", "tracking", "versions", "other"
+};
+static size_t g_mem_used[MEM_CAT_COUNT];
+static size_t g_clients_active = 0;   // conexiones en curso (buffers en pila)
+
+static void *mem_alloc(MemCategory cat, size_t n) {
+    void *p = malloc(n);
+    if (p) g_mem_used[cat] += malloc_usable_size(p);
+    return p;
+}
+
+static void mem_free(MemCategory cat, void *p) {
+    if (!p) return;
+    g_mem_used[cat] -= malloc_usable_size(p);
+    free(p);
+}
+
+static void *mem_realloc(MemCategory cat, void *p, size_t n) {
+    size_t old = p ? malloc_usable_size(p) : 0;
+    void *q = realloc(p, n);
+    if (!q) return NULL;
+    g_mem_used[cat] += malloc_usable_size(q) - old;
+    return q;
+}
+
+// Buffer dinámico contabilizado en una categoría.
+typedef struct {
+    char *p;
+    size_t len;
+    size_t cap;
+    MemCategory cat;
+} Buf;
+
+static bool buf_reserve(Buf *b, size_t extra) {
+    if (b->len + extra <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) cap *= 2;
+    char *p = mem_realloc(b->cat, b->p, cap);
+    if (!p) return false;
+    b->p = p;
+    b->cap = cap;
+    return true;
+}
+
+static bool buf_append(Buf *b, const void *data, size_t n) {
+    if (!buf_reserve(b, n)) return false;
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+    return true;
+}
+
+static void buf_free(Buf *b) {
+    mem_free(b->cat, b->p);
+    b->p = NULL;
+    b->len = b->cap = 0;
+}
+
+// RSS del proceso en bytes (0 si /proc no está disponible).
+static size_t mem_rss(void) {
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) return 0;
+    unsigned long size = 0, resident = 0;
+    int ok = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (ok != 2) return 0;
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// ---------- desfragmentación ----------
+// En reposo, el desfragmentador devuelve al SO las páginas libres del heap
+// (malloc_trim usa madvise(MADV_DONTNEED) sobre ellas) y se reprograma
+// según lo que tardó, para no superar DEFRAG_CPU_PCT de CPU.
+#define DEFRAG_MIN_WASTE (1u << 20)    // bytes libres en el heap para actuar
+#define DEFRAG_CPU_PCT 1
+
+static uint64_t g_defrag_runs = 0;
+static uint64_t g_defrag_released = 0;
+static uint64_t g_defrag_next_us = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static void defrag_step(void) {
+    uint64_t t0 = now_us();
+    if (t0 < g_defrag_next_us) return;
+
+    struct mallinfo2 mi = mallinfo2();
+    if (mi.fordblks < DEFRAG_MIN_WASTE) return;
+
+    size_t before = mem_rss();
+    (void)malloc_trim(0);
+    size_t after = mem_rss();
+
+    uint64_t t1 = now_us();
+    g_defrag_next_us = t1 + (t1 - t0) * (100 / DEFRAG_CPU_PCT);
+    ++g_defrag_runs;
+    if (before > after) g_defrag_released += before - after;
+}
+
 // ---------- utilidades ----------
 static bool clave_valida(const char *clave) {
     if (clave == NULL || clave[0] == '\0') return false;
@@ -59,91 +260,5954 @@ static ssize_t write_all(int fd, const void *buf, size_t len) {
     return (ssize_t)len;
 }
 
-// ---------- parseo ----------
-static Command parse_cmd(const char *cmd_str) {
-    if (strcmp(cmd_str, "SET") == 0) return CMD_SET;
-    if (strcmp(cmd_str, "GET") == 0) return CMD_GET;
-    if (strcmp(cmd_str, "DEL") == 0) return CMD_DEL;
-    return CMD_INVALID;
+// FNV-1a de 64 bits con semilla (hot keys y demás tablas hash)
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = (const unsigned char*)data;
+    uint64_t h = 1469598103934665603ULL ^ seed;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
 }
 
-// 0 ok; <0 error de formato/parámetros
-static int parse_request(const char *buffer, Request *req) {
-    if (!buffer || !req) return -1;
+// Hash de contenido para la deduplicación: 8 bytes por paso en cuatro
+// carriles independientes (las multiplicaciones se superponen), así cuesta
+// bastante menos que copiar el valor. Las coincidencias se confirman con
+// memcmp, no hace falta que sea criptográfico.
+static uint64_t content_hash(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char*)data;
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t lane[4] = { len, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, p + i, sizeof w);
+        for (size_t l = 0; l < 4; ++l) {
+            lane[l] = (lane[l] ^ w[l]) * k;
+            lane[l] = (lane[l] << 31) | (lane[l] >> 33);
+        }
+    }
+    uint64_t h = lane[0] ^ ((lane[1] << 7) | (lane[1] >> 57)) ^ ((lane[2] << 13) | (lane[2] >> 51)) ^
+                 ((lane[3] << 19) | (lane[3] >> 45));
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof w);
+        h = ((h ^ w) * k);
+        h ^= h >> 29;
+    }
+    for (; i < len; ++i) h = (h ^ p[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
 
-    char cmd_str[10] = {0};
-    memset(req, 0, sizeof *req);
+// ---------- hot keys (Count-Min Sketch + top-K) ----------
+// Estimación aproximada de frecuencia por clave con memoria fija:
+// CMS_DEPTH filas de CMS_WIDTH contadores; el top-K es un min-heap.
+#define CMS_DEPTH 4
+#define CMS_WIDTH 1024
+#define HOTKEYS_TOPK 8             // 8 * (99 + 12) entra en una respuesta
+#define HOTKEYS_SAMPLE 1           // muestrear 1 de cada N accesos (1 = todos)
+#define HOTKEYS_DECAY 65536        // cada N muestras se dividen los contadores por 2
 
-    // Formatos:
-    //   SET <key> <value...>
-    //   GET <key>
-    //   DEL <key>
-    int matched = sscanf(buffer, "%9s %99s %1023[^\n]", cmd_str, req->key, req->value);
-    if (matched < 1) return -2; // sin comando
+typedef struct {
+    char key[100];
+    uint32_t count;
+} HotKey;
 
-    req->cmd = parse_cmd(cmd_str);
-    if (req->cmd == CMD_INVALID) return -3;
+static uint32_t g_cms[CMS_DEPTH][CMS_WIDTH];
+static HotKey g_topk[HOTKEYS_TOPK];   // min-heap por count
+static size_t g_topk_len = 0;
+static uint32_t g_hot_samples = 0;
+static uint32_t g_hot_rng = 2463534242u;
 
-    if ((req->cmd == CMD_GET || req->cmd == CMD_DEL) && matched < 2) return -4; // falta clave
-    if (req->cmd == CMD_SET && matched < 3) return -5;                          // falta valor
+static void topk_sift_down(size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < g_topk_len && g_topk[l].count < g_topk[m].count) m = l;
+        if (r < g_topk_len && g_topk[r].count < g_topk[m].count) m = r;
+        if (m == i) return;
+        HotKey tmp = g_topk[i]; g_topk[i] = g_topk[m]; g_topk[m] = tmp;
+        i = m;
+    }
+}
+
+static void topk_sift_up(size_t i) {
+    while (i > 0) {
+        size_t p = (i - 1) / 2;
+        if (g_topk[p].count <= g_topk[i].count) return;
+        HotKey tmp = g_topk[i]; g_topk[i] = g_topk[p]; g_topk[p] = tmp;
+        i = p;
+    }
+}
+
+// Envejecimiento: las claves que dejaron de ser calientes se desvanecen.
+static void hotkeys_decay(void) {
+    for (size_t d = 0; d < CMS_DEPTH; ++d)
+        for (size_t w = 0; w < CMS_WIDTH; ++w) g_cms[d][w] >>= 1;
+    for (size_t i = 0; i < g_topk_len; ++i) g_topk[i].count >>= 1;
+}
+
+// Columna de cada fila para <key> (doble hashing sobre FNV-1a).
+static void cms_index(const char *key, size_t idx[CMS_DEPTH]) {
+    size_t len = strlen(key);
+    uint64_t h1 = hash_bytes(key, len, 0);
+    uint64_t h2 = hash_bytes(key, len, 0x9e3779b97f4a7c15ULL) | 1;
+    for (size_t d = 0; d < CMS_DEPTH; ++d) idx[d] = (size_t)((h1 + d * h2) % CMS_WIDTH);
+}
+
+// Registra un acceso a <key>; O(CMS_DEPTH + HOTKEYS_TOPK).
+static void hotkeys_sample(const char *key) {
+    if (HOTKEYS_SAMPLE > 1) {
+        g_hot_rng ^= g_hot_rng << 13; g_hot_rng ^= g_hot_rng >> 17; g_hot_rng ^= g_hot_rng << 5;
+        if (g_hot_rng % HOTKEYS_SAMPLE != 0) return;
+    }
+    if (++g_hot_samples % HOTKEYS_DECAY == 0) hotkeys_decay();
+
+    size_t idx[CMS_DEPTH];
+    cms_index(key, idx);
+    uint32_t est = UINT32_MAX;
+    for (size_t d = 0; d < CMS_DEPTH; ++d) {
+        uint32_t *c = &g_cms[d][idx[d]];
+        if (*c < UINT32_MAX) ++*c;
+        if (*c < est) est = *c;
+    }
+
+    for (size_t i = 0; i < g_topk_len; ++i) {
+        if (strcmp(g_topk[i].key, key) == 0) {
+            g_topk[i].count = est;
+            topk_sift_down(i);
+            return;
+        }
+    }
+    if (g_topk_len < HOTKEYS_TOPK) {
+        (void)snprintf(g_topk[g_topk_len].key, sizeof g_topk[0].key, "%s", key);
+        g_topk[g_topk_len].count = est;
+        topk_sift_up(g_topk_len++);
+    } else if (est > g_topk[0].count) {
+        (void)snprintf(g_topk[0].key, sizeof g_topk[0].key, "%s", key);
+        g_topk[0].count = est;
+        topk_sift_down(0);
+    }
+}
+
+// ---------- tracking (invalidación asistida por el servidor) ----------
+// "TRACKING ON" deja la conexión abierta como canal de invalidaciones para la
+// IP del cliente: cada GET desde esa IP registra la clave y el siguiente
+// SET/DEL de esa clave envía "INVALIDATE <clave>\n" por el canal.
+// La tabla de claves está acotada (TRACK_MAX_KEYS): si se llena, se invalida
+// y olvida una clave cualquiera. "TRACKING PREFIX <p>" (broadcast) no guarda
+// claves: notifica toda mutación de claves que empiecen con <p>.
+#define TRACK_MAX_CLIENTS 32
+#define TRACK_MAX_KEYS 4096            // potencia de 2; se usa hasta el 75%
+
+typedef struct {
+    bool used;
+    bool broadcast;
+    int fd;
+    struct in_addr addr;
+    char prefix[100];
+} Tracker;
+
+typedef struct {
+    uint32_t mask;                     // bit i = g_trackers[i]; 0 = libre
+    char key[100];
+} TrackedKey;
+
+static Tracker g_trackers[TRACK_MAX_CLIENTS];
+static size_t g_trackers_default = 0;  // trackers en modo por clave
+static TrackedKey *g_tracked = NULL;   // TRACK_MAX_KEYS entradas, se reserva al primer uso
+static size_t g_tracked_count = 0;
+static uint32_t g_track_rng = 88172645u;
+
+static size_t tracked_home(const char *key) {
+    return (size_t)hash_bytes(key, strlen(key), 0) & (TRACK_MAX_KEYS - 1);
+}
+
+static size_t tracked_find(const char *key) {
+    for (size_t i = tracked_home(key);; i = (i + 1) & (TRACK_MAX_KEYS - 1)) {
+        if (g_tracked[i].mask == 0) return i;
+        if (strcmp(g_tracked[i].key, key) == 0) return i;
+    }
+}
+
+// Borrado en sondeo lineal: corre hacia atrás las entradas desplazadas.
+static void tracked_remove(size_t i) {
+    g_tracked[i].mask = 0;
+    --g_tracked_count;
+    for (size_t j = (i + 1) & (TRACK_MAX_KEYS - 1); g_tracked[j].mask != 0; j = (j + 1) & (TRACK_MAX_KEYS - 1)) {
+        size_t home = tracked_home(g_tracked[j].key);
+        bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            g_tracked[i] = g_tracked[j];
+            g_tracked[j].mask = 0;
+            i = j;
+        }
+    }
+}
+
+static void tracking_drop(size_t t) {
+    if (!g_trackers[t].used) return;
+    close(g_trackers[t].fd);
+    if (!g_trackers[t].broadcast) --g_trackers_default;
+    g_trackers[t].used = false;
+    if (!g_tracked) return;
+    uint32_t bit = 1u << t;
+    for (size_t i = 0; i < TRACK_MAX_KEYS;) {
+        if (g_tracked[i].mask & bit) {
+            g_tracked[i].mask &= ~bit;
+            if (g_tracked[i].mask == 0) {
+                tracked_remove(i);
+                continue;              // i recibió otra entrada: revisarla
+            }
+        }
+        ++i;
+    }
+}
+
+// Un cliente lento o caído pierde el canal (debe descartar su caché).
+static void tracking_push(size_t t, const char *key) {
+    char msg[128];
+    int n = snprintf(msg, sizeof msg, "INVALIDATE %s\n", key);
+    if (send(g_trackers[t].fd, msg, (size_t)n, MSG_NOSIGNAL | MSG_DONTWAIT) != n)
+        tracking_drop(t);
+}
+
+static void tracking_push_mask(uint32_t mask, const char *key) {
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t)
+        if ((mask & (1u << t)) && g_trackers[t].used) tracking_push(t, key);
+}
+
+// true si la conexión queda registrada como canal (no se debe cerrar).
+static bool tracking_register(int fd, bool broadcast, const char *prefix) {
+    struct sockaddr_in peer;
+    socklen_t len = sizeof peer;
+    if (getpeername(fd, (struct sockaddr *)&peer, &len) != 0) return false;
+    if (!broadcast && !g_tracked) {
+        g_tracked = mem_alloc(MEM_TRACKING, TRACK_MAX_KEYS * sizeof *g_tracked);
+        if (!g_tracked) return false;
+        memset(g_tracked, 0, TRACK_MAX_KEYS * sizeof *g_tracked);
+    }
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t) {
+        if (g_trackers[t].used) continue;
+        g_trackers[t].used = true;
+        g_trackers[t].broadcast = broadcast;
+        g_trackers[t].fd = fd;
+        g_trackers[t].addr = peer.sin_addr;
+        (void)snprintf(g_trackers[t].prefix, sizeof g_trackers[t].prefix, "%s", prefix ? prefix : "");
+        if (!broadcast) ++g_trackers_default;
+        return true;
+    }
+    return false;
+}
+
+// GET de <key> por client_fd: recordar la clave para los canales de su IP.
+static void tracking_note_read(int client_fd, const char *key) {
+    if (g_trackers_default == 0) return;
+    struct sockaddr_in peer;
+    socklen_t len = sizeof peer;
+    if (getpeername(client_fd, (struct sockaddr *)&peer, &len) != 0) return;
+
+    uint32_t mask = 0;
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t)
+        if (g_trackers[t].used && !g_trackers[t].broadcast &&
+            g_trackers[t].addr.s_addr == peer.sin_addr.s_addr)
+            mask |= 1u << t;
+    if (mask == 0) return;
+
+    size_t i = tracked_find(key);
+    if (g_tracked[i].mask == 0) {
+        if (g_tracked_count >= TRACK_MAX_KEYS / 4 * 3) {
+            g_track_rng ^= g_track_rng << 13; g_track_rng ^= g_track_rng >> 17; g_track_rng ^= g_track_rng << 5;
+            size_t v = g_track_rng & (TRACK_MAX_KEYS - 1);
+            while (g_tracked[v].mask == 0) v = (v + 1) & (TRACK_MAX_KEYS - 1);
+            TrackedKey victim = g_tracked[v];
+            tracked_remove(v);
+            tracking_push_mask(victim.mask, victim.key);
+            i = tracked_find(key);
+        }
+        (void)snprintf(g_tracked[i].key, sizeof g_tracked[i].key, "%s", key);
+        ++g_tracked_count;
+    }
+    g_tracked[i].mask |= mask;
+}
+
+// <key> cambió (SET/DEL): avisar a quien la leyó y a los prefijos que la cubren.
+static void tracking_invalidate(const char *key) {
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t)
+        if (g_trackers[t].used && g_trackers[t].broadcast &&
+            strncmp(key, g_trackers[t].prefix, strlen(g_trackers[t].prefix)) == 0)
+            tracking_push(t, key);
+    if (!g_tracked || g_tracked_count == 0) return;
+    size_t i = tracked_find(key);
+    if (g_tracked[i].mask == 0) return;
+    uint32_t mask = g_tracked[i].mask;
+    tracked_remove(i);
+    tracking_push_mask(mask, key);
+}
+
+static void tracking_shutdown(void) {
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t) tracking_drop(t);
+    mem_free(MEM_TRACKING, g_tracked);
+    g_tracked = NULL;
+    g_tracked_count = 0;
+}
+
+// ---------- almacenamiento (un archivo por clave) ----------
+// Las claves ya vienen validadas (clave_valida) por quien llama. Estas son
+// las funciones del formato original; las store_* de más abajo eligen entre
+// ellas y el índice en disco (--engine=ehash).
+
+// Con --dedup, un valor de al menos g_cfg.dedup_min bytes se guarda una sola
+// vez en DEDUP_DIR/<hash>-<largo> y el archivo de cada clave con ese
+// contenido es un enlace duro al blob: el contador de enlaces del sistema de
+// archivos hace de contador de referencias. Borrar o reemplazar una clave
+// sólo le quita un enlace; dedup_sweep_step() borra los blobs que quedaron
+// sin claves.
+#define DEDUP_DIR ".dedup"
+#define DEDUP_CMP_CHUNK 65536
+
+static bool g_dedup_links = false;     // puede haber archivos enlazados: no escribirles encima
+static uint64_t g_dedup_disk_hits = 0;
+
+static bool dedup_same(int fd, const void *data, size_t len) {
+    char buf[DEDUP_CMP_CHUNK];
+    size_t off = 0;
+    while (off < len) {
+        size_t want = len - off < sizeof buf ? len - off : sizeof buf;
+        ssize_t r = read(fd, buf, want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0 || memcmp(buf, (const char*)data + off, (size_t)r) != 0) return false;
+        off += (size_t)r;
+    }
+    return read(fd, buf, 1) == 0;
+}
+
+// 0 si key quedó enlazada al blob de su contenido; -1: escribirla aparte.
+static int dedup_link(const char *key, const void *data, size_t len) {
+    char blob[64];
+    (void)snprintf(blob, sizeof blob, DEDUP_DIR "/%016llx-%zu",
+                   (unsigned long long)content_hash(data, len), len);
+    int fd = open(blob, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        bool same = dedup_same(fd, data, len);
+        close(fd);
+        if (!same) return -1;                      // colisión del hash
+        ++g_dedup_disk_hits;
+    } else {
+        char tmp[80];
+        (void)snprintf(tmp, sizeof tmp, "%s.%ld", blob, (long)getpid());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) return -1;
+        ssize_t w = write_all(fd, data, len);
+        if (close(fd) != 0 || w < 0 || rename(tmp, blob) != 0) {
+            (void)unlink(tmp);
+            return -1;
+        }
+    }
+    if (unlink(key) != 0 && errno != ENOENT) return -1;
+    return link(blob, key);                        // p. ej. EMLINK: se escribe aparte
+}
+
+// 0 ok; -1 error
+static int file_write(const char *key, const void *data, size_t len) {
+    if (g_cfg.dedup_min > 0 && len >= (size_t)g_cfg.dedup_min && dedup_link(key, data, len) == 0) return 0;
+    struct stat st;
+    if (g_dedup_links && lstat(key, &st) == 0 && st.st_nlink > 1) (void)unlink(key);   // otro lo comparte
+    int fd = open(key, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    ssize_t w = write_all(fd, data, len);
+    if (close(fd) != 0 || w < 0) return -1;
+    return 0;
+}
+
+// Bytes leídos (hasta cap); -1 si la clave no existe
+static ssize_t file_read(const char *key, void *buf, size_t cap) {
+    int fd = open(key, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    size_t n = 0;
+    while (n < cap) {
+        ssize_t r = read(fd, (char*)buf + n, cap - n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        if (r == 0) break;
+        n += (size_t)r;
+    }
+    close(fd);
+    return (ssize_t)n;
+}
+
+// Descriptor de sólo lectura del valor (para envíos sin copia); -1 si no existe.
+static int file_open(const char *key, size_t *size) {
+    int fd = open(key, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+    *size = (size_t)st.st_size;
+    return fd;
+}
+
+// Con create (--dedup) crea el directorio de blobs. Si existe, puede haber
+// claves enlazadas aunque esta vez no se deduplique.
+static bool dedup_open(bool create) {
+    struct stat st;
+    if (create && mkdir(DEDUP_DIR, 0777) != 0 && errno != EEXIST) {
+        perror(DEDUP_DIR);
+        return false;
+    }
+    g_dedup_links = stat(DEDUP_DIR, &st) == 0 && S_ISDIR(st.st_mode);
+    return true;
+}
+
+// Recorre los blobs de a DEDUP_SWEEP_STEP por llamada (en reposo): borra los
+// que ya no tienen claves y, al completar cada pasada, publica cuántos hay
+// y cuánto disco ahorran.
+#define DEDUP_SWEEP_STEP 64
+
+static DIR *g_dedup_dir = NULL;
+static uint64_t g_dedup_pass_blobs = 0, g_dedup_pass_saved = 0;
+static uint64_t g_dedup_blobs = 0, g_dedup_disk_saved = 0, g_dedup_orphans = 0;
+
+static void dedup_sweep_step(void) {
+    if (!g_dedup_links) return;
+    if (!g_dedup_dir && !(g_dedup_dir = opendir(DEDUP_DIR))) return;
+    for (int n = 0; n < DEDUP_SWEEP_STEP; ++n) {
+        struct dirent *de = readdir(g_dedup_dir);
+        if (!de) {
+            closedir(g_dedup_dir);
+            g_dedup_dir = NULL;
+            g_dedup_blobs = g_dedup_pass_blobs;
+            g_dedup_disk_saved = g_dedup_pass_saved;
+            g_dedup_pass_blobs = g_dedup_pass_saved = 0;
+            return;
+        }
+        struct stat st;
+        if (de->d_name[0] == '.') continue;
+        if (fstatat(dirfd(g_dedup_dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_nlink <= 1) {                    // sólo el blob: ninguna clave lo usa
+            if (unlinkat(dirfd(g_dedup_dir), de->d_name, 0) == 0) ++g_dedup_orphans;
+            continue;
+        }
+        ++g_dedup_pass_blobs;
+        g_dedup_pass_saved += (uint64_t)(st.st_nlink - 2) * (uint64_t)st.st_blocks * 512;
+    }
+}
+
+static void dedup_close(void) {
+    if (g_dedup_dir) closedir(g_dedup_dir);
+    g_dedup_dir = NULL;
+}
+
+// ---------- índice en disco (hash lineal) ----------
+// Con --engine=ehash las claves no son archivos sueltos sino registros en
+// páginas de 4 KiB: una página por bucket en ".ehash" y las de desborde en
+// ".ehovf" (los nombres con punto nunca chocan con una clave). El bucket de
+// una clave sale de su hash y de dos enteros del encabezado (nivel y puntero
+// de división), así que no hay índice por clave en memoria y un GET en frío
+// es una sola lectura de página mientras el bucket no desborde. Cuando la
+// ocupación pasa de EH_FILL se divide un solo bucket por inserción (hash
+// lineal): el archivo crece de a una página, sin duplicar directorios ni
+// frenar al resto. Sólo las páginas de una caché acotada (--engine-cache-mb,
+// reloj) quedan en memoria; las escrituras van directo al disco.
+// Los valores de más de EH_MAX_INLINE bytes siguen en su archivo por clave y
+// la página guarda sólo la clave con la marca EH_EXTERNAL.
+#define EH_PAGE 4096
+#define EH_MAGIC "KVEH0001"
+#define EH_FILE ".ehash"
+#define EH_OVF_FILE ".ehovf"
+#define EH_MAX_INLINE 1024
+#define EH_FILL 0.75
+#define EH_INIT_LEVEL 4
+#define EH_REC_HDR 4                       // u8 klen, u8 flags, u16 vlen
+#define EH_EXTERNAL 1
+#define EH_SEED 0x2545f4914f6cdd1dULL
+
+typedef struct {
+    char magic[8];
+    uint32_t level;
+    uint32_t pad;
+    uint64_t split;            // próximo bucket a dividir
+    uint64_t keys;
+    uint64_t bytes;            // bytes de registros (decide las divisiones)
+    uint64_t ovf_pages;        // páginas usadas de .ehovf (la 0 no se usa)
+    uint64_t ovf_free;         // primera página libre de .ehovf (0: ninguna)
+} EhHeader;
+
+typedef struct {
+    uint16_t used;             // bytes ocupados, incluido este encabezado
+    uint16_t pad;
+    uint32_t next;             // página de desborde siguiente (0: fin)
+} EhPageHdr;
+
+typedef struct {
+    uint64_t id;               // (desborde << 63) | página; EH_NO_PAGE: libre
+    bool referenced;
+    char *data;
+} EhSlot;
+
+#define EH_NO_PAGE UINT64_MAX
+
+static struct {
+    int fd, ovf_fd;            // -1: motor desactivado
+    EhHeader h;
+    EhSlot *slots;
+    size_t nslots, hand;
+    uint32_t *map;             // id -> slot + 1 (sondeo lineal; 0 = vacío)
+    size_t mapsize;
+    uint64_t reads, hits, splits;
+} g_eh = { .fd = -1, .ovf_fd = -1 };
+
+static size_t g_eh_cache_pages = (16u << 20) / EH_PAGE;
+
+static uint64_t eh_id(bool ovf, uint64_t page) {
+    return ((uint64_t)ovf << 63) | page;
+}
+
+static size_t eh_map_home(uint64_t id) {
+    return (size_t)(hash_bytes(&id, sizeof id, EH_SEED) & (g_eh.mapsize - 1));
+}
+
+static size_t eh_map_find(uint64_t id) {
+    for (size_t i = eh_map_home(id); g_eh.map[i]; i = (i + 1) & (g_eh.mapsize - 1))
+        if (g_eh.slots[g_eh.map[i] - 1].id == id) return i;
+    return SIZE_MAX;
+}
+
+static void eh_map_remove(size_t i) {
+    g_eh.map[i] = 0;
+    for (size_t j = (i + 1) & (g_eh.mapsize - 1); g_eh.map[j]; j = (j + 1) & (g_eh.mapsize - 1)) {
+        size_t home = eh_map_home(g_eh.slots[g_eh.map[j] - 1].id);
+        if (((j - home) & (g_eh.mapsize - 1)) >= ((j - i) & (g_eh.mapsize - 1))) {
+            g_eh.map[i] = g_eh.map[j];
+            g_eh.map[j] = 0;
+            i = j;
+        }
+    }
+}
+
+// Página en la caché (leída del disco si hace falta). El puntero vale hasta
+// la próxima llamada: otra página puede ocupar su lugar.
+static char *eh_page(bool ovf, uint64_t page) {
+    uint64_t id = eh_id(ovf, page);
+    size_t m = eh_map_find(id);
+    if (m != SIZE_MAX) {
+        EhSlot *s = &g_eh.slots[g_eh.map[m] - 1];
+        s->referenced = true;
+        ++g_eh.hits;
+        return s->data;
+    }
+    for (;;) {                                   // reloj
+        EhSlot *s = &g_eh.slots[g_eh.hand];
+        if (s->id != EH_NO_PAGE && s->referenced) {
+            s->referenced = false;
+            g_eh.hand = (g_eh.hand + 1) % g_eh.nslots;
+            continue;
+        }
+        if (s->id != EH_NO_PAGE) eh_map_remove(eh_map_find(s->id));
+        ssize_t r = pread(ovf ? g_eh.ovf_fd : g_eh.fd, s->data, EH_PAGE, (off_t)(page * EH_PAGE));
+        // más allá del final o hueco del fichero (todo ceros): página vacía
+        if (r < EH_PAGE || ((EhPageHdr *)(void*)s->data)->used < sizeof(EhPageHdr)) {
+            memset(s->data, 0, EH_PAGE);
+            ((EhPageHdr *)(void*)s->data)->used = sizeof(EhPageHdr);
+        }
+        ++g_eh.reads;
+        s->id = id;
+        s->referenced = true;
+        size_t i = eh_map_home(id);
+        while (g_eh.map[i]) i = (i + 1) & (g_eh.mapsize - 1);
+        g_eh.map[i] = (uint32_t)(g_eh.hand + 1);
+        g_eh.hand = (g_eh.hand + 1) % g_eh.nslots;
+        return s->data;
+    }
+}
+
+// Escribe la página al disco y a la caché si está ahí.
+static bool eh_put_page(bool ovf, uint64_t page, const char *data) {
+    size_t m = eh_map_find(eh_id(ovf, page));
+    if (m != SIZE_MAX) {
+        char *cached = g_eh.slots[g_eh.map[m] - 1].data;
+        if (cached != data) memcpy(cached, data, EH_PAGE);
+    }
+    return pwrite(ovf ? g_eh.ovf_fd : g_eh.fd, data, EH_PAGE, (off_t)(page * EH_PAGE)) == EH_PAGE;
+}
+
+static bool eh_put_header(void) {
+    return pwrite(g_eh.fd, &g_eh.h, sizeof g_eh.h, 0) == (ssize_t)sizeof g_eh.h;
+}
+
+static uint64_t eh_buckets(void) {
+    return ((uint64_t)1 << g_eh.h.level) + g_eh.h.split;
+}
+
+static uint64_t eh_bucket_of(uint64_t h) {
+    uint64_t b = h & (((uint64_t)1 << g_eh.h.level) - 1);
+    if (b < g_eh.h.split) b = h & (((uint64_t)1 << (g_eh.h.level + 1)) - 1);
+    return b;
+}
+
+static uint64_t eh_key_hash(const char *key, size_t klen) {
+    return hash_bytes(key, klen, EH_SEED);
+}
+
+// Página de desborde libre (de la lista de libres o al final de .ehovf).
+static uint32_t eh_ovf_alloc(void) {
+    uint32_t p;
+    if (g_eh.h.ovf_free) {
+        p = (uint32_t)g_eh.h.ovf_free;
+        g_eh.h.ovf_free = ((const EhPageHdr *)(const void*)eh_page(true, p))->next;
+    } else {
+        p = (uint32_t)++g_eh.h.ovf_pages;
+    }
+    (void)eh_put_header();                        // no repartir dos veces la misma página tras un corte
+    return p;
+}
+
+static void eh_ovf_release(uint32_t p) {
+    char page[EH_PAGE];
+    memset(page, 0, sizeof page);
+    EhPageHdr *ph = (EhPageHdr *)(void*)page;
+    ph->used = sizeof(EhPageHdr);
+    ph->next = (uint32_t)g_eh.h.ovf_free;
+    (void)eh_put_page(true, p, page);
+    g_eh.h.ovf_free = p;
+    (void)eh_put_header();
+}
+
+// Posición de un registro: página (primaria o de desborde) y offset.
+typedef struct {
+    bool ovf;
+    uint64_t page;
+    size_t off;
+} EhPos;
+
+// Busca key en la cadena de su bucket; el registro queda en eh_page(pos).
+static bool eh_find(const char *key, EhPos *pos) {
+    size_t klen = strlen(key);
+    bool ovf = false;
+    uint64_t page = eh_bucket_of(eh_key_hash(key, klen)) + 1;
+    for (;;) {
+        const char *p = eh_page(ovf, page);
+        const EhPageHdr *ph = (const EhPageHdr *)(const void*)p;
+        for (size_t off = sizeof *ph; off + EH_REC_HDR <= ph->used;) {
+            uint8_t rk = (uint8_t)p[off];
+            uint16_t vlen;
+            memcpy(&vlen, p + off + 2, 2);
+            if (rk == klen && memcmp(p + off + EH_REC_HDR, key, klen) == 0) {
+                *pos = (EhPos){ ovf, page, off };
+                return true;
+            }
+            off += EH_REC_HDR + rk + vlen;
+        }
+        if (!ph->next) return false;
+        ovf = true;
+        page = ph->next;
+    }
+}
+
+// Datos del registro en pos (válidos hasta la próxima llamada a eh_page).
+static const char *eh_record(const EhPos *pos, uint8_t *flags, uint16_t *vlen, size_t *klen) {
+    const char *p = eh_page(pos->ovf, pos->page) + pos->off;
+    *klen = (uint8_t)p[0];
+    *flags = (uint8_t)p[1];
+    memcpy(vlen, p + 2, 2);
+    return p + EH_REC_HDR + *klen;
+}
+
+static bool eh_remove_at(const EhPos *pos) {
+    char *p = eh_page(pos->ovf, pos->page);
+    EhPageHdr *ph = (EhPageHdr *)(void*)p;
+    uint16_t vlen;
+    memcpy(&vlen, p + pos->off + 2, 2);
+    size_t len = EH_REC_HDR + (uint8_t)p[pos->off] + vlen;
+    memmove(p + pos->off, p + pos->off + len, ph->used - pos->off - len);
+    ph->used = (uint16_t)(ph->used - len);
+    memset(p + ph->used, 0, len);
+    --g_eh.h.keys;
+    g_eh.h.bytes -= len;
+    return eh_put_page(pos->ovf, pos->page, p);
+}
+
+// Agrega el registro rec[0..len) en el primer lugar libre de la cadena del bucket b.
+static bool eh_append(uint64_t b, const char *rec, size_t len) {
+    bool ovf = false;
+    uint64_t page = b + 1;
+    for (;;) {
+        char *p = eh_page(ovf, page);
+        EhPageHdr *ph = (EhPageHdr *)(void*)p;
+        if (ph->used + len <= EH_PAGE) {
+            memcpy(p + ph->used, rec, len);
+            ph->used = (uint16_t)(ph->used + len);
+            ++g_eh.h.keys;
+            g_eh.h.bytes += len;
+            return eh_put_page(ovf, page, p);
+        }
+        if (ph->next) {
+            ovf = true;
+            page = ph->next;
+            continue;
+        }
+        uint32_t np = eh_ovf_alloc();             // puede desalojar p
+        p = eh_page(ovf, page);
+        ((EhPageHdr *)(void*)p)->next = np;
+        if (!eh_put_page(ovf, page, p)) return false;
+        char *fresh = eh_page(true, np);
+        memset(fresh, 0, EH_PAGE);
+        ((EhPageHdr *)(void*)fresh)->used = sizeof(EhPageHdr);
+        ovf = true;
+        page = np;
+    }
+}
+
+// Escribe los registros recs[0..len) como la cadena completa del bucket b,
+// reusando las páginas de desborde reuse[] y liberando las que sobren.
+static bool eh_write_chain(uint64_t b, const char *recs, size_t len, const uint32_t *reuse, size_t nreuse) {
+    char page[EH_PAGE];
+    bool ovf = false, ok = true;
+    uint64_t pageno = b + 1;
+    size_t pos = 0, used_reuse = 0;
+    for (;;) {
+        memset(page, 0, sizeof page);
+        EhPageHdr *ph = (EhPageHdr *)(void*)page;
+        ph->used = sizeof *ph;
+        while (pos < len) {
+            uint16_t vlen;
+            memcpy(&vlen, recs + pos + 2, 2);
+            size_t rl = EH_REC_HDR + (uint8_t)recs[pos] + vlen;
+            if (ph->used + rl > EH_PAGE) break;
+            memcpy(page + ph->used, recs + pos, rl);
+            ph->used = (uint16_t)(ph->used + rl);
+            pos += rl;
+        }
+        if (pos < len) ph->next = used_reuse < nreuse ? reuse[used_reuse++] : eh_ovf_alloc();
+        ok = eh_put_page(ovf, pageno, page) && ok;
+        if (pos >= len) break;
+        ovf = true;
+        pageno = ph->next;
+    }
+    while (used_reuse < nreuse) eh_ovf_release(reuse[used_reuse++]);
+    return ok;
+}
+
+// Divide el bucket split en split y split + 2^level.
+static void eh_split(void) {
+    uint64_t s = g_eh.h.split, n = s + ((uint64_t)1 << g_eh.h.level);
+    Buf keep = { NULL, 0, 0, MEM_INDEX }, move = { NULL, 0, 0, MEM_INDEX };
+    uint32_t *chain = NULL;
+    size_t nchain = 0;
+    bool ok = true, ovf = false;
+    uint64_t page = s + 1;
+    while (ok) {
+        char copy[EH_PAGE];
+        memcpy(copy, eh_page(ovf, page), EH_PAGE);
+        const EhPageHdr *ph = (const EhPageHdr *)(const void*)copy;
+        for (size_t off = sizeof *ph; ok && off + EH_REC_HDR <= ph->used;) {
+            uint16_t vlen;
+            memcpy(&vlen, copy + off + 2, 2);
+            size_t klen = (uint8_t)copy[off], rl = EH_REC_HDR + klen + vlen;
+            uint64_t h = eh_key_hash(copy + off + EH_REC_HDR, klen);
+            bool to_new = (h & (((uint64_t)1 << (g_eh.h.level + 1)) - 1)) == n;
+            ok = buf_append(to_new ? &move : &keep, copy + off, rl);
+            off += rl;
+        }
+        if (!ph->next) break;
+        uint32_t *c = mem_realloc(MEM_INDEX, chain, (nchain + 1) * sizeof *chain);
+        if (!c) { ok = false; break; }
+        chain = c;
+        chain[nchain++] = ph->next;
+        ovf = true;
+        page = ph->next;
+    }
+    if (ok) {
+        // Primero el bucket nuevo y el encabezado; recién después se reescribe
+        // el viejo. Si se corta en el medio quedan copias viejas en s que
+        // ninguna búsqueda alcanza (y el recorrido las ignora).
+        ok = eh_write_chain(n, move.p, move.len, NULL, 0);
+        if (ok) {
+            if (++g_eh.h.split == ((uint64_t)1 << g_eh.h.level)) {
+                g_eh.h.split = 0;
+                ++g_eh.h.level;
+            }
+            ok = eh_put_header() && eh_write_chain(s, keep.p, keep.len, chain, nchain);
+            ++g_eh.splits;
+        }
+    }
+    if (!ok) perror("ehash: split");
+    buf_free(&keep);
+    buf_free(&move);
+    mem_free(MEM_INDEX, chain);
+}
+
+static bool eh_put(const char *key, const void *data, size_t len, bool external) {
+    EhPos pos;
+    if (eh_find(key, &pos) && !eh_remove_at(&pos)) return false;
+    char rec[EH_REC_HDR + 100 + EH_MAX_INLINE];
+    size_t klen = strlen(key);
+    uint16_t vlen = external ? 0 : (uint16_t)len;
+    rec[0] = (char)klen;
+    rec[1] = external ? EH_EXTERNAL : 0;
+    memcpy(rec + 2, &vlen, 2);
+    memcpy(rec + EH_REC_HDR, key, klen);
+    if (vlen) memcpy(rec + EH_REC_HDR + klen, data, vlen);
+    if (!eh_append(eh_bucket_of(eh_key_hash(key, klen)), rec, EH_REC_HDR + klen + vlen)) return false;
+    if ((double)g_eh.h.bytes > EH_FILL * (double)eh_buckets() * (EH_PAGE - sizeof(EhPageHdr))) eh_split();
+    return true;
+}
 
+// Abre (o crea, si create) el índice del directorio actual. Sin create y sin
+// índice, el almacenamiento sigue siendo un archivo por clave.
+static bool eh_open(bool create) {
+    int fd = open(EH_FILE, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+    if (fd < 0) return errno == ENOENT && !create;
+    int ovf_fd = open(EH_OVF_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (ovf_fd < 0) { perror(EH_OVF_FILE); close(fd); return false; }
+    EhHeader h;
+    ssize_t r = pread(fd, &h, sizeof h, 0);
+    if (r == 0) {
+        memset(&h, 0, sizeof h);
+        memcpy(h.magic, EH_MAGIC, 8);
+        h.level = EH_INIT_LEVEL;
+    } else if (r != (ssize_t)sizeof h || memcmp(h.magic, EH_MAGIC, 8) != 0) {
+        fprintf(stderr, EH_FILE ": no es un índice " EH_MAGIC "\n");
+        close(fd); close(ovf_fd);
+        return false;
+    }
+    size_t n = g_eh_cache_pages ? g_eh_cache_pages : 1;
+    size_t msize = 1;
+    while (msize < n * 2) msize <<= 1;
+    g_eh.slots = mem_alloc(MEM_INDEX, n * sizeof *g_eh.slots);
+    g_eh.map = mem_alloc(MEM_INDEX, msize * sizeof *g_eh.map);
+    char *pages = mem_alloc(MEM_INDEX, n * EH_PAGE);
+    if (!g_eh.slots || !g_eh.map || !pages) {
+        fprintf(stderr, "ehash: sin memoria para la caché de páginas\n");
+        mem_free(MEM_INDEX, g_eh.slots); mem_free(MEM_INDEX, g_eh.map); mem_free(MEM_INDEX, pages);
+        close(fd); close(ovf_fd);
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) g_eh.slots[i] = (EhSlot){ EH_NO_PAGE, false, pages + i * EH_PAGE };
+    memset(g_eh.map, 0, msize * sizeof *g_eh.map);
+    g_eh.nslots = n;
+    g_eh.mapsize = msize;
+    g_eh.hand = 0;
+    g_eh.fd = fd;
+    g_eh.ovf_fd = ovf_fd;
+    g_eh.h = h;
+    return r != 0 || eh_put_header();
+}
+
+static void eh_close(void) {
+    if (g_eh.fd < 0) return;
+    if (!eh_put_header() || fsync(g_eh.fd) != 0 || fsync(g_eh.ovf_fd) != 0) perror("ehash");
+    close(g_eh.fd);
+    close(g_eh.ovf_fd);
+    mem_free(MEM_INDEX, g_eh.slots[0].data);
+    mem_free(MEM_INDEX, g_eh.slots);
+    mem_free(MEM_INDEX, g_eh.map);
+    g_eh.fd = g_eh.ovf_fd = -1;
+}
+
+// ---------- liberación diferida (UNLINK / FLUSHALL / lápidas) ----------
+// Borrar un archivo grande o muchas claves no debe frenar el bucle. UNLINK,
+// FLUSHALL, DELPREFIX y DELRANGE sacan las claves en el momento y dejan lo
+// caro a un hilo aparte:
+// - los archivos se mueven (rename, sin tocar sus bloques) a LAZY_DIR y el
+//   hilo los borra;
+// - los valores en memoria de LAZY_FREE_MIN bytes o más se descuentan de la
+//   contabilidad en el bucle y el free() lo hace el hilo;
+// - mientras haya lápidas (ver abajo) el hilo recorre el directorio y mueve
+//   a LAZY_DIR los archivos de las claves que ocultan.
+// El hilo trabaja de a LAZY_BATCH entradas y, si la tanda tocó el disco, hace
+// una pausa de LAZY_PAUSE_US para no acaparárselo a los pedidos. Soltar
+// referencias y entradas de la caché sigue en el bucle (los contadores de
+// referencias no son atómicos), pero de a tramos (cache_retire_step).
+#define LAZY_DIR ".trash"
+#define LAZY_FREE_MIN (64u << 10)
+#define LAZY_BATCH 64
+#define LAZY_PAUSE_US 1000
+
+typedef struct {
+    pthread_mutex_t mu;        // protege todo lo que sigue salvo thread y started
+    pthread_cond_t cv;
+    pthread_t thread;
+    bool started;
+    bool stop;
+    void **blocks;             // pendientes de free()
+    size_t nblocks, capblocks;
+    size_t pending_bytes;      // memoria en blocks
+    uint64_t names;            // nombres usados en LAZY_DIR
+    uint64_t trash_gen;        // sube con cada archivo movido a LAZY_DIR
+    uint64_t trash_done;       // generación que el hilo ya vació
+    bool scan;                 // hay lápidas sin recorrer
+    uint64_t scan_done;        // lápida más nueva cubierta por una pasada limpia
+    uint64_t freed_bytes, freed_files, freed_disk, scan_moved;
+} Lazy;
+
+static Lazy g_lazy = { .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER };
+
+// Lápidas: DELPREFIX, DELRANGE y FLUSHALL (el prefijo vacío) no borran clave
+// por clave sino que anotan una lápida que oculta en el momento las claves
+// que cubre. Una clave escrita después vuelve a existir: g_fresh guarda, para
+// las claves que se escriben mientras hay lápidas, el número de la última
+// lápida de ese momento, y una clave está oculta si la cubre alguna lápida
+// más nueva que eso. Tanto las lápidas como g_fresh los modifica sólo el
+// bucle, con g_lazy.mu tomado; el hilo los consulta con el mutex.
+#define TOMB_MAX 64
+
+typedef struct {
+    uint64_t id;               // orden de creación
+    bool range;                // false: prefijo (en lo)
+    size_t lo_len;
+    char lo[100];
+    char hi[100];              // rango [lo, hi)
+} Tombstone;
+
+typedef struct {
+    char *key;                 // NULL: libre
+    uint64_t id;
+} FreshKey;
+
+static Tombstone g_tombs[TOMB_MAX];    // en orden de id
+static size_t g_ntombs = 0;
+static uint64_t g_tomb_last = 0;       // id de la lápida más nueva creada
+static FreshKey *g_fresh = NULL;       // abierta, sin borrados
+static size_t g_fresh_cap = 0, g_fresh_count = 0;
+
+static size_t fresh_slot(const char *key) {
+    size_t mask = g_fresh_cap - 1;
+    size_t i = (size_t)hash_bytes(key, strlen(key), 0) & mask;
+    while (g_fresh[i].key && strcmp(g_fresh[i].key, key) != 0) i = (i + 1) & mask;
+    return i;
+}
+
+// Con g_lazy.mu tomado.
+static void fresh_clear(void) {
+    for (size_t i = 0; i < g_fresh_cap; ++i) mem_free(MEM_KEYS, g_fresh[i].key);
+    mem_free(MEM_INDEX, g_fresh);
+    g_fresh = NULL;
+    g_fresh_cap = g_fresh_count = 0;
+}
+
+static bool tomb_covers(const Tombstone *t, const char *key) {
+    if (!t->range) return strncmp(key, t->lo, t->lo_len) == 0;
+    return strcmp(key, t->lo) >= 0 && strcmp(key, t->hi) < 0;
+}
+
+// true si una lápida oculta key.
+static bool key_hidden(const char *key) {
+    if (g_ntombs == 0) return false;
+    uint64_t seen = 0;
+    if (g_fresh_count > 0) {
+        size_t i = fresh_slot(key);
+        if (g_fresh[i].key) seen = g_fresh[i].id;
+    }
+    for (size_t i = g_ntombs; i-- > 0 && g_tombs[i].id > seen;)
+        if (tomb_covers(&g_tombs[i], key)) return true;
+    return false;
+}
+
+// Con g_lazy.mu tomado: mueve path a LAZY_DIR.
+static int lazy_move(const char *path) {
+    char dst[64];
+    (void)snprintf(dst, sizeof dst, LAZY_DIR "/%ld-%llu", (long)getpid(), (unsigned long long)++g_lazy.names);
+    if (rename(path, dst) != 0) return -1;
+    ++g_lazy.trash_gen;
+    pthread_cond_signal(&g_lazy.cv);
     return 0;
 }
 
-// ---------- handlers ----------
-static void handle_set(const Request *req, char *response, size_t cap) {
-    if (!clave_valida(req->key)) {
-        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+// Borra path: lo mueve a LAZY_DIR para el hilo (o lo borra acá si no hay hilo).
+static int lazy_unlink(const char *path) {
+    if (g_lazy.started) {
+        pthread_mutex_lock(&g_lazy.mu);
+        int r = lazy_move(path);
+        pthread_mutex_unlock(&g_lazy.mu);
+        if (r == 0 || errno == ENOENT) return r;
+    }
+    return unlink(path);
+}
+
+// mem_free() con el free() a cargo del hilo.
+static void lazy_free(MemCategory cat, void *p) {
+    if (!p) return;
+    size_t n = malloc_usable_size(p);
+    if (g_lazy.started) {
+        pthread_mutex_lock(&g_lazy.mu);
+        bool queued = true;
+        if (g_lazy.nblocks == g_lazy.capblocks) {
+            size_t cap = g_lazy.capblocks ? g_lazy.capblocks * 2 : 64;
+            void **b = mem_realloc(MEM_OTHER, g_lazy.blocks, cap * sizeof *b);
+            if (b) { g_lazy.blocks = b; g_lazy.capblocks = cap; }
+            else queued = false;
+        }
+        if (queued) {
+            g_lazy.blocks[g_lazy.nblocks++] = p;
+            g_lazy.pending_bytes += n;
+            pthread_cond_signal(&g_lazy.cv);
+        }
+        pthread_mutex_unlock(&g_lazy.mu);
+        if (queued) {
+            g_mem_used[cat] -= n;
+            return;
+        }
+    }
+    mem_free(cat, p);
+}
+
+// Con g_lazy.mu tomado: key fue escrita después de la lápida id. false sin memoria.
+static bool fresh_put(const char *key, uint64_t id) {
+    if (g_fresh_cap && g_fresh[fresh_slot(key)].key) {
+        g_fresh[fresh_slot(key)].id = id;
+        return true;
+    }
+    if (g_fresh_count * 2 >= g_fresh_cap) {
+        size_t n = g_fresh_cap ? g_fresh_cap * 2 : 1024;
+        FreshKey *t = mem_alloc(MEM_INDEX, n * sizeof *t);
+        if (!t) return false;
+        memset(t, 0, n * sizeof *t);
+        FreshKey *old = g_fresh;
+        size_t oldcap = g_fresh_cap;
+        g_fresh = t;
+        g_fresh_cap = n;
+        for (size_t i = 0; i < oldcap; ++i)
+            if (old[i].key) g_fresh[fresh_slot(old[i].key)] = old[i];
+        mem_free(MEM_INDEX, old);
+    }
+    char *k = mem_alloc(MEM_KEYS, strlen(key) + 1);
+    if (!k) return false;
+    strcpy(k, key);
+    g_fresh[fresh_slot(key)] = (FreshKey){ k, id };
+    ++g_fresh_count;
+    return true;
+}
+
+// Antes de escribir key: si una lápida la oculta, pasa a existir de nuevo y
+// su archivo viejo, si el hilo todavía no lo movió, se va a LAZY_DIR.
+// false sin memoria.
+static bool tomb_note_write(const char *key) {
+    if (!key_hidden(key)) return true;
+    pthread_mutex_lock(&g_lazy.mu);
+    bool ok = fresh_put(key, g_tomb_last);
+    pthread_mutex_unlock(&g_lazy.mu);
+    if (ok) (void)lazy_unlink(key);
+    return ok;
+}
+
+// Del hilo (o del bucle, sin hilo): un tramo del recorrido del directorio.
+// Cada pasada cubre las lápidas que había al empezarla; una pasada que no
+// mueve nada las da por terminadas (g_lazy.scan_done). true si no queda
+// ninguna por recorrer.
+static bool tomb_scan_step(void) {
+    static DIR *dir = NULL;
+    static size_t pass_moved = 0;
+    static uint64_t pass_tomb = 0;
+    if (!dir) {
+        if (!(dir = opendir("."))) return false;
+        pthread_mutex_lock(&g_lazy.mu);
+        pass_tomb = g_tomb_last;
+        pthread_mutex_unlock(&g_lazy.mu);
+        pass_moved = 0;
+    }
+    for (int n = 0; n < LAZY_BATCH; ++n) {
+        struct dirent *de = readdir(dir);
+        if (!de) {
+            closedir(dir);
+            dir = NULL;
+            pthread_mutex_lock(&g_lazy.mu);
+            if (pass_moved == 0 && pass_tomb > g_lazy.scan_done) g_lazy.scan_done = pass_tomb;
+            bool done = g_lazy.scan_done == g_tomb_last;
+            pthread_mutex_unlock(&g_lazy.mu);
+            return done;
+        }
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+        if (!clave_valida(de->d_name)) continue;
+        pthread_mutex_lock(&g_lazy.mu);
+        bool moved = key_hidden(de->d_name) &&
+                     (g_lazy.started ? lazy_move(de->d_name) : unlink(de->d_name)) == 0;
+        if (moved) ++g_lazy.scan_moved;
+        pthread_mutex_unlock(&g_lazy.mu);
+        if (moved) ++pass_moved;
+    }
+    return false;
+}
+
+// Del hilo: borra hasta LAZY_BATCH archivos de LAZY_DIR. true al terminar una
+// pasada completa; *gen es la generación que había al empezarla (todo lo
+// movido hasta ahí quedó borrado).
+static bool lazy_empty_trash(uint64_t *gen, uint64_t *files, uint64_t *disk) {
+    static DIR *dir = NULL;
+    static uint64_t dir_gen = 0;
+    if (!dir) {
+        pthread_mutex_lock(&g_lazy.mu);
+        dir_gen = g_lazy.trash_gen;
+        pthread_mutex_unlock(&g_lazy.mu);
+        if (!(dir = opendir(LAZY_DIR))) { *gen = dir_gen; return true; }
+    }
+    for (int n = 0; n < LAZY_BATCH; ++n) {
+        struct dirent *de = readdir(dir);
+        if (!de) {
+            closedir(dir);
+            dir = NULL;
+            *gen = dir_gen;
+            return true;
+        }
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (unlinkat(dirfd(dir), de->d_name, 0) != 0) continue;
+        ++*files;
+        if (st.st_nlink <= 1) *disk += (uint64_t)st.st_blocks * 512;   // con --dedup puede seguir enlazado
+    }
+    return false;
+}
+
+// Al cerrar espera la memoria pendiente; el recorrido sigue en el próximo
+// arranque (las lápidas se guardan) y lo que quede en LAZY_DIR se borra ahí.
+static void *lazy_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_lazy.mu);
+    for (;;) {
+        while (!g_lazy.stop && g_lazy.nblocks == 0 && !g_lazy.scan && g_lazy.trash_done == g_lazy.trash_gen)
+            pthread_cond_wait(&g_lazy.cv, &g_lazy.mu);
+        if (g_lazy.stop && g_lazy.nblocks == 0) break;
+        void *batch[LAZY_BATCH];
+        size_t n = 0, bytes = 0;
+        while (n < LAZY_BATCH && g_lazy.nblocks > 0) batch[n++] = g_lazy.blocks[--g_lazy.nblocks];
+        bool scan = !g_lazy.stop && g_lazy.scan;
+        bool trash = !g_lazy.stop && g_lazy.trash_done != g_lazy.trash_gen;
+        uint64_t moved_before = g_lazy.scan_moved;
+        pthread_mutex_unlock(&g_lazy.mu);
+
+        for (size_t i = 0; i < n; ++i) {
+            bytes += malloc_usable_size(batch[i]);
+            free(batch[i]);
+        }
+        bool scanned = scan && tomb_scan_step();
+        uint64_t gen = 0, files = 0, disk = 0;
+        bool emptied = trash && lazy_empty_trash(&gen, &files, &disk);
+
+        pthread_mutex_lock(&g_lazy.mu);
+        bool touched = files > 0 || g_lazy.scan_moved != moved_before;
+        g_lazy.pending_bytes -= bytes;
+        g_lazy.freed_bytes += bytes;
+        g_lazy.freed_files += files;
+        g_lazy.freed_disk += disk;
+        if (emptied && gen > g_lazy.trash_done) g_lazy.trash_done = gen;
+        if (scanned && g_lazy.scan_done == g_tomb_last) g_lazy.scan = false;
+        if (touched && !g_lazy.stop) {
+            pthread_mutex_unlock(&g_lazy.mu);
+            struct timespec pause = { 0, LAZY_PAUSE_US * 1000L };
+            (void)nanosleep(&pause, NULL);
+            pthread_mutex_lock(&g_lazy.mu);
+        }
+    }
+    pthread_mutex_unlock(&g_lazy.mu);
+    return NULL;
+}
+
+// Arranca el hilo (modo servidor). Lo que haya quedado en LAZY_DIR de una
+// ejecución anterior se borra de entrada. Sin hilo todo se libera en el momento.
+static void lazy_start(void) {
+    if (mkdir(LAZY_DIR, 0777) != 0 && errno != EEXIST) {
+        perror(LAZY_DIR);
+        return;
+    }
+    g_lazy.trash_gen = 1;
+    int r = pthread_create(&g_lazy.thread, NULL, lazy_main, NULL);
+    if (r != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(r));
+        return;
+    }
+    g_lazy.started = true;
+}
+
+static void lazy_stop(void) {
+    if (g_lazy.started) {
+        pthread_mutex_lock(&g_lazy.mu);
+        g_lazy.stop = true;
+        pthread_cond_signal(&g_lazy.cv);
+        pthread_mutex_unlock(&g_lazy.mu);
+        (void)pthread_join(g_lazy.thread, NULL);
+        g_lazy.started = false;
+    }
+    mem_free(MEM_OTHER, g_lazy.blocks);
+    g_lazy.blocks = NULL;
+    g_lazy.capblocks = 0;
+}
+
+// ---------- almacenamiento: puntos de entrada ----------
+// Todo el resto del servidor pasa por acá; con el índice abierto los valores
+// chicos viven en sus páginas y los grandes en el archivo de la clave.
+
+// 0 ok; -1 error
+static int store_write(const char *key, const void *data, size_t len) {
+    if (!tomb_note_write(key)) return -1;
+    if (g_eh.fd < 0) return file_write(key, data, len);
+    bool external = len > EH_MAX_INLINE;
+    if (external && file_write(key, data, len) != 0) return -1;
+    EhPos pos;
+    bool was_external = false;
+    if (!external && eh_find(key, &pos)) {
+        uint8_t flags; uint16_t vlen; size_t klen;
+        (void)eh_record(&pos, &flags, &vlen, &klen);
+        was_external = flags & EH_EXTERNAL;
+    }
+    if (!eh_put(key, data, len, external)) return -1;
+    if (was_external) (void)unlink(key);
+    return 0;
+}
+
+// Bytes leídos (hasta cap); -1 si la clave no existe
+static ssize_t store_read(const char *key, void *buf, size_t cap) {
+    if (key_hidden(key)) return -1;
+    if (g_eh.fd < 0) return file_read(key, buf, cap);
+    EhPos pos;
+    if (!eh_find(key, &pos)) return -1;
+    uint8_t flags; uint16_t vlen; size_t klen;
+    const char *v = eh_record(&pos, &flags, &vlen, &klen);
+    if (flags & EH_EXTERNAL) return file_read(key, buf, cap);
+    size_t n = vlen < cap ? vlen : cap;
+    if (n) memcpy(buf, v, n);
+    return (ssize_t)n;
+}
+
+// Largo del valor; -1 si la clave no existe.
+static ssize_t store_size(const char *key) {
+    struct stat st;
+    if (key_hidden(key)) return -1;
+    if (g_eh.fd >= 0) {
+        EhPos pos;
+        if (!eh_find(key, &pos)) return -1;
+        uint8_t flags; uint16_t vlen; size_t klen;
+        (void)eh_record(&pos, &flags, &vlen, &klen);
+        if (!(flags & EH_EXTERNAL)) return vlen;
+    }
+    return stat(key, &st) == 0 ? (ssize_t)st.st_size : -1;
+}
+
+// Bytes que ocupa en disco: bloques del archivo, o el registro en su página
+// (más el archivo aparte si el valor es grande). -1 si la clave no existe.
+static ssize_t store_disk_usage(const char *key) {
+    struct stat st;
+    ssize_t bytes = 0;
+    if (key_hidden(key)) return -1;
+    if (g_eh.fd >= 0) {
+        EhPos pos;
+        if (!eh_find(key, &pos)) return -1;
+        uint8_t flags; uint16_t vlen; size_t klen;
+        (void)eh_record(&pos, &flags, &vlen, &klen);
+        bytes = (ssize_t)(EH_REC_HDR + klen + vlen);
+        if (!(flags & EH_EXTERNAL)) return bytes;
+    }
+    return stat(key, &st) == 0 ? bytes + (ssize_t)st.st_blocks * 512 : -1;
+}
+
+// Descriptor del valor (para sendfile); sólo para valores en su propio
+// archivo: con el índice, los valores en página son chicos y nunca llegan acá.
+static int store_open(const char *key, size_t *size) {
+    if (key_hidden(key)) return -1;
+    return file_open(key, size);
+}
+
+// lazy (UNLINK): el archivo se borra en el hilo de liberación diferida.
+// No mira las lápidas (las usa el recorrido que borra lo que ocultan).
+static int store_erase(const char *key, bool lazy) {
+    int (*rm)(const char *) = lazy ? lazy_unlink : unlink;
+    if (g_eh.fd < 0) return rm(key);
+    EhPos pos;
+    if (!eh_find(key, &pos)) return -1;
+    uint8_t flags; uint16_t vlen; size_t klen;
+    (void)eh_record(&pos, &flags, &vlen, &klen);
+    bool external = flags & EH_EXTERNAL;
+    if (!eh_remove_at(&pos)) return -1;
+    if (external) (void)rm(key);
+    return 0;
+}
+
+static int store_remove(const char *key, bool lazy) {
+    if (key_hidden(key)) return -1;
+    return store_erase(key, lazy);
+}
+
+// FLUSHALL: con el índice, el índice entero pasa a LAZY_DIR (sin volcarlo) y
+// se empieza uno vacío; los archivos de los valores grandes quedan para el
+// recorrido del hilo. Con archivos sueltos no hay nada que hacer acá.
+static bool store_discard(void) {
+    if (g_eh.fd < 0) return true;
+    close(g_eh.fd);
+    close(g_eh.ovf_fd);
+    mem_free(MEM_INDEX, g_eh.slots[0].data);
+    mem_free(MEM_INDEX, g_eh.slots);
+    mem_free(MEM_INDEX, g_eh.map);
+    g_eh.fd = g_eh.ovf_fd = -1;
+    if (lazy_unlink(EH_FILE) != 0 || lazy_unlink(EH_OVF_FILE) != 0) perror("ehash");
+    if (eh_open(true)) return true;
+    perror(EH_FILE);
+    return false;
+}
+
+// Recorrido de todas las claves del almacenamiento.
+typedef struct {
+    DIR *dir;
+    bool all;                  // también las claves ocultas por una lápida
+    uint64_t bucket;           // índice: bucket, página y offset actuales
+    bool ovf;
+    uint64_t page;
+    size_t off;
+} StoreIter;
+
+static bool store_iter_open(StoreIter *it) {
+    *it = (StoreIter){ .dir = NULL, .all = false, .bucket = 0, .ovf = false, .page = 1, .off = sizeof(EhPageHdr) };
+    if (g_eh.fd >= 0) return true;
+    it->dir = opendir(".");
+    return it->dir != NULL;
+}
+
+// Copia en key (cap >= 100) la siguiente clave; false al terminar.
+static bool store_iter_next(StoreIter *it, char *key, size_t cap) {
+    if (g_eh.fd >= 0) {
+        while (it->bucket < eh_buckets()) {
+            const char *p = eh_page(it->ovf, it->page);
+            const EhPageHdr *ph = (const EhPageHdr *)(const void*)p;
+            if (it->off + EH_REC_HDR > ph->used) {
+                if (ph->next) {
+                    it->ovf = true;
+                    it->page = ph->next;
+                } else {
+                    ++it->bucket;
+                    it->ovf = false;
+                    it->page = it->bucket + 1;
+                }
+                it->off = sizeof *ph;
+                continue;
+            }
+            size_t klen = (uint8_t)p[it->off];
+            uint16_t vlen;
+            memcpy(&vlen, p + it->off + 2, 2);
+            const char *k = p + it->off + EH_REC_HDR;
+            it->off += EH_REC_HDR + klen + vlen;
+            // restos de una división interrumpida: su bucket ya es otro
+            if (klen >= cap || eh_bucket_of(eh_key_hash(k, klen)) != it->bucket) continue;
+            memcpy(key, k, klen);
+            key[klen] = '\0';
+            if (!it->all && key_hidden(key)) continue;
+            return true;
+        }
+        return false;
+    }
+    struct dirent *de;
+    while ((de = readdir(it->dir)) != NULL) {
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) continue;
+        if (strlen(de->d_name) >= cap || !clave_valida(de->d_name)) continue;
+        if (!it->all && key_hidden(de->d_name)) continue;
+        memcpy(key, de->d_name, strlen(de->d_name) + 1);
+        return true;
+    }
+    return false;
+}
+
+// Vuelve al principio del bucket actual. Un recorrido que se reanuda después
+// de otras escrituras (EXPORT) lo llama antes de seguir: un borrado en la
+// misma página corre los registros que quedan y podría saltearse alguno.
+static void store_iter_rewind(StoreIter *it) {
+    if (g_eh.fd < 0) return;
+    it->ovf = false;
+    it->page = it->bucket + 1;
+    it->off = sizeof(EhPageHdr);
+}
+
+static void store_iter_close(StoreIter *it) {
+    if (it->dir) closedir(it->dir);
+    it->dir = NULL;
+}
+
+// ---------- borrado por rangos (lápidas) ----------
+// Las lápidas (ver liberación diferida) se guardan en TOMB_FILE al crearse y
+// al terminar, así que un reinicio no devuelve las claves borradas. Al cerrar
+// se guarda también g_fresh; si el servidor se cae, al arrancar se pierden
+// las claves del rango escritas después de la lápida y antes de la caída.
+// Con el índice, además del recorrido del directorio (que sólo encuentra los
+// valores grandes), el bucle recorre sus registros de a TOMB_SWEEP_STEP por
+// vuelta. Una lápida termina cuando los dos recorridos tuvieron una pasada
+// limpia posterior a ella.
+#define TOMB_FILE ".tombstones"
+#define TOMB_SWEEP_STEP 256
+
+typedef struct {
+    bool open;
+    StoreIter it;
+    uint64_t pass_tomb;        // lápida más nueva al empezar la pasada
+    size_t erased;             // registros borrados en la pasada
+    uint64_t done;             // lápida más nueva cubierta por una pasada limpia
+} TombSweep;
+
+static TombSweep g_tsweep = { .open = false };
+static uint64_t g_tombs_created = 0, g_tombs_done = 0, g_tomb_erased = 0, g_flushes = 0;
+
+// Una línea por lápida: "P <id> <prefijo>" o "R <id> <desde> <hasta>"; con
+// fresh, además "K <id> <clave>" por cada clave de g_fresh.
+static void tomb_save(bool fresh) {
+    if (g_ntombs == 0) {
+        if (unlink(TOMB_FILE) != 0 && errno != ENOENT) perror(TOMB_FILE);
+        return;
+    }
+    FILE *fp = fopen(TOMB_FILE ".tmp", "w");
+    if (!fp) { perror(TOMB_FILE); return; }
+    for (size_t i = 0; i < g_ntombs; ++i) {
+        const Tombstone *t = &g_tombs[i];
+        if (t->range) fprintf(fp, "R %llu %s %s\n", (unsigned long long)t->id, t->lo, t->hi);
+        else          fprintf(fp, "P %llu %s\n", (unsigned long long)t->id, t->lo);
+    }
+    for (size_t i = 0; fresh && i < g_fresh_cap; ++i)
+        if (g_fresh[i].key) fprintf(fp, "K %llu %s\n", (unsigned long long)g_fresh[i].id, g_fresh[i].key);
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(TOMB_FILE ".tmp", TOMB_FILE) != 0) {
+        perror(TOMB_FILE);
+        (void)unlink(TOMB_FILE ".tmp");
+    }
+}
+
+static bool tomb_load(void) {
+    FILE *fp = fopen(TOMB_FILE, "r");
+    if (!fp) return errno == ENOENT;
+    char line[256];
+    while (fgets(line, sizeof line, fp)) {
+        char kind;
+        unsigned long long id;
+        char a[100] = "", b[100] = "";
+        int n = sscanf(line, "%c %llu %99s %99s", &kind, &id, a, b);
+        if (n < 2) continue;
+        if ((kind == 'P' || kind == 'R') && g_ntombs < TOMB_MAX && (kind == 'P' || n == 4)) {
+            Tombstone *t = &g_tombs[g_ntombs++];
+            *t = (Tombstone){ .id = id, .range = kind == 'R', .lo_len = strlen(a) };
+            memcpy(t->lo, a, sizeof t->lo);
+            memcpy(t->hi, b, sizeof t->hi);
+            if (id > g_tomb_last) g_tomb_last = id;
+        } else if (kind == 'K' && n >= 3 && !fresh_put(a, id)) {
+            fclose(fp);
+            fprintf(stderr, TOMB_FILE ": sin memoria\n");
+            return false;
+        }
+    }
+    fclose(fp);
+    g_lazy.scan = g_ntombs > 0;
+    if (g_ntombs) printf("Borrados por rango pendientes: %zu\n", g_ntombs);
+    return true;
+}
+
+// Anota una lápida (prefijo en lo, o el rango [lo, hi)). El prefijo vacío
+// (FLUSHALL) cubre a todas las anteriores y las reemplaza. false si ya hay
+// TOMB_MAX (errno = EAGAIN).
+static bool tomb_add(bool range, const char *lo, const char *hi) {
+    bool all = !range && lo[0] == '\0';
+    if (!all && g_ntombs == TOMB_MAX) { errno = EAGAIN; return false; }
+    pthread_mutex_lock(&g_lazy.mu);
+    if (all) {
+        g_ntombs = 0;
+        fresh_clear();
+    }
+    Tombstone *t = &g_tombs[g_ntombs++];
+    *t = (Tombstone){ .id = ++g_tomb_last, .range = range, .lo_len = strlen(lo) };
+    (void)snprintf(t->lo, sizeof t->lo, "%s", lo);
+    (void)snprintf(t->hi, sizeof t->hi, "%s", range ? hi : "");
+    g_lazy.scan = true;
+    pthread_cond_signal(&g_lazy.cv);
+    pthread_mutex_unlock(&g_lazy.mu);
+    ++g_tombs_created;
+    tomb_save(false);
+    return true;
+}
+
+static void tomb_sweep_reset(void) {
+    if (g_tsweep.open) store_iter_close(&g_tsweep.it);
+    g_tsweep.open = false;
+}
+
+// Con el índice: un tramo del recorrido de sus registros.
+static void tomb_sweep_step(void) {
+    if (g_eh.fd < 0 || g_tsweep.done == g_tomb_last) return;
+    if (!g_tsweep.open) {
+        if (!store_iter_open(&g_tsweep.it)) return;
+        g_tsweep.it.all = true;
+        g_tsweep.open = true;
+        g_tsweep.pass_tomb = g_tomb_last;
+        g_tsweep.erased = 0;
+    }
+    char key[100];
+    for (int n = 0; n < TOMB_SWEEP_STEP; ++n) {
+        if (!store_iter_next(&g_tsweep.it, key, sizeof key)) {
+            tomb_sweep_reset();
+            if (g_tsweep.erased == 0) g_tsweep.done = g_tsweep.pass_tomb;
+            return;
+        }
+        if (!key_hidden(key)) continue;
+        if (store_erase(key, true) == 0) {
+            ++g_tsweep.erased;
+            ++g_tomb_erased;
+        }
+        store_iter_rewind(&g_tsweep.it);         // el borrado corrió los registros de la página
+    }
+}
+
+// Queda un recorrido del índice por hacer: el bucle no se duerme.
+static bool tomb_sweeping(void) {
+    return g_ntombs > 0 && g_eh.fd >= 0 && g_tsweep.done != g_tomb_last;
+}
+
+// Una vez por vuelta del bucle (y en reposo): avanza el recorrido del índice
+// y quita las lápidas ya cubiertas por los dos recorridos.
+static void tomb_tick(void) {
+    if (g_ntombs == 0) return;
+    tomb_sweep_step();
+    if (!g_lazy.started && g_lazy.scan && tomb_scan_step()) g_lazy.scan = false;   // sin hilo
+    uint64_t done = g_eh.fd >= 0 ? g_tsweep.done : g_tomb_last;
+    pthread_mutex_lock(&g_lazy.mu);
+    if (g_lazy.scan_done < done) done = g_lazy.scan_done;
+    size_t k = 0;
+    while (k < g_ntombs && g_tombs[k].id <= done) ++k;
+    if (k > 0) {
+        memmove(g_tombs, g_tombs + k, (g_ntombs - k) * sizeof *g_tombs);
+        g_ntombs -= k;
+        if (g_ntombs == 0) fresh_clear();
+    }
+    pthread_mutex_unlock(&g_lazy.mu);
+    if (k > 0) {
+        g_tombs_done += k;
+        tomb_save(false);
+    }
+}
+
+// Sin hilo (import): termina los borrados pendientes antes de escribir.
+static void tomb_finish(void) {
+    while (g_ntombs > 0) tomb_tick();
+}
+
+// Al cerrar (con el hilo ya detenido): guarda lo pendiente con g_fresh.
+static void tomb_shutdown(void) {
+    tomb_sweep_reset();
+    tomb_tick();
+    tomb_save(true);
+    pthread_mutex_lock(&g_lazy.mu);
+    fresh_clear();
+    g_ntombs = 0;
+    pthread_mutex_unlock(&g_lazy.mu);
+}
+
+// ---------- dataset de solo lectura ----------
+// Con --ro-dataset=ARCHIVO el servidor sirve un archivo armado con
+// "server2 build-ro" en lugar del directorio. El archivo se mapea completo y
+// cada GET es un hash de la clave más una lectura del desplazamiento de su
+// bucket y otra de su ranura (hash perfecto mínimo CHD, "hash and
+// displace"); la respuesta sale directo del mapeo. SET/DEL responden error.
+// RELOAD vuelve a mapear el archivo: quien lo regenera lo reemplaza con
+// rename() y las respuestas en vuelo mantienen vivo el mapeo anterior.
+//
+// Formato (little endian):
+//   RoHeader
+//   u32 disp[nbuckets]          desplazamiento de cada bucket
+//   u64 slot[nkeys]             offset del registro de cada ranura (alineado a 8)
+//   registros                   u32 klen, u32 vlen, clave, "OK\n", valor, "\n"
+#define RO_MAGIC "KVRO0001"
+#define RO_REPLY_EXTRA 4           // "OK\n" antes del valor y "\n" después
+
+typedef struct {
+    char magic[8];
+    uint64_t nkeys;
+    uint64_t nbuckets;
+    uint64_t seed;
+    uint64_t size;                 // tamaño total del archivo
+} RoHeader;
+
+typedef struct RoSet {
+    uint32_t refs;
+    const char *map;
+    size_t size;
+    uint64_t nkeys, nbuckets, seed;
+    const uint32_t *disp;
+    const uint64_t *slot;
+} RoSet;
+
+static RoSet *g_ro = NULL;
+static uint64_t g_ro_reloads = 0;
+
+static uint64_t ro_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t ro_bucket(uint64_t h, uint64_t nbuckets) {
+    return (h >> 32) % nbuckets;
+}
+
+static uint64_t ro_slot(uint64_t h, uint32_t disp, uint64_t nkeys) {
+    return ro_mix(h ^ ((uint64_t)disp * 0x9e3779b97f4a7c15ULL)) % nkeys;
+}
+
+static size_t ro_slot_offset(uint64_t nbuckets) {
+    return (sizeof(RoHeader) + nbuckets * sizeof(uint32_t) + 7) & ~(size_t)7;
+}
+
+// Mapea y valida el encabezado; NULL (con mensaje) si el archivo no sirve.
+static RoSet *ro_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { perror(path); return NULL; }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RoHeader)) {
+        fprintf(stderr, "%s: dataset vacío o ilegible\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); return NULL; }
+
+    RoHeader h;
+    memcpy(&h, map, sizeof h);
+    bool ok = memcmp(h.magic, RO_MAGIC, 8) == 0 && h.size == size && (h.nkeys == 0 || h.nbuckets > 0) &&
+              h.nbuckets <= size / sizeof(uint32_t) && h.nkeys <= size / sizeof(uint64_t) &&
+              ro_slot_offset(h.nbuckets) + h.nkeys * sizeof(uint64_t) <= size;
+    RoSet *ro = ok ? mem_alloc(MEM_OTHER, sizeof *ro) : NULL;
+    if (!ro) {
+        if (!ok) fprintf(stderr, "%s: no es un dataset " RO_MAGIC "\n", path);
+        munmap((void*)map, size);
+        return NULL;
+    }
+    *ro = (RoSet){ .refs = 1, .map = map, .size = size, .nkeys = h.nkeys, .nbuckets = h.nbuckets, .seed = h.seed,
+                   .disp = (const uint32_t *)(map + sizeof(RoHeader)),
+                   .slot = (const uint64_t *)(map + ro_slot_offset(h.nbuckets)) };
+    return ro;
+}
+
+static RoSet *ro_ref(RoSet *ro) {
+    ++ro->refs;
+    return ro;
+}
+
+static void ro_unref(RoSet *ro) {
+    if (!ro || --ro->refs > 0) return;
+    munmap((void*)ro->map, ro->size);
+    mem_free(MEM_OTHER, ro);
+}
+
+// Respuesta armada ("OK\n" valor "\n") de key y el largo del valor; NULL si no está.
+static const char *ro_find(const RoSet *ro, const char *key, uint32_t *len) {
+    if (ro->nkeys == 0) return NULL;
+    size_t klen = strlen(key);
+    uint64_t h = hash_bytes(key, klen, ro->seed);
+    uint64_t off = ro->slot[ro_slot(h, ro->disp[ro_bucket(h, ro->nbuckets)], ro->nkeys)];
+    if (off > ro->size - 8) return NULL;
+    uint32_t hdr[2];
+    memcpy(hdr, ro->map + off, sizeof hdr);
+    if (hdr[0] != klen || (uint64_t)hdr[0] + hdr[1] + RO_REPLY_EXTRA > ro->size - off - 8) return NULL;
+    if (memcmp(ro->map + off + 8, key, klen) != 0) return NULL;
+    *len = hdr[1];
+    return ro->map + off + 8 + klen;
+}
+
+// ---------- valores en memoria ----------
+// Los valores son buffers inmutables con contador de referencias: la caché
+// guarda una referencia y cada respuesta en vuelo otra, así un SET reemplaza
+// el buffer de la caché sin tocar el que todavía se está enviando.
+// wire es la respuesta nativa ya armada: "OK\n" <valor> "\n"; apunta a data
+// o, para los valores de un dataset de solo lectura, al mapeo del archivo.
+#define VALUE_HDR 3
+
+typedef struct {
+    uint32_t refs;
+    uint32_t len;          // largo del valor (sin "OK\n" ni "\n")
+    const char *wire;
+    RoSet *ro;             // dueño de wire cuando no es data
+    uint32_t keys;         // entradas de la caché que lo usan (más de una con --dedup)
+    bool interned;         // está en la tabla de deduplicación
+    bool lazy;             // al soltarse, el free() lo hace el hilo (UNLINK/FLUSHALL)
+    char data[];
+} Value;
+
+// p == NULL deja el valor sin inicializar (para leerlo directo de un archivo).
+static Value *value_new(const void *p, size_t len) {
+    if (len > UINT32_MAX - VALUE_HDR - 1) return NULL;
+    Value *v = mem_alloc(MEM_VALUES, sizeof *v + VALUE_HDR + len + 1);
+    if (!v) return NULL;
+    v->refs = 1;
+    v->len = (uint32_t)len;
+    v->wire = v->data;
+    v->ro = NULL;
+    v->keys = 0;
+    v->interned = false;
+    v->lazy = false;
+    memcpy(v->data, "OK\n", VALUE_HDR);
+    if (p && len) memcpy(v->data + VALUE_HDR, p, len);
+    v->data[VALUE_HDR + len] = '\n';
+    return v;
+}
+
+// Valor que apunta a un registro de ro (sin copiarlo).
+static Value *value_borrow(RoSet *ro, const char *wire, uint32_t len) {
+    Value *v = mem_alloc(MEM_VALUES, sizeof *v);
+    if (!v) return NULL;
+    *v = (Value){ .refs = 1, .len = len, .wire = wire, .ro = ro_ref(ro) };
+    return v;
+}
+
+static const char *value_bytes(const Value *v) {
+    return v->wire + VALUE_HDR;
+}
+
+static Value *value_ref(Value *v) {
+    ++v->refs;
+    return v;
+}
+
+// Deduplicación en memoria (--dedup): tabla abierta contenido -> Value de
+// los valores de al menos g_cfg.dedup_min bytes. No guarda referencias: un
+// valor sale de la tabla cuando se libera.
+typedef struct {
+    uint64_t h;
+    Value *v;              // NULL: libre
+} DedupSlot;
+
+static DedupSlot *g_dedup = NULL;
+static size_t g_dedup_cap = 0, g_dedup_count = 0;
+static uint64_t g_dedup_mem_hits = 0;
+static size_t g_dedup_mem_saved = 0;     // bytes que se cargarían de más sin compartir
+
+static void dedup_forget(Value *v) {
+    uint64_t h = content_hash(value_bytes(v), v->len);
+    size_t mask = g_dedup_cap - 1, i = h & mask;
+    while (g_dedup[i].v != v) i = (i + 1) & mask;
+    // borrado con corrimiento hacia atrás (sin lápidas)
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (!g_dedup[j].v) break;
+        size_t home = g_dedup[j].h & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            g_dedup[i] = g_dedup[j];
+            i = j;
+        }
+    }
+    g_dedup[i] = (DedupSlot){ 0, NULL };
+    --g_dedup_count;
+}
+
+static void value_unref(Value *v) {
+    if (!v || --v->refs > 0) return;
+    if (v->interned) dedup_forget(v);
+    ro_unref(v->ro);
+    if (v->lazy) lazy_free(MEM_VALUES, v);
+    else mem_free(MEM_VALUES, v);
+}
+
+// La clave de v se borró con UNLINK/FLUSHALL: si es grande, que lo libere el hilo.
+static void value_lazy(Value *v) {
+    if (v && !v->ro && v->len >= LAZY_FREE_MIN) v->lazy = true;
+}
+
+static bool dedup_grow(void) {
+    size_t n = g_dedup_cap ? g_dedup_cap * 2 : 1024;
+    DedupSlot *t = mem_alloc(MEM_INDEX, n * sizeof *t);
+    if (!t) return false;
+    memset(t, 0, n * sizeof *t);
+    for (size_t i = 0; i < g_dedup_cap; ++i) {
+        if (!g_dedup[i].v) continue;
+        size_t j = g_dedup[i].h & (n - 1);
+        while (t[j].v) j = (j + 1) & (n - 1);
+        t[j] = g_dedup[i];
+    }
+    mem_free(MEM_INDEX, g_dedup);
+    g_dedup = t;
+    g_dedup_cap = n;
+    return true;
+}
+
+// Posición de la tabla con el contenido [p, p+len) de hash h, o la libre
+// donde iría.
+static size_t dedup_slot(uint64_t h, const void *p, size_t len) {
+    size_t mask = g_dedup_cap - 1, i = h & mask;
+    for (; g_dedup[i].v; i = (i + 1) & mask) {
+        const Value *o = g_dedup[i].v;
+        if (g_dedup[i].h == h && o->len == len && memcmp(value_bytes(o), p, len) == 0) break;
+    }
+    return i;
+}
+
+static bool dedup_wanted(size_t len) {
+    if (g_cfg.dedup_min <= 0 || len < (size_t)g_cfg.dedup_min) return false;
+    return 2 * (g_dedup_count + 1) <= g_dedup_cap || dedup_grow();
+}
+
+// value_new() para un valor recién escrito: si ya hay uno en memoria con el
+// mismo contenido se comparte (sin reservar ni copiar).
+static Value *value_intern(const void *p, size_t len) {
+    if (!dedup_wanted(len)) return value_new(p, len);
+    uint64_t h = content_hash(p, len);
+    size_t i = dedup_slot(h, p, len);
+    if (g_dedup[i].v) {
+        ++g_dedup_mem_hits;
+        return value_ref(g_dedup[i].v);
+    }
+    Value *v = value_new(p, len);
+    if (!v) return NULL;
+    g_dedup[i] = (DedupSlot){ h, v };
+    ++g_dedup_count;
+    v->interned = true;
+    return v;
+}
+
+// Lo mismo para un valor ya leído del disco: devuelve el que estaba en
+// memoria con el mismo contenido (soltando v) o registra v.
+static Value *value_dedup(Value *v) {
+    if (!v || v->ro || v->interned || !dedup_wanted(v->len)) return v;
+    uint64_t h = content_hash(value_bytes(v), v->len);
+    size_t i = dedup_slot(h, value_bytes(v), v->len);
+    if (g_dedup[i].v) {
+        ++g_dedup_mem_hits;
+        Value *o = value_ref(g_dedup[i].v);
+        value_unref(v);
+        return o;
+    }
+    g_dedup[i] = (DedupSlot){ h, v };
+    ++g_dedup_count;
+    v->interned = true;
+    return v;
+}
+
+// Cola de salida: bytes propios (cabeceras, respuestas cortas) intercalados
+// con referencias a valores; se envía con sendmsg() sin copiar los valores.
+typedef struct {
+    Value *ref;            // NULL: [off, off+len) dentro de OutQ.bytes
+    size_t off;
+    size_t len;
+} OutSeg;
+
+typedef struct {
+    Buf bytes;
+    OutSeg *seg;
+    size_t nseg;
+    size_t capseg;
+    size_t total;
+} OutQ;
+
+#define OUTQ_INIT { .bytes = { NULL, 0, 0, MEM_OUTPUT }, .seg = NULL, .nseg = 0, .capseg = 0, .total = 0 }
+#define OUTQ_IOV 64
+
+static bool outq_seg(OutQ *q, Value *ref, size_t off, size_t len) {
+    OutSeg *last = q->nseg ? &q->seg[q->nseg - 1] : NULL;
+    if (!ref && last && !last->ref && last->off + last->len == off) {
+        last->len += len;
+        q->total += len;
+        return true;
+    }
+    if (q->nseg == q->capseg) {
+        size_t cap = q->capseg ? q->capseg * 2 : 16;
+        OutSeg *seg = mem_realloc(MEM_OUTPUT, q->seg, cap * sizeof *seg);
+        if (!seg) return false;
+        q->seg = seg;
+        q->capseg = cap;
+    }
+    q->seg[q->nseg++] = (OutSeg){ .ref = ref, .off = off, .len = len };
+    q->total += len;
+    return true;
+}
+
+static bool outq_bytes(OutQ *q, const void *p, size_t n) {
+    size_t off = q->bytes.len;
+    return buf_append(&q->bytes, p, n) && outq_seg(q, NULL, off, n);
+}
+
+static bool outq_printf(OutQ *q, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static bool outq_printf(OutQ *q, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof tmp, fmt, ap);
+    va_end(ap);
+    if (n < 0) return false;
+    return outq_bytes(q, tmp, (size_t)n < sizeof tmp ? (size_t)n : sizeof tmp - 1);
+}
+
+// Encola [off, off+len) de v tomando una referencia.
+static bool outq_value(OutQ *q, Value *v, size_t off, size_t len) {
+    if (!outq_seg(q, v, off, len)) return false;
+    (void)value_ref(v);
+    return true;
+}
+
+static void outq_free(OutQ *q) {
+    for (size_t i = 0; i < q->nseg; ++i) value_unref(q->seg[i].ref);
+    buf_free(&q->bytes);
+    mem_free(MEM_OUTPUT, q->seg);
+    *q = (OutQ)OUTQ_INIT;
+}
+
+// Envía la cola desde el byte *sent con sendmsg(flags) y avanza *sent.
+// *calls cuenta los sendmsg que enviaron algo. Si MSG_ZEROCOPY falla con
+// ENOBUFS se sigue copiando (*fallback = true). Con un socket no bloqueante
+// se detiene en EAGAIN (queda *sent < q->total). Devuelve false ante un
+// error de escritura.
+static bool outq_send(int fd, const OutQ *q, size_t *sent, int flags, uint32_t *calls, bool *fallback) {
+    size_t si = 0, soff = *sent;
+    while (si < q->nseg && soff >= q->seg[si].len) soff -= q->seg[si++].len;
+    while (si < q->nseg) {
+        struct iovec iov[OUTQ_IOV];
+        size_t n = 0;
+        for (size_t k = si, o = soff; k < q->nseg && n < OUTQ_IOV; ++k, o = 0) {
+            const OutSeg *s = &q->seg[k];
+            const char *base = s->ref ? s->ref->wire : q->bytes.p;
+            iov[n].iov_base = (void*)(base + s->off + o);
+            iov[n].iov_len = s->len - o;
+            ++n;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t w = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                flags &= ~MSG_ZEROCOPY;
+                *fallback = true;
+                continue;
+            }
+            return false;
+        }
+        if (w > 0 && calls) ++*calls;
+        *sent += (size_t)w;
+        size_t left = (size_t)w;
+        while (left > 0) {
+            size_t rem = q->seg[si].len - soff;
+            if (left < rem) { soff += left; break; }
+            left -= rem;
+            ++si;
+            soff = 0;
+        }
+        while (si < q->nseg && q->seg[si].len == 0) ++si;
+    }
+    return true;
+}
+
+// Agrega a dst lo que sigue de src desde el byte skip (los valores, por referencia).
+static bool outq_append(OutQ *dst, const OutQ *src, size_t skip) {
+    for (size_t k = 0; k < src->nseg; ++k) {
+        const OutSeg *s = &src->seg[k];
+        if (skip >= s->len) { skip -= s->len; continue; }
+        bool ok = s->ref ? outq_value(dst, s->ref, s->off + skip, s->len - skip)
+                         : outq_bytes(dst, src->bytes.p + s->off + skip, s->len - skip);
+        if (!ok) return false;
+        skip = 0;
+    }
+    return true;
+}
+
+// ---------- caché de valores ----------
+// Índice hash encadenado clave -> Value con escritura directa: el archivo
+// sigue siendo la fuente de verdad y la caché se llena en cada SET y en cada
+// GET que no la encuentra. Si ocupa más de g_cfg.cache_bytes se desalojan
+// entradas con el algoritmo del reloj (segunda oportunidad).
+//
+// Con --write-back los SET sólo actualizan la caché y marcan la entrada como
+// sucia; writeback_tick() escribe el último valor de cada clave sucia una vez
+// por intervalo, así N sobrescrituras dentro del intervalo cuestan una sola
+// escritura. Las lecturas siempre pasan primero por la caché, por lo que ven
+// el valor nuevo. Una entrada sucia se escribe antes de desalojarla y todas
+// se escriben al cerrar.
+//
+// Con --tiering[=N] la caché tiene dos niveles. El reloj no descarta una
+// entrada fría: suelta su valor (que ya está en el disco) y deja un stub con
+// la clave y el largo; lo que descarta son los stubs fríos. Una lectura que
+// no encuentra el valor en memoria lo lee del disco (con el largo del stub,
+// sin averiguarlo) y lo cuenta en el stub, que se crea en la primera; el
+// valor vuelve a memoria recién en la lectura número N mientras el stub siga
+// vivo. Así las claves leídas una sola vez (un recorrido) no desalojan a las
+// calientes y la memoria se dimensiona para las que se leen seguido.
+#define CACHE_MIN_BUCKETS 1024
+#define CACHE_MAX_ITEM (1u << 20)          // valores más grandes no se cachean
+
+typedef struct CacheEntry {
+    struct CacheEntry *next;
+    uint64_t hash;
+    char *key;
+    Value *val;            // NULL: stub (--tiering), el valor sólo está en el disco
+    uint32_t len;          // largo del valor (también en los stubs)
+    uint16_t reads;        // stub: lecturas desde el disco
+    bool referenced;       // bit del reloj
+    bool dirty;            // valor más nuevo que el archivo (write-back)
+    size_t dirty_pos;      // índice en g_dirty si dirty
+} CacheEntry;
+
+static CacheEntry **g_cache = NULL;
+static size_t g_cache_nbuckets = 0;
+static size_t g_cache_count = 0;
+static size_t g_cache_bytes = 0;
+static size_t g_cache_hand = 0;
+static uint64_t g_cache_hits = 0, g_cache_misses = 0, g_cache_evictions = 0;
+
+// Entradas sucias (write-back); se quitan con swap-remove usando dirty_pos.
+static CacheEntry **g_dirty = NULL;
+static size_t g_ndirty = 0, g_capdirty = 0;
+static uint64_t g_wb_deadline = 0;           // now_us() del próximo volcado
+static uint64_t g_wb_absorbed = 0, g_wb_flushed = 0;
+static size_t g_tier_stubs = 0;
+static uint64_t g_tier_demotions = 0, g_tier_promotions = 0, g_tier_cold_reads = 0;
+
+static uint64_t key_hash(const char *key) {
+    return hash_bytes(key, strlen(key), 0x51ed270b27e54c1dULL);
+}
+
+// Bytes de la entrada sin su valor: el valor se carga aparte (cache_attach),
+// una sola vez aunque lo compartan varias claves (--dedup).
+static size_t entry_bytes(const CacheEntry *e) {
+    return malloc_usable_size((void*)e) + malloc_usable_size(e->key);
+}
+
+static void cache_attach(CacheEntry *e, Value *v) {
+    e->val = value_ref(v);
+    if (v->keys++ == 0) g_cache_bytes += malloc_usable_size(v);
+    else g_dedup_mem_saved += malloc_usable_size(v);
+}
+
+static void cache_detach(CacheEntry *e) {
+    Value *v = e->val;
+    if (!v) return;
+    if (--v->keys == 0) g_cache_bytes -= malloc_usable_size(v);
+    else g_dedup_mem_saved -= malloc_usable_size(v);
+    e->val = NULL;
+    value_unref(v);
+}
+
+// Puntero al enlace que apunta a <key> (o al NULL final de su cadena).
+static CacheEntry **cache_link(const char *key, uint64_t h) {
+    CacheEntry **pp = &g_cache[h & (g_cache_nbuckets - 1)];
+    while (*pp && ((*pp)->hash != h || strcmp((*pp)->key, key) != 0)) pp = &(*pp)->next;
+    return pp;
+}
+
+static bool dirty_add(CacheEntry *e) {
+    if (g_ndirty == g_capdirty) {
+        size_t cap = g_capdirty ? g_capdirty * 2 : 64;
+        CacheEntry **d = mem_realloc(MEM_INDEX, g_dirty, cap * sizeof *d);
+        if (!d) return false;
+        g_dirty = d;
+        g_capdirty = cap;
+    }
+    if (g_ndirty == 0) g_wb_deadline = now_us() + (uint64_t)g_cfg.writeback_ms * 1000;
+    e->dirty = true;
+    e->dirty_pos = g_ndirty;
+    g_dirty[g_ndirty++] = e;
+    return true;
+}
+
+static void dirty_remove(CacheEntry *e) {
+    CacheEntry *last = g_dirty[--g_ndirty];
+    g_dirty[e->dirty_pos] = last;
+    last->dirty_pos = e->dirty_pos;
+    e->dirty = false;
+}
+
+// Escribe el valor de una entrada sucia; false si falló (sigue sucia).
+static bool cache_flush_entry(CacheEntry *e) {
+    if (store_write(e->key, value_bytes(e->val), e->val->len) != 0) {
+        perror("write-back");
+        return false;
+    }
+    dirty_remove(e);
+    ++g_wb_flushed;
+    return true;
+}
+
+static void writeback_flush(void) {
+    for (size_t i = g_ndirty; i-- > 0;)
+        (void)cache_flush_entry(g_dirty[i]);
+    if (g_ndirty) g_wb_deadline = now_us() + (uint64_t)g_cfg.writeback_ms * 1000;
+}
+
+// Desde el bucle principal en cada vuelta: vuelca si venció el intervalo.
+static void writeback_tick(void) {
+    if (g_ndirty && now_us() >= g_wb_deadline) writeback_flush();
+}
+
+static void cache_free_entry(CacheEntry *e) {
+    g_cache_bytes -= entry_bytes(e);
+    cache_detach(e);
+    mem_free(MEM_KEYS, e->key);
+    mem_free(MEM_INDEX, e);
+}
+
+static void cache_unlink(CacheEntry **pp) {
+    CacheEntry *e = *pp;
+    if (e->dirty) dirty_remove(e);
+    *pp = e->next;
+    --g_cache_count;
+    if (!e->val) --g_tier_stubs;
+    cache_free_entry(e);
+}
+
+static CacheEntry *cache_find(const char *key) {
+    if (!g_cache) return NULL;
+    return *cache_link(key, key_hash(key));
+}
+
+static void cache_drop(const char *key) {
+    if (!g_cache) return;
+    CacheEntry **pp = cache_link(key, key_hash(key));
+    if (*pp) cache_unlink(pp);
+}
+
+// DELPREFIX/DELRANGE: suelta las entradas que cubre t (sucias incluidas, que
+// ya no deben llegar al disco). La lápida se retira sin mirar la caché.
+static void cache_drop_tomb(const Tombstone *t) {
+    for (size_t i = 0; i < g_cache_nbuckets; ++i) {
+        CacheEntry **pp = &g_cache[i];
+        while (*pp) {
+            if (tomb_covers(t, (*pp)->key)) cache_unlink(pp);
+            else pp = &(*pp)->next;
+        }
+    }
+}
+
+static void cache_grow(void) {
+    size_t n = g_cache_nbuckets ? g_cache_nbuckets * 2 : CACHE_MIN_BUCKETS;
+    CacheEntry **b = mem_alloc(MEM_INDEX, n * sizeof *b);
+    if (!b) return;                       // seguir con cadenas más largas
+    memset(b, 0, n * sizeof *b);
+    for (size_t i = 0; i < g_cache_nbuckets; ++i) {
+        CacheEntry *e = g_cache[i];
+        while (e) {
+            CacheEntry *next = e->next;
+            e->next = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    mem_free(MEM_INDEX, g_cache);
+    g_cache = b;
+    g_cache_nbuckets = n;
+    g_cache_hand = 0;
+}
+
+// --tiering: la entrada queda como stub (el valor ya está en el disco).
+static void cache_demote(CacheEntry *e) {
+    cache_detach(e);
+    e->reads = 0;
+    ++g_tier_stubs;
+    ++g_tier_demotions;
+}
+
+// FLUSHALL: la tabla entera se aparta de una vez (la caché queda vacía) y
+// cache_retire_step la libera de a CACHE_RETIRE_STEP entradas por vuelta.
+// Hasta entonces lo suyo sigue sumado en g_cache_bytes; g_retired_bytes es
+// esa parte, que no cuenta para el límite (una estimación: un valor que una
+// entrada nueva comparte por --dedup se descuenta recién al terminar).
+#define CACHE_RETIRE_STEP 1024
+
+static CacheEntry **g_retired = NULL;
+static size_t g_retired_nbuckets = 0, g_retired_pos = 0;
+static size_t g_retired_bytes = 0;
+
+static void cache_retire_step(void) {
+    if (!g_retired) return;
+    for (int n = 0; n < CACHE_RETIRE_STEP && g_retired_pos < g_retired_nbuckets;) {
+        CacheEntry *e = g_retired[g_retired_pos];
+        if (!e) {
+            ++g_retired_pos;
+            continue;
+        }
+        g_retired[g_retired_pos] = e->next;
+        value_lazy(e->val);
+        size_t before = g_cache_bytes;
+        cache_free_entry(e);
+        size_t freed = before - g_cache_bytes;
+        g_retired_bytes -= freed < g_retired_bytes ? freed : g_retired_bytes;
+        ++n;
+    }
+    if (g_retired_pos < g_retired_nbuckets) return;
+    mem_free(MEM_INDEX, g_retired);
+    g_retired = NULL;
+    g_retired_nbuckets = g_retired_pos = 0;
+    g_retired_bytes = 0;
+}
+
+// Las entradas sucias se descartan: sus claves también dejan de existir.
+static void cache_retire(void) {
+    while (g_retired) cache_retire_step();         // un FLUSHALL anterior sin terminar
+    if (!g_cache) return;
+    g_retired = g_cache;
+    g_retired_nbuckets = g_cache_nbuckets;
+    g_retired_pos = 0;
+    g_retired_bytes = g_cache_bytes;
+    g_cache = NULL;
+    g_cache_nbuckets = g_cache_count = 0;
+    g_cache_hand = 0;
+    g_tier_stubs = 0;
+    g_ndirty = 0;
+}
+
+// Reloj: recorre los buckets y desaloja la primera entrada sin uso reciente
+// (con --tiering, una entrada con valor pasa a stub y sigue de largo).
+static void cache_evict(void) {
+    while (g_cache_bytes > g_cfg.cache_bytes + g_retired_bytes && g_cache_count > 0) {
+        CacheEntry **pp = &g_cache[g_cache_hand];
+        bool evicted = false;
+        while (*pp) {
+            CacheEntry *e = *pp;
+            if (e->referenced) {
+                e->referenced = false;
+                pp = &e->next;
+                continue;
+            }
+            if (e->dirty && !cache_flush_entry(e)) return;   // sin disco no se puede soltar
+            if (e->val && g_cfg.tier_promote > 0) {
+                cache_demote(e);
+                if (g_cache_bytes <= g_cfg.cache_bytes + g_retired_bytes) return;
+                pp = &e->next;
+                continue;
+            }
+            cache_unlink(pp);
+            ++g_cache_evictions;
+            evicted = true;
+            break;
+        }
+        if (!evicted) g_cache_hand = (g_cache_hand + 1) & (g_cache_nbuckets - 1);
+    }
+}
+
+// Entrada nueva para key en *pp (el final de su cadena); NULL sin memoria.
+static CacheEntry *cache_insert(CacheEntry **pp, const char *key, uint64_t h) {
+    CacheEntry *e = mem_alloc(MEM_INDEX, sizeof *e);
+    char *k = e ? mem_alloc(MEM_KEYS, strlen(key) + 1) : NULL;
+    if (!k) { mem_free(MEM_INDEX, e); return NULL; }
+    strcpy(k, key);
+    *e = (CacheEntry){ .next = NULL, .hash = h, .key = k, .val = NULL, .len = 0, .reads = 0,
+                       .referenced = false, .dirty = false, .dirty_pos = 0 };
+    *pp = e;
+    ++g_cache_count;
+    return e;
+}
+
+// Asocia v a key en la caché (toma su propia referencia). dirty: el valor
+// todavía no está en el archivo. false si no quedó en la caché como se pidió.
+static bool cache_put(const char *key, Value *v, bool dirty) {
+    if (g_cfg.cache_bytes == 0) return false;
+    if (!g_cache || g_cache_count >= g_cache_nbuckets) cache_grow();
+    if (!g_cache) return false;
+    uint64_t h = key_hash(key);
+    CacheEntry **pp = cache_link(key, h);
+    CacheEntry *e = *pp;
+    if (e) {
+        if (!e->val) --g_tier_stubs;
+        cache_detach(e);
+        cache_attach(e, v);
+    } else {
+        e = cache_insert(pp, key, h);
+        if (!e) return false;
+        cache_attach(e, v);
+        g_cache_bytes += entry_bytes(e);
+    }
+    e->len = v->len;
+    e->referenced = true;
+    bool ok = true;
+    if (dirty && e->dirty) ++g_wb_absorbed;      // la escritura anterior nunca llegó al disco
+    else if (dirty) ok = dirty_add(e);
+    else if (e->dirty) dirty_remove(e);
+    cache_evict();
+    return ok;
+}
+
+// --tiering: stub para una clave leída del disco por primera vez.
+static CacheEntry *cache_stub(const char *key, uint32_t len) {
+    if (g_cfg.cache_bytes == 0) return NULL;
+    if (!g_cache || g_cache_count >= g_cache_nbuckets) cache_grow();
+    if (!g_cache) return NULL;
+    uint64_t h = key_hash(key);
+    CacheEntry **pp = cache_link(key, h);
+    if (*pp) return *pp;
+    CacheEntry *e = cache_insert(pp, key, h);
+    if (!e) return NULL;
+    e->len = len;
+    e->referenced = true;
+    ++g_tier_stubs;
+    g_cache_bytes += entry_bytes(e);
+    cache_evict();
+    return e;
+}
+
+// --tiering: cuenta una lectura desde el disco de key; true si su valor
+// tiene que quedar en memoria.
+static bool tier_admit(const char *key, CacheEntry *stub, uint32_t len) {
+    if (g_cfg.tier_promote <= 0) return true;
+    if (!stub) stub = cache_stub(key, len);
+    if (!stub) return false;
+    stub->referenced = true;
+    if (stub->reads < UINT16_MAX) ++stub->reads;
+    if (stub->reads < g_cfg.tier_promote) {
+        ++g_tier_cold_reads;
+        return false;
+    }
+    ++g_tier_promotions;
+    return true;
+}
+
+// Búsqueda de varias claves a la vez (MGET, get de memcached con varias
+// claves). Por grupos de CACHE_BATCH: primero se calculan todos los hashes y
+// se pide cada bucket con __builtin_prefetch, después la primera entrada de
+// cada cadena, después su clave y su valor, y recién al final se comparan.
+// Así las esperas a memoria de las distintas claves se superponen en lugar de
+// sumarse una tras otra.
+#define CACHE_BATCH 16
+
+static void cache_find_batch(const char *const *keys, size_t n, CacheEntry **out) {
+    for (size_t base = 0; base < n; base += CACHE_BATCH) {
+        size_t m = n - base < CACHE_BATCH ? n - base : CACHE_BATCH;
+        uint64_t h[CACHE_BATCH];
+        CacheEntry **slot[CACHE_BATCH];
+        if (!g_cache) {
+            for (size_t i = 0; i < m; ++i) out[base + i] = NULL;
+            continue;
+        }
+        for (size_t i = 0; i < m; ++i) {
+            h[i] = key_hash(keys[base + i]);
+            slot[i] = &g_cache[h[i] & (g_cache_nbuckets - 1)];
+            __builtin_prefetch(slot[i]);
+        }
+        for (size_t i = 0; i < m; ++i)
+            if (*slot[i]) __builtin_prefetch(*slot[i]);
+        for (size_t i = 0; i < m; ++i) {
+            const CacheEntry *e = *slot[i];
+            if (!e) continue;
+            __builtin_prefetch(e->key);
+            __builtin_prefetch(e->val);
+        }
+        for (size_t i = 0; i < m; ++i) {
+            CacheEntry *e = *slot[i];
+            while (e && (e->hash != h[i] || strcmp(e->key, keys[base + i]) != 0)) e = e->next;
+            out[base + i] = e;
+        }
+    }
+}
+
+static void cache_shutdown(void) {
+    writeback_flush();
+    while (g_retired) cache_retire_step();
+    for (size_t i = 0; i < g_cache_nbuckets; ++i)
+        while (g_cache[i]) cache_unlink(&g_cache[i]);
+    mem_free(MEM_INDEX, g_cache);
+    g_cache = NULL;
+    g_cache_nbuckets = 0;
+    mem_free(MEM_INDEX, g_dirty);
+    g_dirty = NULL;
+    g_ndirty = g_capdirty = 0;
+    if (g_dedup_count == 0) {              // si no, algún valor todavía la necesita al soltarse
+        mem_free(MEM_INDEX, g_dedup);
+        g_dedup = NULL;
+        g_dedup_cap = 0;
+    }
+}
+
+// ---------- lecturas en vuelo (single-flight) ----------
+// Los pedidos que llegan juntos (una tanda de get/MGET, o varias conexiones
+// listas en la misma vuelta del bucle) y fallan en la caché sobre la misma
+// clave comparten una sola lectura del almacenamiento: la primera la hace y
+// anota el resultado; las siguientes lo toman de acá. Las entradas viven hasta
+// el final de la vuelta (flights_end) o hasta un SET/DEL de esa clave. Esto
+// cubre también las claves inexistentes y el caso --cache-mb=0.
+#define FLIGHT_SLOTS 64                    // potencia de 2
+
+typedef struct {
+    bool used;
+    bool found;
+    uint64_t hash;
+    char key[100];
+    Value *val;            // NULL si no existe o no entra en memoria
+} Flight;
+
+static Flight g_flights[FLIGHT_SLOTS];
+static size_t g_nflights = 0;
+static uint64_t g_flight_shared = 0;
+
+static Flight *flight_find(const char *key, uint64_t h) {
+    for (size_t n = 0, i = h & (FLIGHT_SLOTS - 1); n < FLIGHT_SLOTS; ++n, i = (i + 1) & (FLIGHT_SLOTS - 1)) {
+        Flight *f = &g_flights[i];
+        if (!f->used) return NULL;
+        if (f->hash == h && strcmp(f->key, key) == 0) return f;
+    }
+    return NULL;
+}
+
+// Anota el resultado de una lectura; si la tabla está llena simplemente no se comparte.
+static void flight_add(const char *key, uint64_t h, Value *v, bool found) {
+    if (g_nflights >= FLIGHT_SLOTS / 2 || strlen(key) >= sizeof g_flights[0].key) return;
+    size_t i = h & (FLIGHT_SLOTS - 1);
+    while (g_flights[i].used) i = (i + 1) & (FLIGHT_SLOTS - 1);
+    g_flights[i] = (Flight){ .used = true, .found = found, .hash = h, .val = v ? value_ref(v) : NULL };
+    strcpy(g_flights[i].key, key);
+    ++g_nflights;
+}
+
+// El valor cambió: la lectura anotada ya no sirve (se deja como tumba para no
+// cortar las secuencias de sondeo; flights_end la limpia).
+static void flight_forget(const char *key) {
+    if (g_nflights == 0) return;
+    Flight *f = flight_find(key, key_hash(key));
+    if (!f) return;
+    value_unref(f->val);
+    f->val = NULL;
+    f->key[0] = '\0';
+    f->hash = 0;
+}
+
+static void flights_end(void) {
+    if (g_nflights == 0) return;
+    for (size_t i = 0; i < FLIGHT_SLOTS; ++i) {
+        if (g_flights[i].used) value_unref(g_flights[i].val);
+        g_flights[i].used = false;
+    }
+    g_nflights = 0;
+}
+
+// ---------- versiones (MVCC) ----------
+// Cada SET/DEL toma el siguiente número de secuencia (g_seq) y un snapshot es
+// el número de secuencia del momento en que se abrió: ve cada clave como
+// quedó después de esa mutación. Mientras haya snapshots abiertos, la primera
+// mutación de una clave posterior al snapshot más nuevo guarda el valor que
+// reemplaza (o que la clave no existía) en la lista de versiones de la clave,
+// con el número de esa mutación; las siguientes no guardan nada porque ningún
+// snapshot puede ver los valores intermedios. Leer key en el snapshot S es
+// tomar la primera versión con seq > S; si no hay, la clave no cambió desde S.
+// Las versiones con seq <= el snapshot más viejo ya no las elige nadie y
+// mvcc_tick() las libera de a VER_GC_STEP buckets por vuelta.
+#define SNAP_MAX 16
+#define SNAP_TTL_US (60ull * 1000000)      // sin usarse, un snapshot se libera solo
+#define VER_MIN_BUCKETS 1024
+#define VER_GC_STEP 256
+
+typedef struct Version {
+    struct Version *next;    // de la más vieja a la más nueva
+    uint64_t seq;            // mutación que reemplazó a val
+    Value *val;              // NULL: la clave no existía
+} Version;
+
+typedef struct VerKey {
+    struct VerKey *next;
+    uint64_t hash;
+    Version *head, *tail;    // nunca vacía
+    char key[];
+} VerKey;
+
+typedef struct {
+    uint64_t id;
+    uint64_t seq;
+    uint64_t last_use;       // now_us() del último uso
+    bool pinned;             // de una exportación en curso: no vence
+} Snapshot;
+
+static uint64_t g_seq = 0;
+static Snapshot g_snaps[SNAP_MAX];
+static size_t g_nsnaps = 0;
+static uint64_t g_snap_next_id = 1;
+static VerKey **g_ver = NULL;
+static size_t g_ver_nbuckets = 0, g_ver_keys = 0, g_ver_count = 0;
+static size_t g_ver_gc_pos = 0, g_ver_gc_left = 0;  // buckets que faltan revisar
+static uint64_t g_ver_freed = 0, g_snap_expired = 0;
+
+static Snapshot *snap_find(uint64_t id) {
+    for (size_t i = 0; i < g_nsnaps; ++i) {
+        if (g_snaps[i].id != id) continue;
+        g_snaps[i].last_use = now_us();
+        return &g_snaps[i];
+    }
+    return NULL;
+}
+
+// Id del snapshot nuevo; 0 si ya hay SNAP_MAX abiertos.
+static uint64_t snap_open(bool pinned) {
+    if (g_nsnaps == SNAP_MAX) return 0;
+    g_snaps[g_nsnaps] = (Snapshot){ .id = g_snap_next_id++, .seq = g_seq, .last_use = now_us(), .pinned = pinned };
+    return g_snaps[g_nsnaps++].id;
+}
+
+static bool snap_release(uint64_t id) {
+    for (size_t i = 0; i < g_nsnaps; ++i) {
+        if (g_snaps[i].id != id) continue;
+        g_snaps[i] = g_snaps[--g_nsnaps];
+        g_ver_gc_left = g_ver_nbuckets;             // otra pasada con el nuevo piso
+        return true;
+    }
+    return false;
+}
+
+static VerKey **ver_link(const char *key, uint64_t h) {
+    VerKey **pp = &g_ver[h & (g_ver_nbuckets - 1)];
+    while (*pp && ((*pp)->hash != h || strcmp((*pp)->key, key) != 0)) pp = &(*pp)->next;
+    return pp;
+}
+
+static void ver_grow(void) {
+    size_t n = g_ver_nbuckets ? g_ver_nbuckets * 2 : VER_MIN_BUCKETS;
+    VerKey **b = mem_alloc(MEM_VERSIONS, n * sizeof *b);
+    if (!b) return;                       // seguir con cadenas más largas
+    memset(b, 0, n * sizeof *b);
+    for (size_t i = 0; i < g_ver_nbuckets; ++i) {
+        VerKey *k = g_ver[i];
+        while (k) {
+            VerKey *next = k->next;
+            k->next = b[k->hash & (n - 1)];
+            b[k->hash & (n - 1)] = k;
+            k = next;
+        }
+    }
+    mem_free(MEM_VERSIONS, g_ver);
+    g_ver = b;
+    g_ver_nbuckets = n;
+    g_ver_gc_pos = 0;
+    if (g_ver_gc_left) g_ver_gc_left = n;
+}
+
+// Valor actual de key para guardarlo como versión: de la caché (compartido) o
+// leído del almacenamiento, sin cachearlo ni contarlo como fallo.
+// *ok = false si no hubo memoria.
+static Value *ver_current(const char *key, bool *ok) {
+    *ok = true;
+    const CacheEntry *e = cache_find(key);
+    if (e && e->val) return value_ref(e->val);
+    ssize_t sz = store_size(key);
+    if (sz < 0) return NULL;
+    Value *v = value_new(NULL, (size_t)sz);
+    ssize_t r = v ? store_read(key, v->data + VALUE_HDR, (size_t)sz) : -1;
+    if (r < 0) {
+        value_unref(v);
+        *ok = false;
+        return NULL;
+    }
+    if (r < sz) {                         // se achicó mientras lo leíamos
+        v->len = (uint32_t)r;
+        v->data[VALUE_HDR + r] = '\n';
+    }
+    return value_dedup(v);
+}
+
+// Antes de cada SET/DEL: numera la mutación y, si algún snapshot abierto
+// todavía ve el valor actual de key, lo guarda. false si no hubo memoria
+// para guardarlo (la mutación no debe hacerse).
+static bool mvcc_capture(const char *key) {
+    uint64_t seq = ++g_seq;
+    if (g_nsnaps == 0) return true;
+    uint64_t newest = 0;
+    for (size_t i = 0; i < g_nsnaps; ++i) if (g_snaps[i].seq > newest) newest = g_snaps[i].seq;
+    if (g_ver_keys >= g_ver_nbuckets) ver_grow();
+    if (!g_ver) return false;
+    uint64_t h = key_hash(key);
+    VerKey **pp = ver_link(key, h);
+    if (*pp && (*pp)->tail->seq > newest) return true;  // ya guardado después del snapshot más nuevo
+
+    bool ok;
+    Value *old = ver_current(key, &ok);
+    Version *ver = ok ? mem_alloc(MEM_VERSIONS, sizeof *ver) : NULL;
+    VerKey *k = *pp;
+    if (ver && !k) {
+        size_t klen = strlen(key);
+        k = mem_alloc(MEM_VERSIONS, sizeof *k + klen + 1);
+        if (k) {
+            *k = (VerKey){ .next = NULL, .hash = h, .head = NULL, .tail = NULL };
+            memcpy(k->key, key, klen + 1);
+            *pp = k;
+            ++g_ver_keys;
+        }
+    }
+    if (!ver || !k) {
+        value_unref(old);
+        mem_free(MEM_VERSIONS, ver);
+        return false;
+    }
+    *ver = (Version){ .next = NULL, .seq = seq, .val = old };
+    if (k->tail) k->tail->next = ver;
+    else k->head = ver;
+    k->tail = ver;
+    ++g_ver_count;
+    return true;
+}
+
+// Versión de key que ve el snapshot de número s; NULL si no cambió desde s.
+static const Version *mvcc_version(const char *key, uint64_t s) {
+    if (g_ver_count == 0) return NULL;
+    const VerKey *k = *ver_link(key, key_hash(key));
+    for (const Version *v = k ? k->head : NULL; v; v = v->next)
+        if (v->seq > s) return v;
+    return NULL;
+}
+
+static void mvcc_gc_step(void) {
+    uint64_t floor = UINT64_MAX;
+    for (size_t i = 0; i < g_nsnaps; ++i) if (g_snaps[i].seq < floor) floor = g_snaps[i].seq;
+    for (size_t n = 0; n < VER_GC_STEP && g_ver_gc_left > 0; ++n, --g_ver_gc_left) {
+        VerKey **pp = &g_ver[g_ver_gc_pos];
+        g_ver_gc_pos = (g_ver_gc_pos + 1) & (g_ver_nbuckets - 1);
+        while (*pp) {
+            VerKey *k = *pp;
+            while (k->head && k->head->seq <= floor) {
+                Version *v = k->head;
+                k->head = v->next;
+                value_unref(v->val);
+                mem_free(MEM_VERSIONS, v);
+                --g_ver_count;
+                ++g_ver_freed;
+            }
+            if (k->head) {
+                pp = &k->next;
+                continue;
+            }
+            *pp = k->next;
+            mem_free(MEM_VERSIONS, k);
+            --g_ver_keys;
+        }
+    }
+}
+
+// Snapshots sin usar por SNAP_TTL_US (un cliente que no hizo RELEASE) y
+// versiones que ya nadie ve.
+static void mvcc_expire(void) {
+    uint64_t now = now_us();
+    for (size_t i = 0; i < g_nsnaps; ) {
+        if (!g_snaps[i].pinned && now - g_snaps[i].last_use > SNAP_TTL_US) {
+            ++g_snap_expired;
+            (void)snap_release(g_snaps[i].id);      // trae el último a la posición i
+            continue;
+        }
+        ++i;
+    }
+    mvcc_gc_step();
+}
+
+static void mvcc_shutdown(void) {
+    g_nsnaps = 0;
+    g_ver_gc_left = g_ver_nbuckets;
+    while (g_ver_gc_left > 0) mvcc_gc_step();
+    mem_free(MEM_VERSIONS, g_ver);
+    g_ver = NULL;
+    g_ver_nbuckets = 0;
+}
+
+// ---------- registro de cambios (CDC) ----------
+// Con --cdc[=MB] cada mutación (SET, DEL/UNLINK, DELPREFIX, DELRANGE,
+// FLUSHALL, de cualquier protocolo) se agrega con un número de secuencia a
+// segmentos en .cdc/ ("<primera secuencia>.log"). Los bytes del archivo son
+// los mismos que recibe el consumidor, así que CDCREAD los envía con
+// sendfile() sin pasar por espacio de usuario:
+//   <seq> SET <clave> <largo>\n<valor>\n
+//   <seq> DEL <clave>\n
+//   <seq> DELPREFIX <prefijo>\n | <seq> DELRANGE <desde> <hasta>\n | <seq> FLUSHALL\n
+// Cada segmento tiene en memoria una marca (secuencia, offset) cada
+// CDC_INDEX_STEP bytes para ubicar una secuencia sin leer el archivo entero.
+// Los segmentos más viejos se descartan cuando el total pasa la retención.
+// Los write() van directo al archivo (una caída del proceso no pierde nada);
+// fdatasync() una vez por segundo. Si un registro no se puede escribir el
+// registro queda roto desde esa secuencia (marca en .cdc/broken, sobrevive
+// al reinicio): no se agrega nada más y CDCREAD/CDCINFO lo informan.
+#define CDC_DIR ".cdc"
+#define CDC_CONSUMERS_FILE CDC_DIR "/consumers"
+#define CDC_BROKEN_FILE CDC_DIR "/broken"
+#define CDC_SEGMENT_MAX (16u << 20)
+#define CDC_INDEX_STEP 8192
+#define CDC_MAX_HEAD 256                   // línea de encabezado de un registro
+#define CDC_READ_DEFAULT (1u << 20)        // bytes por CDCREAD
+#define CDC_READ_MAX (16u << 20)
+#define CDC_MAX_SENDERS 16                 // CDCREAD con respuesta a medio enviar
+#define CDC_MAX_CONSUMERS 64
+#define CDC_NAME_MAX 32
+#define CDC_SYNC_MS 1000
+
+typedef struct { uint64_t seq, off; } CdcMark;
+
+typedef struct {
+    uint64_t first;                        // primera secuencia (el nombre del archivo)
+    uint64_t last;                         // última; first - 1 si está vacío
+    uint64_t size;
+    CdcMark *idx;
+    size_t nidx, capidx;
+} CdcSeg;
+
+typedef struct { char name[CDC_NAME_MAX]; uint64_t offset; } CdcConsumer;
+
+// Respuesta de CDCREAD que no entró en el socket: main() la sigue con POLLOUT.
+typedef struct {
+    bool used;
+    int fd, file;                          // cliente (no bloqueante) y segmento
+    off_t off, end;
+    uint64_t start;
+} CdcSender;
+
+static struct {
+    int fd;                                // segmento activo (el último); -1 sin --cdc
+    CdcSeg *segs;
+    size_t nsegs, capsegs;
+    uint64_t seq;                          // última secuencia escrita
+    uint64_t bytes;                        // total en disco
+    uint64_t seg_max, retention;
+    uint64_t broken;                       // primera secuencia perdida; 0 si está completo
+    bool dirty;
+    uint64_t last_sync;
+    CdcConsumer consumers[CDC_MAX_CONSUMERS];
+    size_t nconsumers;
+    CdcSender senders[CDC_MAX_SENDERS];
+    uint64_t appends, errors, dropped, reads, read_bytes, syncs;
+} g_cdc = { .fd = -1 };
+
+static void cdc_path(char *buf, size_t cap, uint64_t first) {
+    (void)snprintf(buf, cap, CDC_DIR "/%020llu.log", (unsigned long long)first);
+}
+
+// Encabezado del registro en p (n bytes disponibles): su secuencia y su largo
+// total. false si la línea está incompleta o mal formada.
+static bool cdc_head(const char *p, size_t n, uint64_t *seq, size_t *len) {
+    const char *nl = memchr(p, '\n', n < CDC_MAX_HEAD ? n : CDC_MAX_HEAD);
+    if (!nl) return false;
+    char line[CDC_MAX_HEAD + 1], op[16];
+    size_t hlen = (size_t)(nl - p) + 1;
+    memcpy(line, p, hlen - 1);
+    line[hlen - 1] = '\0';
+    unsigned long long s = 0, vlen = 0;
+    if (sscanf(line, "%llu %15s", &s, op) != 2) return false;
+    *seq = s;
+    *len = hlen;
+    if (strcmp(op, "SET") != 0) return true;
+    if (sscanf(line, "%*s %*s %*s %llu", &vlen) != 1 || vlen > CDC_SEGMENT_MAX) return false;
+    *len += (size_t)vlen + 1;
+    return true;
+}
+
+static bool cdc_mark(CdcSeg *s, uint64_t seq, uint64_t off) {
+    if (s->nidx > 0 && off - s->idx[s->nidx - 1].off < CDC_INDEX_STEP) return true;
+    if (s->nidx == s->capidx) {
+        size_t cap = s->capidx ? s->capidx * 2 : 16;
+        CdcMark *m = mem_realloc(MEM_OTHER, s->idx, cap * sizeof *m);
+        if (!m) return false;
+        s->idx = m;
+        s->capidx = cap;
+    }
+    s->idx[s->nidx++] = (CdcMark){ seq, off };
+    return true;
+}
+
+// Recorre el segmento (ya en g_cdc.segs) armando sus marcas. Un registro
+// incompleto al final del último segmento (caída a mitad de un write) se
+// recorta; en otro segmento, lo que sigue se ignora.
+static bool cdc_scan(CdcSeg *s, bool active) {
+    char path[64];
+    cdc_path(path, sizeof path, s->first);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size, off = 0;
+    const char *p = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (size && p == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    s->last = s->first - 1;
+    uint64_t seq;
+    size_t len;
+    while (off < size && cdc_head(p + off, size - off, &seq, &len) && len <= size - off &&
+           p[off + len - 1] == '\n' && seq == s->last + 1) {
+        if (!cdc_mark(s, seq, off)) break;
+        s->last = seq;
+        off += len;
+    }
+    if (size) munmap((void*)p, size);
+    if (off < size) {
+        fprintf(stderr, "%s: registro incompleto en el byte %zu%s\n", path, off, active ? ", se recorta" : "");
+        if (active && ftruncate(fd, (off_t)off) != 0) perror(path);
+    }
+    close(fd);
+    s->size = off;
+    return true;
+}
+
+static CdcSeg *cdc_push(uint64_t first) {
+    if (g_cdc.nsegs == g_cdc.capsegs) {
+        size_t cap = g_cdc.capsegs ? g_cdc.capsegs * 2 : 16;
+        CdcSeg *v = mem_realloc(MEM_OTHER, g_cdc.segs, cap * sizeof *v);
+        if (!v) return NULL;
+        g_cdc.segs = v;
+        g_cdc.capsegs = cap;
+    }
+    CdcSeg *s = &g_cdc.segs[g_cdc.nsegs++];
+    *s = (CdcSeg){ .first = first, .last = first - 1 };
+    return s;
+}
+
+static int cdc_cmp_first(const void *a, const void *b) {
+    uint64_t x = ((const CdcSeg*)a)->first, y = ((const CdcSeg*)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+// Descarta los segmentos más viejos mientras se pase de la retención (el
+// activo queda siempre). Los archivos los borra el hilo de liberación diferida.
+static void cdc_retain(void) {
+    while (g_cdc.nsegs > 1 && g_cdc.bytes > g_cdc.retention) {
+        CdcSeg *s = &g_cdc.segs[0];
+        char path[64];
+        cdc_path(path, sizeof path, s->first);
+        if (lazy_unlink(path) != 0 && errno != ENOENT) perror(path);
+        g_cdc.bytes -= s->size;
+        mem_free(MEM_OTHER, s->idx);
+        memmove(g_cdc.segs, g_cdc.segs + 1, (g_cdc.nsegs - 1) * sizeof *g_cdc.segs);
+        --g_cdc.nsegs;
+        ++g_cdc.dropped;
+    }
+}
+
+// Abre un segmento nuevo que empieza en g_cdc.seq + 1 y recién entonces
+// cierra el activo: si falla, el activo sigue abierto (y crece de más).
+static bool cdc_roll(void) {
+    char path[64];
+    cdc_path(path, sizeof path, g_cdc.seq + 1);
+    CdcSeg *s = cdc_push(g_cdc.seq + 1);
+    int fd = s ? open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : -1;
+    if (fd < 0) {
+        perror(path);
+        if (s) --g_cdc.nsegs;
+        return false;
+    }
+    if (g_cdc.fd >= 0) {
+        if (fdatasync(g_cdc.fd) != 0) perror("fdatasync(cdc)");
+        close(g_cdc.fd);
+    }
+    g_cdc.fd = fd;
+    g_cdc.dirty = false;
+    cdc_retain();
+    return true;
+}
+
+static void cdc_save_consumers(void) {
+    FILE *fp = fopen(CDC_CONSUMERS_FILE ".tmp", "w");
+    if (!fp) { perror(CDC_CONSUMERS_FILE); return; }
+    for (size_t i = 0; i < g_cdc.nconsumers; ++i)
+        fprintf(fp, "%s %llu\n", g_cdc.consumers[i].name, (unsigned long long)g_cdc.consumers[i].offset);
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(CDC_CONSUMERS_FILE ".tmp", CDC_CONSUMERS_FILE) != 0) {
+        perror(CDC_CONSUMERS_FILE);
+        (void)unlink(CDC_CONSUMERS_FILE ".tmp");
+    }
+}
+
+// Un cambio no entró en el registro: desde su secuencia los consumidores ya
+// no verían todo, así que se deja de agregar y se guarda la marca.
+static void cdc_break(void) {
+    ++g_cdc.errors;
+    if (g_cdc.broken) return;
+    g_cdc.broken = g_cdc.seq + 1;
+    fprintf(stderr, "Registro de cambios roto desde la secuencia %llu\n", (unsigned long long)g_cdc.broken);
+    FILE *fp = fopen(CDC_BROKEN_FILE, "w");
+    bool ok = fp && fprintf(fp, "%llu\n", (unsigned long long)g_cdc.broken) > 0 && fflush(fp) == 0 &&
+              fsync(fileno(fp)) == 0;
+    if ((fp && fclose(fp) != 0) || !ok) perror(CDC_BROKEN_FILE);
+}
+
+static CdcConsumer *cdc_consumer(const char *name) {
+    for (size_t i = 0; i < g_cdc.nconsumers; ++i)
+        if (strcmp(g_cdc.consumers[i].name, name) == 0) return &g_cdc.consumers[i];
+    return NULL;
+}
+
+// Abre (o crea) .cdc/: recorre los segmentos, recorta un registro a medias y
+// deja el último como activo.
+static bool cdc_open(void) {
+    uint64_t mb = (uint64_t)g_cfg.cdc_mb;
+    g_cdc.retention = mb << 20;
+    g_cdc.seg_max = g_cdc.retention / 4 < CDC_SEGMENT_MAX ? g_cdc.retention / 4 : CDC_SEGMENT_MAX;
+    if (mkdir(CDC_DIR, 0755) != 0 && errno != EEXIST) { perror(CDC_DIR); return false; }
+    DIR *d = opendir(CDC_DIR);
+    if (!d) { perror(CDC_DIR); return false; }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        unsigned long long first;
+        char tail[8];
+        if (strlen(de->d_name) != 24 || sscanf(de->d_name, "%20llu%7s", &first, tail) != 2 ||
+            strcmp(tail, ".log") != 0 || first == 0)
+            continue;
+        if (!cdc_push(first)) { closedir(d); return false; }
+    }
+    closedir(d);
+    if (g_cdc.nsegs > 1) qsort(g_cdc.segs, g_cdc.nsegs, sizeof *g_cdc.segs, cdc_cmp_first);
+    for (size_t i = 0; i < g_cdc.nsegs; ++i) {
+        if (!cdc_scan(&g_cdc.segs[i], i + 1 == g_cdc.nsegs)) return false;
+        g_cdc.bytes += g_cdc.segs[i].size;
+    }
+    if (g_cdc.nsegs > 0) {
+        CdcSeg *s = &g_cdc.segs[g_cdc.nsegs - 1];
+        char path[64];
+        cdc_path(path, sizeof path, s->first);
+        g_cdc.seq = s->last;
+        g_cdc.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (g_cdc.fd < 0) { perror(path); return false; }
+    } else if (!cdc_roll()) {
+        return false;
+    }
+    FILE *fp = fopen(CDC_BROKEN_FILE, "r");
+    if (fp) {
+        unsigned long long b = 0;
+        if (fscanf(fp, "%llu", &b) != 1 || b == 0) b = g_cdc.seq + 1;
+        g_cdc.broken = b;
+        fclose(fp);
+        fprintf(stderr, "Registro de cambios roto desde la secuencia %llu (borrar " CDC_DIR " para empezar de nuevo)\n", b);
+    }
+    fp = fopen(CDC_CONSUMERS_FILE, "r");
+    if (fp) {
+        char name[CDC_NAME_MAX];
+        unsigned long long off;
+        while (g_cdc.nconsumers < CDC_MAX_CONSUMERS && fscanf(fp, "%31s %llu", name, &off) == 2) {
+            CdcConsumer *c = &g_cdc.consumers[g_cdc.nconsumers++];
+            memcpy(c->name, name, sizeof c->name);
+            c->offset = off;
+        }
+        fclose(fp);
+    }
+    g_cdc.last_sync = now_us();
+    printf("Registro de cambios " CDC_DIR ": secuencias %llu..%llu (%zu segmentos)\n",
+           (unsigned long long)g_cdc.segs[0].first, (unsigned long long)g_cdc.seq, g_cdc.nsegs);
+    return true;
+}
+
+// Agrega "<seq> <línea>\n" y, con val, "<valor>\n" (la línea ya trae el largo).
+static void cdc_log(const void *val, size_t vlen, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void cdc_log(const void *val, size_t vlen, const char *fmt, ...) {
+    if (g_cdc.fd < 0) return;
+    if (g_cdc.broken) { ++g_cdc.errors; return; }
+    char head[CDC_MAX_HEAD];
+    int h = snprintf(head, sizeof head, "%llu ", (unsigned long long)(g_cdc.seq + 1));
+    va_list ap;
+    va_start(ap, fmt);
+    int b = vsnprintf(head + h, sizeof head - (size_t)h, fmt, ap);
+    va_end(ap);
+    if (b < 0 || (size_t)(h + b) + 1 >= sizeof head) { cdc_break(); return; }
+    size_t hlen = (size_t)(h + b);
+    head[hlen++] = '\n';
+    CdcSeg *s = &g_cdc.segs[g_cdc.nsegs - 1];
+    size_t rec = hlen + (val ? vlen + 1 : 0);
+    if (s->size > 0 && s->size + rec > g_cdc.seg_max && cdc_roll())   // si no, sigue en el activo
+        s = &g_cdc.segs[g_cdc.nsegs - 1];
+    struct iovec iov[3] = { { head, hlen }, { (void*)val, vlen }, { (void*)"\n", 1 } };
+    ssize_t w;
+    do w = writev(g_cdc.fd, iov, val ? 3 : 1);
+    while (w < 0 && errno == EINTR);
+    if (w < 0 || (size_t)w < rec || !cdc_mark(s, g_cdc.seq + 1, s->size)) {
+        perror("cdc");
+        if (ftruncate(g_cdc.fd, (off_t)s->size) != 0) perror("ftruncate(cdc)");   // sin el registro a medias
+        cdc_break();
+        return;
+    }
+    s->size += rec;
+    s->last = ++g_cdc.seq;
+    g_cdc.bytes += rec;
+    g_cdc.dirty = true;
+    ++g_cdc.appends;
+}
+
+// Una vez por vuelta del bucle (y en reposo): fdatasync() cada CDC_SYNC_MS.
+static void cdc_tick(void) {
+    if (g_cdc.fd < 0 || !g_cdc.dirty) return;
+    uint64_t now = now_us();
+    if (now - g_cdc.last_sync < (uint64_t)CDC_SYNC_MS * 1000) return;
+    if (fdatasync(g_cdc.fd) != 0) perror("fdatasync(cdc)");
+    g_cdc.dirty = false;
+    g_cdc.last_sync = now;
+    ++g_cdc.syncs;
+}
+
+// Sigue enviando con sendfile() sin bloquear; true si terminó (o falló) y se cerró.
+static bool cdc_send_step(CdcSender *sd) {
+    while (sd->off < sd->end) {
+        ssize_t w = sendfile(sd->fd, sd->file, &sd->off, (size_t)(sd->end - sd->off));
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+        if (w <= 0) break;
+    }
+    g_cdc.read_bytes += (uint64_t)sd->off - sd->start;
+    close(sd->file);
+    close(sd->fd);
+    sd->used = false;
+    return true;
+}
+
+static void cdc_close(void) {
+    for (size_t k = 0; k < CDC_MAX_SENDERS; ++k) {
+        if (!g_cdc.senders[k].used) continue;
+        g_cdc.senders[k].end = g_cdc.senders[k].off;   // lo que falta no se envía
+        (void)cdc_send_step(&g_cdc.senders[k]);
+    }
+    if (g_cdc.fd >= 0) {
+        if (fdatasync(g_cdc.fd) != 0) perror("fdatasync(cdc)");
+        close(g_cdc.fd);
+        g_cdc.fd = -1;
+    }
+    for (size_t i = 0; i < g_cdc.nsegs; ++i) mem_free(MEM_OTHER, g_cdc.segs[i].idx);
+    mem_free(MEM_OTHER, g_cdc.segs);
+    g_cdc.segs = NULL;
+    g_cdc.nsegs = g_cdc.capsegs = 0;
+}
+
+// Encabezado del registro en off de fd (un segmento ya validado).
+static bool cdc_read_head(int fd, uint64_t off, uint64_t *seq, size_t *len) {
+    char buf[CDC_MAX_HEAD];
+    ssize_t r = pread(fd, buf, sizeof buf, (off_t)off);
+    return r > 0 && cdc_head(buf, (size_t)r, seq, len);
+}
+
+// Tramo de s a enviar desde la secuencia from con a lo sumo max bytes (al
+// menos un registro): [*start, *end) termina en la secuencia *last.
+static bool cdc_span(const CdcSeg *s, int fd, uint64_t from, size_t max,
+                     uint64_t *start, uint64_t *end, uint64_t *last) {
+    size_t lo = 0, hi = s->nidx;               // última marca con seq <= from
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (s->idx[mid].seq <= from) lo = mid;
+        else hi = mid;
+    }
+    uint64_t seq = s->idx[lo].seq, off = s->idx[lo].off;
+    size_t len;
+    while (seq < from) {
+        if (!cdc_read_head(fd, off, &seq, &len)) return false;
+        off += len;
+        ++seq;
+    }
+    *start = off;
+    if (s->size - off <= max) {
+        *end = s->size;
+        *last = s->last;
+        return true;
+    }
+    for (size_t i = s->nidx; i-- > lo + 1;) {  // última marca dentro del tope
+        if (s->idx[i].off <= off + max && s->idx[i].off > off) {
+            *end = s->idx[i].off;
+            *last = s->idx[i].seq - 1;
+            return true;
+        }
+    }
+    uint64_t got;                              // sin marca en el medio: de a un registro
+    if (!cdc_read_head(fd, off, &got, &len)) return false;
+    *end = off + len;
+    *last = from;
+    while (*end < s->size && cdc_read_head(fd, *end, &got, &len) && *end + len - off <= max) {
+        *end += len;
+        *last = got;
+    }
+    return true;
+}
+
+// ---------- operaciones del almacén ----------
+// Punto común de todos los protocolos (nativo y memcached): almacenamiento
+// más los avisos que dispara cada mutación.
+// Copia el valor en buf (hasta cap bytes); -1 si no existe.
+static ssize_t kv_get(const char *key, void *buf, size_t cap) {
+    if (g_ro) {
+        uint32_t len = 0;
+        const char *w = ro_find(g_ro, key, &len);
+        if (!w) return -1;
+        size_t n = len < cap ? len : cap;
+        memcpy(buf, w + VALUE_HDR, n);
+        return (ssize_t)n;
+    }
+    CacheEntry *e = cache_find(key);
+    if (!e || !e->val) return store_read(key, buf, cap);
+    size_t n = e->val->len < cap ? e->val->len : cap;
+    memcpy(buf, value_bytes(e->val), n);
+    return (ssize_t)n;
+}
+
+static Value *kv_hit(CacheEntry *e) {
+    e->referenced = true;
+    ++g_cache_hits;
+    return value_ref(e->val);
+}
+
+// Fallo de caché: lee key del almacenamiento a un Value nuevo y lo cachea
+// (con --tiering, según tier_admit()).
+static Value *kv_load_value(const char *key, bool *found) {
+    ++g_cache_misses;
+    uint64_t h = key_hash(key);
+    const Flight *f = flight_find(key, h);
+    if (f) {
+        ++g_flight_shared;
+        *found = f->found;
+        return f->val ? value_ref(f->val) : NULL;
+    }
+    *found = false;
+    CacheEntry *stub = g_cfg.tier_promote > 0 ? cache_find(key) : NULL;   // sin valor: si no, era acierto
+    ssize_t sz = stub ? (ssize_t)stub->len : store_size(key);
+    if (sz < 0) {
+        flight_add(key, h, NULL, false);
+        return NULL;
+    }
+    *found = true;
+    size_t size = (size_t)sz, n = 0;
+    Value *v = size <= CACHE_MAX_ITEM ? value_new(NULL, size) : NULL;
+    if (v) {
+        ssize_t r = store_read(key, v->data + VALUE_HDR, size);
+        n = r > 0 ? (size_t)r : 0;
+    }
+    if (v && n < size) {                  // se achicó mientras lo leíamos
+        v->len = (uint32_t)n;
+        v->data[VALUE_HDR + n] = '\n';
+    }
+    v = value_dedup(v);
+    flight_add(key, h, v, true);
+    if (v && tier_admit(key, stub, v->len)) (void)cache_put(key, v, false);
+    return v;
+}
+
+// Referencia al valor (de la caché, o leído del almacenamiento y cacheado).
+// NULL si no existe (*found = false) o si es demasiado grande para tenerlo en
+// memoria (*found = true: usar kv_open).
+static Value *kv_get_value(const char *key, bool *found) {
+    if (g_ro) {
+        uint32_t len = 0;
+        const char *w = ro_find(g_ro, key, &len);
+        *found = w != NULL;
+        return w ? value_borrow(g_ro, w, len) : NULL;
+    }
+    CacheEntry *e = cache_find(key);
+    *found = e != NULL;
+    if (e && e->val) return kv_hit(e);
+    return kv_load_value(key, found);
+}
+
+// kv_get_value() para n claves: primero se resuelven todos los aciertos con
+// cache_find_batch() (tomando su referencia antes de que un fallo pueda
+// desalojarlos) y después se leen los fallos del almacenamiento.
+static void kv_get_values(const char *const *keys, size_t n, Value **out, bool *found) {
+    if (g_ro) {
+        for (size_t i = 0; i < n; ++i) out[i] = kv_get_value(keys[i], &found[i]);
+        return;
+    }
+    for (size_t base = 0; base < n; base += CACHE_BATCH) {
+        size_t m = n - base < CACHE_BATCH ? n - base : CACHE_BATCH;
+        CacheEntry *e[CACHE_BATCH];
+        cache_find_batch(keys + base, m, e);
+        for (size_t i = 0; i < m; ++i) {
+            found[base + i] = e[i] != NULL;
+            out[base + i] = e[i] && e[i]->val ? kv_hit(e[i]) : NULL;
+        }
+        // out (no e, que un fallo anterior pudo desalojar) dice qué falta leer
+        for (size_t i = 0; i < m; ++i)
+            if (!out[base + i]) out[base + i] = kv_load_value(keys[base + i], &found[base + i]);
+    }
+}
+
+static int kv_open(const char *key, size_t *size) {
+    if (g_ro) return -1;                   // todo se sirve desde el mapeo
+    return store_open(key, size);
+}
+
+static bool kv_exists(const char *key) {
+    uint32_t len;
+    if (g_ro) return ro_find(g_ro, key, &len) != NULL;
+    return cache_find(key) != NULL || store_read(key, NULL, 0) >= 0;
+}
+
+static int kv_set(const char *key, const void *data, size_t len) {
+    if (g_ro) { errno = EROFS; return -1; }
+    if (!mvcc_capture(key) || !tomb_note_write(key)) { errno = ENOMEM; return -1; }
+    flight_forget(key);
+    if (g_cfg.writeback_ms > 0 && len <= CACHE_MAX_ITEM && g_cfg.cache_bytes > 0) {
+        Value *v = value_intern(data, len);
+        bool buffered = v && cache_put(key, v, true);
+        value_unref(v);
+        if (buffered) {
+            tracking_invalidate(key);
+            cdc_log(data, len, "SET %s %zu", key, len);
+            return 0;
+        }
+    }
+    if (store_write(key, data, len) != 0) {
+        cache_drop(key);
+        return -1;
+    }
+    Value *v = (len <= CACHE_MAX_ITEM && g_cfg.cache_bytes > 0) ? value_intern(data, len) : NULL;
+    if (!v || !cache_put(key, v, false)) cache_drop(key);
+    value_unref(v);
+    tracking_invalidate(key);
+    cdc_log(data, len, "SET %s %zu", key, len);
+    return 0;
+}
+
+static int kv_del(const char *key) {
+    if (g_ro) { errno = EROFS; return -1; }
+    if (!mvcc_capture(key)) { errno = ENOMEM; return -1; }
+    const CacheEntry *e = cache_find(key);
+    bool pending = e && e->dirty;          // write-back: puede no existir todavía el archivo
+    int r = store_remove(key, false);
+    flight_forget(key);
+    cache_drop(key);
+    tracking_invalidate(key);
+    if (pending || r == 0) cdc_log(NULL, 0, "DEL %s", key);
+    return pending ? 0 : r;
+}
+
+// Como kv_del, pero el archivo y un valor grande en memoria los libera el
+// hilo de liberación diferida.
+static int kv_unlink(const char *key) {
+    if (g_ro) { errno = EROFS; return -1; }
+    if (!mvcc_capture(key)) { errno = ENOMEM; return -1; }
+    CacheEntry *e = cache_find(key);
+    bool pending = e && e->dirty;
+    if (e) value_lazy(e->val);
+    int r = store_remove(key, true);
+    flight_forget(key);
+    cache_drop(key);
+    tracking_invalidate(key);
+    if (pending || r == 0) cdc_log(NULL, 0, "DEL %s", key);
+    return pending ? 0 : r;
+}
+
+// ---------- HyperLogLog ----------
+// PFADD/PFCOUNT/PFMERGE: un contador de elementos distintos guardado como
+// valor de una clave cualquiera (con error típico ~0,81%). Cada elemento se
+// hashea a 64 bits: los 14 bits bajos eligen uno de los 16384 registros y el
+// registro guarda el máximo de (ceros al final del resto + 1).
+//
+// Formato del valor: "HYLL", u8 codificación, 3 bytes reservados y después
+//   - dispersa: u32 (registro << 8 | valor) por registro no nulo, ordenados;
+//     sirve mientras el contador es chico (hasta HLL_SPARSE_MAX registros)
+//   - densa: un byte por registro (16 KiB), para que PFMERGE combine de a
+//     16 registros por instrucción (SSE2)
+// La estimación es la de Ertl ("New cardinality estimation algorithms for
+// HyperLogLog sketches"): sólo necesita el histograma de los registros.
+#define HLL_MAGIC "HYLL"
+#define HLL_P 14
+#define HLL_REGS (1u << HLL_P)
+#define HLL_Q (64 - HLL_P)
+#define HLL_HDR 8
+#define HLL_SPARSE 1
+#define HLL_DENSE 2
+#define HLL_SPARSE_MAX 750                 // 3000 bytes; más, y conviene la densa
+#define HLL_MAX_KEYS 64                    // claves por PFCOUNT/PFMERGE
+
+typedef struct {
+    uint8_t enc;
+    uint32_t n;                            // entradas de sparse
+    uint32_t sparse[HLL_SPARSE_MAX];
+    uint8_t reg[HLL_REGS];                 // sólo con HLL_DENSE
+} Hll;
+
+static uint64_t g_hll_dense = 0;           // pasajes de dispersa a densa
+
+static void hll_init(Hll *h) {
+    h->enc = HLL_SPARSE;
+    h->n = 0;
+}
+
+// Lee key; false con errno = EINVAL si el valor no es un HyperLogLog.
+// *found dice si la clave existía (si no, h queda vacío).
+static bool hll_load(const char *key, Hll *h, bool *found) {
+    static uint8_t buf[HLL_HDR + HLL_REGS + 1];
+    hll_init(h);
+    ssize_t n = kv_get(key, buf, sizeof buf);
+    *found = n >= 0;
+    if (n < 0) return true;
+    size_t len = (size_t)n;
+    if (len < HLL_HDR || memcmp(buf, HLL_MAGIC, 4) != 0) { errno = EINVAL; return false; }
+    if (buf[4] == HLL_DENSE && len == HLL_HDR + HLL_REGS) {
+        for (size_t i = 0; i < HLL_REGS; ++i)
+            if (buf[HLL_HDR + i] > HLL_Q + 1) { errno = EINVAL; return false; }
+        h->enc = HLL_DENSE;
+        memcpy(h->reg, buf + HLL_HDR, HLL_REGS);
+        return true;
+    }
+    size_t cnt = (len - HLL_HDR) / 4;
+    if (buf[4] != HLL_SPARSE || (len - HLL_HDR) % 4 != 0 || cnt > HLL_SPARSE_MAX) { errno = EINVAL; return false; }
+    memcpy(h->sparse, buf + HLL_HDR, cnt * 4);
+    for (size_t i = 0; i < cnt; ++i) {
+        uint32_t e = h->sparse[i];
+        if ((e >> 8) >= HLL_REGS || (e & 0xff) == 0 || (e & 0xff) > HLL_Q + 1 ||
+            (i > 0 && (e >> 8) <= (h->sparse[i - 1] >> 8))) { errno = EINVAL; return false; }
+    }
+    h->n = (uint32_t)cnt;
+    return true;
+}
+
+static int hll_store(const char *key, const Hll *h) {
+    static uint8_t buf[HLL_HDR + HLL_REGS];
+    memcpy(buf, HLL_MAGIC, 4);
+    buf[4] = h->enc;
+    buf[5] = buf[6] = buf[7] = 0;
+    size_t len = HLL_HDR;
+    if (h->enc == HLL_DENSE) {
+        memcpy(buf + HLL_HDR, h->reg, HLL_REGS);
+        len += HLL_REGS;
+    } else {
+        memcpy(buf + HLL_HDR, h->sparse, (size_t)h->n * 4);
+        len += (size_t)h->n * 4;
+    }
+    return kv_set(key, buf, len);
+}
+
+static void hll_to_dense(Hll *h) {
+    if (h->enc == HLL_DENSE) return;
+    memset(h->reg, 0, HLL_REGS);
+    for (uint32_t i = 0; i < h->n; ++i) h->reg[h->sparse[i] >> 8] = (uint8_t)(h->sparse[i] & 0xff);
+    h->enc = HLL_DENSE;
+    h->n = 0;
+    ++g_hll_dense;
+}
+
+// Sube el registro idx a val si era menor; true si cambió.
+static bool hll_set(Hll *h, uint32_t idx, uint8_t val) {
+    if (h->enc == HLL_DENSE) {
+        if (h->reg[idx] >= val) return false;
+        h->reg[idx] = val;
+        return true;
+    }
+    uint32_t lo = 0, hi = h->n;            // primera entrada con registro >= idx
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if ((h->sparse[mid] >> 8) < idx) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < h->n && (h->sparse[lo] >> 8) == idx) {
+        if ((h->sparse[lo] & 0xff) >= val) return false;
+        h->sparse[lo] = idx << 8 | val;
+        return true;
+    }
+    if (h->n == HLL_SPARSE_MAX) {
+        hll_to_dense(h);
+        return hll_set(h, idx, val);
+    }
+    memmove(h->sparse + lo + 1, h->sparse + lo, (h->n - lo) * sizeof *h->sparse);
+    h->sparse[lo] = idx << 8 | val;
+    ++h->n;
+    return true;
+}
+
+// content_hash deja poco mezclados los bits bajos de elementos cortos y
+// parecidos ("u1", "u2"...) y eso se ve como registros repetidos: una vuelta
+// más de mezcla (el final de splitmix64).
+static uint64_t hll_hash(const char *elem, size_t len) {
+    uint64_t x = content_hash(elem, len);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static bool hll_add(Hll *h, const char *elem, size_t len) {
+    uint64_t x = hll_hash(elem, len);
+    uint32_t idx = (uint32_t)(x & (HLL_REGS - 1));
+    uint64_t w = (x >> HLL_P) | (1ULL << HLL_Q);   // centinela: a lo sumo Q ceros
+    return hll_set(h, idx, (uint8_t)(__builtin_ctzll(w) + 1));
+}
+
+// dst = máximo registro a registro de dst y src.
+static void hll_merge(Hll *dst, const Hll *src) {
+    if (src->enc == HLL_SPARSE) {
+        for (uint32_t i = 0; i < src->n; ++i) (void)hll_set(dst, src->sparse[i] >> 8, (uint8_t)(src->sparse[i] & 0xff));
+        return;
+    }
+    hll_to_dense(dst);
+#ifdef __SSE2__
+    for (size_t i = 0; i < HLL_REGS; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst->reg + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src->reg + i));
+        _mm_storeu_si128((__m128i*)(dst->reg + i), _mm_max_epu8(a, b));
+    }
+#else
+    for (size_t i = 0; i < HLL_REGS; ++i)
+        if (src->reg[i] > dst->reg[i]) dst->reg[i] = src->reg[i];
+#endif
+}
+
+static double hll_sigma(double x) {
+    if (x == 1.0) return INFINITY;
+    double y = 1.0, z = x, zp;
+    do {
+        x *= x;
+        zp = z;
+        z += x * y;
+        y += y;
+    } while (z != zp);
+    return z;
+}
+
+static double hll_tau(double x) {
+    if (x == 0.0 || x == 1.0) return 0.0;
+    double y = 1.0, z = 1.0 - x, zp;
+    do {
+        x = sqrt(x);
+        zp = z;
+        y *= 0.5;
+        z -= (1.0 - x) * (1.0 - x) * y;
+    } while (z != zp);
+    return z / 3.0;
+}
+
+static uint64_t hll_count(const Hll *h) {
+    uint32_t hist[HLL_Q + 2] = {0};
+    if (h->enc == HLL_DENSE) {
+        for (size_t i = 0; i < HLL_REGS; ++i) ++hist[h->reg[i]];
+    } else {
+        hist[0] = HLL_REGS - h->n;
+        for (uint32_t i = 0; i < h->n; ++i) ++hist[h->sparse[i] & 0xff];
+    }
+    const double m = HLL_REGS;
+    double z = m * hll_tau((m - hist[HLL_Q + 1]) / m);
+    for (int k = HLL_Q; k >= 1; --k) {
+        z += hist[k];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(hist[0] / m);
+    return (uint64_t)(0.5 / log(2.0) * m * m / z + 0.5);
+}
+
+// ---------- bitmaps ----------
+// SETBIT/GETBIT/BITCOUNT/BITOP tratan el valor de una clave como un arreglo de
+// bits: el bit 0 es el más alto del primer byte (como Redis) y SETBIT agranda
+// el valor con ceros. BITCOUNT y BITOP recorren el valor entero, así que sus
+// lazos van de a 32 bytes con AVX2 (popcount por tabla de nibbles con
+// vpshufb, Muła et al.) si la CPU lo tiene; si no, de a 8 bytes.
+// Se compilan con target("avx2") y se eligen en tiempo de ejecución: el
+// binario corre igual en CPUs sin AVX2.
+#define BIT_MAX_BYTES CACHE_MAX_ITEM       // 8 Mbit: el valor entra en la caché
+#define BITOP_MAX_KEYS 64
+
+typedef enum { BITOP_AND, BITOP_OR, BITOP_XOR } BitOp;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BIT_AVX2 1
+#endif
+
+static uint64_t g_bit_simd_bytes = 0;      // bytes procesados con AVX2
+
+static bool bit_use_avx2(void) {
+#ifdef BIT_AVX2
+    static int avx2 = -1;
+    if (avx2 < 0) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return avx2 == 1;
+#else
+    return false;
+#endif
+}
+
+static uint64_t popcount_scalar(const uint8_t *p, size_t n) {
+    uint64_t c = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof w);
+        c += (uint64_t)__builtin_popcountll(w);
+    }
+    for (; i < n; ++i) c += (uint64_t)__builtin_popcount(p[i]);
+    return c;
+}
+
+static void bitop_scalar(BitOp op, uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof a);
+        memcpy(&b, src + i, sizeof b);
+        a = op == BITOP_AND ? a & b : op == BITOP_OR ? a | b : a ^ b;
+        memcpy(dst + i, &a, sizeof a);
+    }
+    for (; i < n; ++i)
+        dst[i] = op == BITOP_AND ? dst[i] & src[i] : op == BITOP_OR ? dst[i] | src[i] : dst[i] ^ src[i];
+}
+
+#ifdef BIT_AVX2
+__attribute__((target("avx2")))
+static uint64_t popcount_avx2(const uint8_t *p, size_t n) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nib));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    uint64_t lane[4];
+    _mm256_storeu_si256((__m256i*)lane, acc);
+    return lane[0] + lane[1] + lane[2] + lane[3] + popcount_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bitop_avx2(BitOp op, uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        a = op == BITOP_AND ? _mm256_and_si256(a, b) : op == BITOP_OR ? _mm256_or_si256(a, b) : _mm256_xor_si256(a, b);
+        _mm256_storeu_si256((__m256i*)(dst + i), a);
+    }
+    bitop_scalar(op, dst + i, src + i, n - i);
+}
+#endif
+
+static uint64_t bit_popcount(const uint8_t *p, size_t n) {
+#ifdef BIT_AVX2
+    if (n >= 32 && bit_use_avx2()) {
+        g_bit_simd_bytes += n;
+        return popcount_avx2(p, n);
+    }
+#endif
+    return popcount_scalar(p, n);
+}
+
+// dst[i] = dst[i] op src[i] para i < n.
+static void bit_apply(BitOp op, uint8_t *dst, const uint8_t *src, size_t n) {
+#ifdef BIT_AVX2
+    if (n >= 32 && bit_use_avx2()) {
+        g_bit_simd_bytes += n;
+        bitop_avx2(op, dst, src, n);
+        return;
+    }
+#endif
+    bitop_scalar(op, dst, src, n);
+}
+
+// Offset de bit: número decimal menor que BIT_MAX_BYTES * 8.
+static bool bit_offset(const char *s, uint64_t *off) {
+    if (!s || *s < '0' || *s > '9') return false;
+    errno = 0;
+    char *end = NULL;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno != 0 || *end != '\0' || v >= (unsigned long long)BIT_MAX_BYTES * 8) return false;
+    *off = v;
+    return true;
+}
+
+// Valor de key como bitmap: referencia (soltar con value_unref) o NULL si no
+// existe. *too_big si existe pero es más grande que un bitmap.
+static Value *bit_load(const char *key, bool *too_big) {
+    bool found = false;
+    Value *v = kv_get_value(key, &found);
+    *too_big = found && (!v || v->len > BIT_MAX_BYTES);
+    if (*too_big && v) {
+        value_unref(v);
+        v = NULL;
+    }
+    return v;
+}
+
+// Valor anterior del bit (0/1), o -1 con errno (EFBIG, ENOMEM o el de kv_set).
+static int kv_setbit(const char *key, uint64_t off, bool bit) {
+    bool too_big = false;
+    Value *v = bit_load(key, &too_big);
+    if (too_big) { errno = EFBIG; return -1; }
+    size_t old_len = v ? v->len : 0, byte = (size_t)(off / 8);
+    uint8_t mask = (uint8_t)(0x80u >> (off % 8));
+    int old = byte < old_len && ((const uint8_t*)value_bytes(v))[byte] & mask ? 1 : 0;
+    if (byte < old_len && old == (bit ? 1 : 0)) {   // nada cambia
+        value_unref(v);
+        return old;
+    }
+    size_t len = byte < old_len ? old_len : byte + 1;
+    uint8_t *buf = mem_alloc(MEM_VALUES, len);
+    if (!buf) {
+        value_unref(v);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (old_len) memcpy(buf, value_bytes(v), old_len);
+    memset(buf + old_len, 0, len - old_len);
+    value_unref(v);
+    if (bit) buf[byte] |= mask;
+    else buf[byte] &= (uint8_t)~mask;
+    int r = kv_set(key, buf, len);
+    mem_free(MEM_VALUES, buf);
+    return r == 0 ? old : -1;
+}
+
+// ---------- lecturas en un snapshot y exportación en línea ----------
+// Referencia al valor de key que ve el snapshot de número seq (ver kv_get_value).
+static Value *snap_get_value(uint64_t seq, const char *key, bool *found) {
+    const Version *v = mvcc_version(key, seq);
+    if (!v) return kv_get_value(key, found);
+    *found = v->val != NULL;
+    return v->val ? value_ref(v->val) : NULL;
+}
+
+// Copia en buf (hasta cap bytes) el valor que ve el snapshot; -1 si no existía.
+static ssize_t snap_get(uint64_t seq, const char *key, void *buf, size_t cap) {
+    const Version *v = mvcc_version(key, seq);
+    if (!v) return kv_get(key, buf, cap);
+    if (!v->val) return -1;
+    size_t n = v->val->len < cap ? v->val->len : cap;
+    memcpy(buf, value_bytes(v->val), n);
+    return (ssize_t)n;
+}
+
+// EXPORT <nombre> escribe EXPORT_DIR/<nombre> en el formato CSV de
+// "server2 export" con las claves como estaban al pedirlo, de a EXPORT_STEP
+// claves por vuelta del bucle, mientras los SET/DEL siguen. Primero junta los
+// nombres (las pendientes de write-back, las del almacenamiento y, al final,
+// las claves con versiones: las borradas después del snapshot sólo están
+// ahí) y después
+// escribe cada una como la ve su snapshot. Se escribe aparte y se renombra
+// al terminar. En binario (snapshots de Raft) cada clave es
+// <u8 largo><clave><u32 largo><valor> y sólo se omiten los valores de más de
+// EXPORT_MAX_VALUE.
+#define EXPORT_DIR ".exports"
+#define EXPORT_STEP 256
+#define EXPORT_MAX_VALUE (1u << 20)        // como BULK_MAX_VALUE
+
+typedef struct {
+    bool running;
+    bool scanning;           // juntando nombres
+    bool binary;
+    uint64_t snap, seq;
+    StoreIter it;
+    char **names;            // tabla abierta de nombres, sin repetidos
+    size_t cap, count, pos;
+    FILE *out;
+    char *val;
+    char path[128], tmp[128];
+    unsigned long long written, skipped;
+} ExportJob;
+
+static ExportJob g_export;
+static uint64_t g_exports_done = 0, g_exports_failed = 0;
+
+static bool export_add(const char *key) {
+    if (2 * (g_export.count + 1) > g_export.cap) {
+        size_t n = g_export.cap ? g_export.cap * 2 : 1024;
+        char **t = mem_alloc(MEM_KEYS, n * sizeof *t);
+        if (!t) return false;
+        memset(t, 0, n * sizeof *t);
+        for (size_t i = 0; i < g_export.cap; ++i) {
+            char *k = g_export.names[i];
+            if (!k) continue;
+            size_t j = key_hash(k) & (n - 1);
+            while (t[j]) j = (j + 1) & (n - 1);
+            t[j] = k;
+        }
+        mem_free(MEM_KEYS, g_export.names);
+        g_export.names = t;
+        g_export.cap = n;
+    }
+    size_t j = key_hash(key) & (g_export.cap - 1);
+    for (; g_export.names[j]; j = (j + 1) & (g_export.cap - 1))
+        if (strcmp(g_export.names[j], key) == 0) return true;
+    size_t klen = strlen(key);
+    char *k = mem_alloc(MEM_KEYS, klen + 1);
+    if (!k) return false;
+    memcpy(k, key, klen + 1);
+    g_export.names[j] = k;
+    ++g_export.count;
+    return true;
+}
+
+static void export_finish(bool ok) {
+    store_iter_close(&g_export.it);
+    if (g_export.out && (fflush(g_export.out) != 0 || ferror(g_export.out))) ok = false;
+    if (g_export.out && fclose(g_export.out) != 0) ok = false;
+    if (ok && rename(g_export.tmp, g_export.path) != 0) ok = false;
+    if (!ok) (void)unlink(g_export.tmp);
+    for (size_t i = 0; i < g_export.cap; ++i) mem_free(MEM_KEYS, g_export.names[i]);
+    mem_free(MEM_KEYS, g_export.names);
+    mem_free(MEM_OUTPUT, g_export.val);
+    (void)snap_release(g_export.snap);
+    if (ok) ++g_exports_done;
+    else ++g_exports_failed;
+    if (ok) printf("Exportadas %llu claves a %s (%llu omitidas)\n", g_export.written, g_export.path, g_export.skipped);
+    else fprintf(stderr, "No se pudo exportar %s\n", g_export.path);
+    g_export = (ExportJob){ .running = false };
+}
+
+// 0 ok; -1 error (errno); EBUSY si ya hay una exportación en curso.
+static int export_begin(const char *path, bool binary, uint64_t *snap) {
+    if (g_export.running) { errno = EBUSY; return -1; }
+    ExportJob j = { .running = true, .scanning = true, .binary = binary };
+    (void)snprintf(j.path, sizeof j.path, "%s", path);
+    (void)snprintf(j.tmp, sizeof j.tmp, "%s.tmp", path);
+    j.val = mem_alloc(MEM_OUTPUT, EXPORT_MAX_VALUE + 1);
+    j.out = j.val ? fopen(j.tmp, "wb") : NULL;
+    if (!j.out || !store_iter_open(&j.it)) {
+        int err = j.val ? errno : ENOMEM;
+        if (j.out) { fclose(j.out); (void)unlink(j.tmp); }
+        mem_free(MEM_OUTPUT, j.val);
+        errno = err;
+        return -1;
+    }
+    j.snap = snap_open(true);
+    if (j.snap == 0) {
+        store_iter_close(&j.it);
+        fclose(j.out);
+        (void)unlink(j.tmp);
+        mem_free(MEM_OUTPUT, j.val);
+        errno = EAGAIN;
+        return -1;
+    }
+    j.seq = snap_find(j.snap)->seq;
+    g_export = j;
+    // Con write-back, lo pendiente todavía no está en el almacenamiento y,
+    // cuando se escriba, puede caer en una parte ya recorrida.
+    for (size_t i = 0; i < g_ndirty; ++i) {
+        if (export_add(g_dirty[i]->key)) continue;
+        export_finish(false);
+        errno = ENOMEM;
+        return -1;
+    }
+    *snap = j.snap;
+    return 0;
+}
+
+static int export_start(const char *name, uint64_t *snap) {
+    if (g_export.running) { errno = EBUSY; return -1; }
+    if (mkdir(EXPORT_DIR, 0777) != 0 && errno != EEXIST) return -1;
+    char path[128];
+    (void)snprintf(path, sizeof path, "%s/%s", EXPORT_DIR, name);
+    return export_begin(path, false, snap);
+}
+
+static void export_step(void) {
+    if (!g_export.running) return;
+    char key[100];
+    if (g_export.scanning) {
+        // Con el índice se corta siempre al empezar un bucket nuevo y se relee
+        // desde su principio (los repetidos se descartan).
+        store_iter_rewind(&g_export.it);
+        uint64_t bucket = g_export.it.bucket;
+        size_t n = 0;
+        bool more;
+        while ((more = store_iter_next(&g_export.it, key, sizeof key))) {
+            if (!export_add(key)) { export_finish(false); return; }
+            if (++n >= EXPORT_STEP && (g_eh.fd < 0 || g_export.it.bucket != bucket)) break;
+        }
+        if (more) return;
+        for (size_t b = 0; b < g_ver_nbuckets; ++b)
+            for (const VerKey *k = g_ver[b]; k; k = k->next)
+                if (!export_add(k->key)) { export_finish(false); return; }
+        store_iter_close(&g_export.it);
+        g_export.scanning = false;
+        return;
+    }
+    for (size_t n = 0; n < EXPORT_STEP && g_export.pos < g_export.cap; ++g_export.pos) {
+        const char *k = g_export.names[g_export.pos];
+        if (!k) continue;
+        ++n;
+        ssize_t len = snap_get(g_export.seq, k, g_export.val, EXPORT_MAX_VALUE + 1);
+        if (len < 0) continue;                      // no existía en el snapshot
+        if ((size_t)len > EXPORT_MAX_VALUE || (!g_export.binary && memchr(g_export.val, '\n', (size_t)len))) {
+            ++g_export.skipped;                     // no representable en CSV
+            continue;
+        }
+        if (g_export.binary) {
+            uint8_t klen = (uint8_t)strlen(k);
+            uint32_t vlen = (uint32_t)len;
+            fputc(klen, g_export.out);
+            fwrite(k, 1, klen, g_export.out);
+            fwrite(&vlen, sizeof vlen, 1, g_export.out);
+        } else {
+            fputs(k, g_export.out);
+            fputc(',', g_export.out);
+        }
+        fwrite(g_export.val, 1, (size_t)len, g_export.out);
+        if (!g_export.binary) fputc('\n', g_export.out);
+        ++g_export.written;
+    }
+    if (g_export.pos == g_export.cap) export_finish(true);
+}
+
+// Una vez por vuelta del bucle (y en reposo).
+static void mvcc_tick(void) {
+    export_step();
+    mvcc_expire();
+}
+
+// Borra todas las claves: dejan de existir en el momento (una lápida con el
+// prefijo vacío) y lo que ocupaban se libera en segundo plano. Con el índice
+// sus archivos se reemplazan por uno vacío. Los canales de TRACKING se cierran
+// (sus clientes descartan lo que tenían). Con snapshots abiertos o una
+// exportación en curso no se puede: habría que guardar todas las versiones.
+// wait (FLUSHALL sin ASYNC): responder recién al terminar.
+static int kv_flushall(bool wait) {
+    if (g_ro) { errno = EROFS; return -1; }
+    if (g_nsnaps > 0 || g_export.running) { errno = EBUSY; return -1; }
+    tomb_sweep_reset();
+    if (!store_discard()) return -1;
+    (void)tomb_add(false, "", NULL);
+    cache_retire();
+    flights_end();
+    for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t) tracking_drop(t);
+    cdc_log(NULL, 0, "FLUSHALL");
+    ++g_flushes;
+    while (wait && g_retired) cache_retire_step();
+    while (wait && g_ntombs > 0) {
+        tomb_tick();
+        struct timespec pause = { 0, LAZY_PAUSE_US * 1000L };
+        (void)nanosleep(&pause, NULL);
+    }
+    return 0;
+}
+
+// Avisa a los canales de TRACKING de las claves que cubre t. Un canal de
+// prefijo que puede tocarse con t se cierra: no se sabe qué claves tenía.
+static void tracking_invalidate_tomb(const Tombstone *t) {
+    for (size_t k = 0; k < TRACK_MAX_CLIENTS; ++k) {
+        if (!g_trackers[k].used || !g_trackers[k].broadcast) continue;
+        size_t plen = strlen(g_trackers[k].prefix);
+        if (t->range || strncmp(g_trackers[k].prefix, t->lo, plen < t->lo_len ? plen : t->lo_len) == 0)
+            tracking_drop(k);
+    }
+    if (!g_tracked) return;
+    for (size_t i = 0; i < TRACK_MAX_KEYS;) {
+        if (g_tracked[i].mask != 0 && tomb_covers(t, g_tracked[i].key)) {
+            TrackedKey k = g_tracked[i];
+            tracked_remove(i);
+            tracking_push_mask(k.mask, k.key);
+            continue;                  // i recibió otra entrada: revisarla
+        }
+        ++i;
+    }
+}
+
+// DELPREFIX (range false, prefijo en lo) y DELRANGE ([lo, hi)): las claves
+// que cubre dejan de existir en el momento; ver lápidas.
+static int kv_delrange(bool range, const char *lo, const char *hi) {
+    if (g_ro) { errno = EROFS; return -1; }
+    if (g_nsnaps > 0 || g_export.running) { errno = EBUSY; return -1; }
+    if (!tomb_add(range, lo, hi)) return -1;
+    flights_end();
+    cache_drop_tomb(&g_tombs[g_ntombs - 1]);
+    tracking_invalidate_tomb(&g_tombs[g_ntombs - 1]);
+    if (range) cdc_log(NULL, 0, "DELRANGE %s %s", lo, hi);
+    else cdc_log(NULL, 0, "DELPREFIX %s", lo);
+    return 0;
+}
+
+// Una vez por vuelta del bucle (y en reposo).
+static void lazy_tick(void) {
+    cache_retire_step();
+    tomb_tick();
+}
+
+// ---------- replicación (Raft) ----------
+// Con --raft=P1,P2,P3 (3 o 5 procesos en esta máquina; cada Pi es el puerto
+// nativo de un nodo y el propio es el de --port) SET, DEL y UNLINK pasan por
+// un grupo Raft: el líder los agrega a su registro (.raft/log), los replica y
+// responde OK recién cuando están en el disco de la mayoría y aplicados. Los
+// nodos hablan entre sí en el puerto nativo + RAFT_PORT_OFFSET con mensajes
+// binarios (un RaftMsg y su carga; mismo host, enteros en el orden nativo):
+//   VOTE / VOTE_R       pedido de voto y respuesta
+//   APPEND / APPEND_R   entradas (o latido vacío) y respuesta: hasta dónde
+//                       coincide el registro o desde dónde reintentar
+//   SNAP / SNAP_R       un tramo del snapshot para un seguidor atrasado
+// Lotes y pipeline: lo que llega en una vuelta del bucle se escribe con un
+// solo fdatasync() y sale en un APPEND por seguidor, y el líder no espera la
+// respuesta para mandar el siguiente (hasta RAFT_MAX_INFLIGHT por seguidor).
+// Lease: un nodo que recibió un APPEND del líder no vota a nadie durante
+// RAFT_ELECTION_MIN_MS (tampoco recién arrancado). Mientras la mayoría haya
+// respondido a un APPEND enviado hace menos de RAFT_LEASE_MS no puede haber
+// otro líder, así que el líder responde las lecturas desde su almacén sin
+// consultar a nadie (una vez aplicada la entrada vacía con la que empieza su
+// mandato).
+// Snapshots: cada --raft-snap entradas aplicadas se exporta el almacén en
+// binario (exportación en línea) a .raft/snapshot, se sincroniza con syncfs()
+// y se descartan del registro las entradas que cubre. Un seguidor al que le
+// falta algo ya descartado recibe el snapshot, vacía su almacén y lo carga.
+#define RAFT_DIR ".raft"
+#define RAFT_STATE_FILE RAFT_DIR "/state"
+#define RAFT_LOG_FILE RAFT_DIR "/log"
+#define RAFT_SNAP_FILE RAFT_DIR "/snapshot"
+#define RAFT_RECV_FILE RAFT_DIR "/snapshot.recv"
+#define RAFT_MAX_NODES 5
+#define RAFT_PORT_OFFSET 1000
+#define RAFT_TICK_MS 10                    // tope del timeout de poll() con --raft
+#define RAFT_HEARTBEAT_MS 50
+#define RAFT_ELECTION_MIN_MS 300
+#define RAFT_ELECTION_MAX_MS 600
+#define RAFT_LEASE_MS 250                  // < RAFT_ELECTION_MIN_MS: margen para la deriva del reloj
+#define RAFT_RETRY_MS 100                  // reconexión a un nodo caído
+#define RAFT_BATCH_BYTES (256u << 10)
+#define RAFT_MAX_INFLIGHT 8
+#define RAFT_SNAP_CHUNK (64u << 10)
+#define RAFT_MAX_MSG (RAFT_BATCH_BYTES + 4096)
+#define RAFT_MAX_OUT (16u << 20)           // sin enviar: más que esto corta la conexión
+#define RAFT_MAX_WAITERS 1024              // escrituras esperando confirmación
+#define RAFT_MAX_SOCKS (3 * RAFT_MAX_NODES) // [0, RAFT_MAX_NODES): salientes; el resto, entrantes
+
+typedef enum { RAFT_FOLLOWER = 0, RAFT_CANDIDATE, RAFT_LEADER } RaftRole;
+typedef enum { RAFT_VOTE = 1, RAFT_VOTE_R, RAFT_APPEND, RAFT_APPEND_R, RAFT_SNAP, RAFT_SNAP_R } RaftType;
+
+// Encabezado de todos los mensajes (precedido por el largo total en u32).
+typedef struct {
+    uint8_t type;
+    uint8_t from;
+    uint8_t ok;              // VOTE_R: voto; APPEND_R, SNAP_R: aceptado; SNAP: último tramo
+    uint8_t pad;
+    uint32_t n;              // APPEND y su respuesta: entradas del pedido
+    uint64_t term;
+    uint64_t a, b, c;        // VOTE: último índice y su mandato
+                             // APPEND: índice previo, su mandato y commit del líder
+                             // APPEND_R: índice que coincide o desde dónde reintentar
+                             // SNAP: índice y mandato del snapshot, offset del tramo
+                             // SNAP_R: offset esperado; índice instalado (0: todavía no)
+    uint64_t sent_us;        // del pedido; la respuesta lo repite (lease)
+} RaftMsg;
+
+typedef struct { uint64_t term, len; } RaftWire;          // antes de cada entrada de un APPEND
+typedef struct { uint64_t index, term, len; } RaftRec;    // antes de cada entrada de RAFT_LOG_FILE
+
+typedef struct {
+    uint64_t term;
+    uint64_t off;            // del registro en RAFT_LOG_FILE
+    uint32_t len;
+    char *data;              // 'S' clave '\0' valor | 'D' clave '\0' | 'U' clave '\0' | 'N'
+} RaftEntry;
+
+typedef struct {
+    bool used;
+    bool connecting;
+    int fd;
+    int peer;                // saliente: el nodo; entrante: -1
+    Buf in, out;
+} RaftSock;
+
+typedef struct {
+    uint64_t next, match;
+    int inflight;            // APPEND con entradas sin respuesta
+    uint64_t ack_us;         // envío del último pedido respondido en este mandato
+    uint64_t last_send, retry_at;
+    int snap_fd;             // snapshot en envío (-1: ninguno)
+    bool snap_wait;          // tramo enviado sin respuesta
+    uint64_t snap_index, snap_term, snap_off;
+} RaftPeer;
+
+typedef struct { int fd; uint64_t index; } RaftWaiter;
+
+static struct {
+    int n, self;             // n == 0: sin --raft
+    int ports[RAFT_MAX_NODES];
+    int listen_fd, log_fd, recv_fd;
+    RaftRole role;
+    int leader;              // -1: desconocido
+    uint64_t term;
+    int voted;               // -1: nadie en este mandato
+    unsigned votes;          // candidato: máscara de nodos que lo votaron
+    RaftEntry *log;          // índices snap_index + 1 ...
+    size_t nlog, caplog;
+    uint64_t log_bytes;
+    uint64_t snap_index, snap_term;
+    bool loading;            // instalando un snapshot recibido (se guarda en el estado)
+    uint64_t commit, applied, synced, noop_index;
+    bool unsynced;
+    uint64_t deadline_us, contact_us, leader_since;
+    RaftPeer peers[RAFT_MAX_NODES];
+    RaftSock socks[RAFT_MAX_SOCKS];
+    RaftWaiter waiters[RAFT_MAX_WAITERS];
+    size_t nwaiters;
+    uint64_t recv_off;
+    bool snapping;           // exportando un snapshot propio
+    uint64_t snapping_index, snapping_term, exports_before;
+    Buf scratch;
+    uint64_t elections, append_msgs, append_entries, syncs, lease_reads, lease_misses;
+    uint64_t snaps_taken, snaps_sent, snaps_installed;
+} g_raft = { .listen_fd = -1, .log_fd = -1, .recv_fd = -1, .leader = -1, .voted = -1,
+             .scratch = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_REPL_BACKLOG } };
+
+static uint64_t raft_last(void) {
+    return g_raft.snap_index + g_raft.nlog;
+}
+
+static RaftEntry *raft_entry(uint64_t i) {
+    return &g_raft.log[i - g_raft.snap_index - 1];
+}
+
+// Mandato de la entrada i; 0 si ya no está en el registro o no existe.
+static uint64_t raft_term_at(uint64_t i) {
+    if (i == g_raft.snap_index) return g_raft.snap_term;
+    if (i < g_raft.snap_index || i > raft_last()) return 0;
+    return raft_entry(i)->term;
+}
+
+// El valor que alcanza la mayoría: el (n/2 + 1)-ésimo mayor de v[0..n).
+static uint64_t raft_quorum(uint64_t *v) {
+    for (int i = 1; i < g_raft.n; ++i)
+        for (int j = i; j > 0 && v[j - 1] < v[j]; --j) {
+            uint64_t t = v[j]; v[j] = v[j - 1]; v[j - 1] = t;
+        }
+    return v[g_raft.n / 2];
+}
+
+static uint64_t raft_timeout(void) {
+    unsigned span = RAFT_ELECTION_MAX_MS - RAFT_ELECTION_MIN_MS;
+    return now_us() + (RAFT_ELECTION_MIN_MS + (unsigned)rand() % span) * 1000ull;
+}
+
+static bool raft_save_state(void) {
+    FILE *fp = fopen(RAFT_STATE_FILE ".tmp", "w");
+    if (!fp) { perror(RAFT_STATE_FILE); return false; }
+    fprintf(fp, "%llu %d %llu %llu %d\n", (unsigned long long)g_raft.term, g_raft.voted,
+            (unsigned long long)g_raft.snap_index, (unsigned long long)g_raft.snap_term, g_raft.loading ? 1 : 0);
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(RAFT_STATE_FILE ".tmp", RAFT_STATE_FILE) != 0) {
+        perror(RAFT_STATE_FILE);
+        (void)unlink(RAFT_STATE_FILE ".tmp");
+        return false;
+    }
+    return true;
+}
+
+// El almacén escribe sin fsync: antes de descartar entradas del registro
+// lo aplicado tiene que estar en el disco.
+static bool raft_sync_store(void) {
+    int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    bool ok = fd >= 0 && syncfs(fd) == 0;
+    if (!ok) perror("syncfs");
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+static bool raft_log_push(uint64_t term, uint64_t off, char *data, size_t len) {
+    if (g_raft.nlog == g_raft.caplog) {
+        size_t cap = g_raft.caplog ? g_raft.caplog * 2 : 1024;
+        RaftEntry *v = mem_realloc(MEM_REPL_BACKLOG, g_raft.log, cap * sizeof *v);
+        if (!v) return false;
+        g_raft.log = v;
+        g_raft.caplog = cap;
+    }
+    g_raft.log[g_raft.nlog++] = (RaftEntry){ term, off, (uint32_t)len, data };
+    return true;
+}
+
+// Agrega una entrada al final del registro con write(); el fdatasync() lo
+// hace raft_log_sync() una vez por tanda.
+static bool raft_log_append(uint64_t term, const void *data, size_t len) {
+    RaftRec r = { raft_last() + 1, term, len };
+    struct iovec iov[2] = { { &r, sizeof r }, { (void*)data, len } };
+    char *copy = mem_alloc(MEM_REPL_BACKLOG, len);
+    if (!copy || writev(g_raft.log_fd, iov, 2) != (ssize_t)(sizeof r + len)) {
+        perror(RAFT_LOG_FILE);
+        mem_free(MEM_REPL_BACKLOG, copy);
+        if (ftruncate(g_raft.log_fd, (off_t)g_raft.log_bytes) != 0) perror(RAFT_LOG_FILE);
+        return false;
+    }
+    memcpy(copy, data, len);
+    if (!raft_log_push(term, g_raft.log_bytes, copy, len)) {
+        mem_free(MEM_REPL_BACKLOG, copy);
+        if (ftruncate(g_raft.log_fd, (off_t)g_raft.log_bytes) != 0) perror(RAFT_LOG_FILE);
+        return false;
+    }
+    g_raft.log_bytes += sizeof r + len;
+    g_raft.unsynced = true;
+    return true;
+}
+
+static bool raft_log_sync(void) {
+    if (!g_raft.unsynced) return true;
+    if (fdatasync(g_raft.log_fd) != 0) { perror("fdatasync(raft)"); return false; }
+    g_raft.unsynced = false;
+    g_raft.synced = raft_last();
+    ++g_raft.syncs;
+    return true;
+}
+
+// Descarta las entradas desde i (no coinciden con las del líder).
+static void raft_log_truncate(uint64_t i) {
+    size_t k = (size_t)(i - g_raft.snap_index - 1);
+    g_raft.log_bytes = g_raft.log[k].off;
+    if (ftruncate(g_raft.log_fd, (off_t)g_raft.log_bytes) != 0) perror(RAFT_LOG_FILE);
+    for (size_t j = k; j < g_raft.nlog; ++j) mem_free(MEM_REPL_BACKLOG, g_raft.log[j].data);
+    g_raft.nlog = k;
+    if (g_raft.synced > raft_last()) g_raft.synced = raft_last();
+    g_raft.unsynced = true;
+}
+
+// El snapshot pasa a cubrir hasta index: se guarda en el estado y el registro
+// se reescribe con lo que sigue (vacío si la entrada index no coincide). Si
+// no se puede reescribir queda el archivo viejo: al leerlo se saltean las
+// entradas que cubre el snapshot.
+static bool raft_set_snapshot(uint64_t index, uint64_t term, bool loading) {
+    size_t drop = g_raft.nlog;
+    if (index <= raft_last() && raft_term_at(index) == term) drop = (size_t)(index - g_raft.snap_index);
+    g_raft.snap_index = index;
+    g_raft.snap_term = term;
+    g_raft.loading = loading;
+    if (!raft_save_state()) return false;
+    for (size_t k = 0; k < drop; ++k) mem_free(MEM_REPL_BACKLOG, g_raft.log[k].data);
+    g_raft.nlog -= drop;
+    memmove(g_raft.log, g_raft.log + drop, g_raft.nlog * sizeof *g_raft.log);
+    if (g_raft.synced < index) g_raft.synced = index;
+
+    int fd = open(RAFT_LOG_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+    for (size_t k = 0; k < g_raft.nlog && ok; ++k) {
+        const RaftEntry *e = &g_raft.log[k];
+        RaftRec r = { index + k + 1, e->term, e->len };
+        struct iovec iov[2] = { { &r, sizeof r }, { e->data, e->len } };
+        ok = writev(fd, iov, 2) == (ssize_t)(sizeof r + e->len);
+    }
+    if (!ok || fsync(fd) != 0 || rename(RAFT_LOG_FILE ".tmp", RAFT_LOG_FILE) != 0) {
+        perror(RAFT_LOG_FILE);
+        if (fd >= 0) close(fd);
+        (void)unlink(RAFT_LOG_FILE ".tmp");
+        return true;
+    }
+    close(g_raft.log_fd);
+    g_raft.log_fd = fd;
+    g_raft.log_bytes = 0;
+    for (size_t k = 0; k < g_raft.nlog; ++k) {
+        g_raft.log[k].off = g_raft.log_bytes;
+        g_raft.log_bytes += sizeof(RaftRec) + g_raft.log[k].len;
+    }
+    g_raft.unsynced = false;
+    g_raft.synced = raft_last();
+    return true;
+}
+
+// Reemplaza el almacén por el contenido de RAFT_SNAP_FILE.
+static bool raft_load_snapshot(void) {
+    if (g_export.running) export_finish(false);
+    g_raft.snapping = false;
+    while (g_nsnaps > 0) (void)snap_release(g_snaps[0].id);
+    FILE *fp = fopen(RAFT_SNAP_FILE, "rb");
+    char *val = fp ? mem_alloc(MEM_REPL_BACKLOG, EXPORT_MAX_VALUE) : NULL;
+    if (!val || kv_flushall(true) != 0) {
+        perror(RAFT_SNAP_FILE);
+        if (fp) fclose(fp);
+        mem_free(MEM_REPL_BACKLOG, val);
+        return false;
+    }
+    bool ok = true;
+    size_t keys = 0;
+    int klen;
+    while (ok && (klen = fgetc(fp)) != EOF) {
+        char key[100];
+        uint32_t vlen = 0;
+        ok = klen > 0 && klen < (int)sizeof key && fread(key, 1, (size_t)klen, fp) == (size_t)klen &&
+             fread(&vlen, sizeof vlen, 1, fp) == 1 && vlen <= EXPORT_MAX_VALUE &&
+             fread(val, 1, vlen, fp) == vlen;
+        if (!ok) break;
+        key[klen] = '\0';
+        ok = kv_set(key, val, vlen) == 0;
+        ++keys;
+    }
+    fclose(fp);
+    mem_free(MEM_REPL_BACKLOG, val);
+    if (!ok || !raft_sync_store()) {
+        fprintf(stderr, RAFT_SNAP_FILE ": no se pudo cargar el snapshot\n");
+        return false;
+    }
+    g_raft.loading = false;
+    (void)raft_save_state();
+    if (g_raft.applied < g_raft.snap_index) g_raft.applied = g_raft.snap_index;
+    if (g_raft.commit < g_raft.snap_index) g_raft.commit = g_raft.snap_index;
+    ++g_raft.snaps_installed;
+    printf("Raft: snapshot hasta %llu cargado (%zu claves)\n", (unsigned long long)g_raft.snap_index, keys);
+    return true;
+}
+
+// Responde a los clientes que esperan la confirmación de sus escrituras.
+static void raft_answer(RaftWaiter *w, const char *msg) {
+    (void)send(w->fd, msg, strlen(msg), MSG_NOSIGNAL);
+    close(w->fd);
+}
+
+static void raft_fail_waiters(const char *msg) {
+    for (size_t i = 0; i < g_raft.nwaiters; ++i) raft_answer(&g_raft.waiters[i], msg);
+    g_raft.nwaiters = 0;
+}
+
+// Aplica al almacén las entradas confirmadas y contesta a quien las esperaba.
+static void raft_apply(void) {
+    size_t answered = 0;
+    while (g_raft.applied < g_raft.commit && !g_raft.loading) {
+        uint64_t i = ++g_raft.applied;
+        const RaftEntry *e = raft_entry(i);
+        int r = 0;
+        if (e->len >= 2) {
+            const char *key = e->data + 1;
+            size_t klen = strnlen(key, e->len - 1);
+            if (e->data[0] == 'S' && klen + 2 <= e->len) r = kv_set(key, key + klen + 1, e->len - klen - 2);
+            else if (e->data[0] == 'D') (void)kv_del(key);
+            else if (e->data[0] == 'U') (void)kv_unlink(key);
+        }
+        for (; answered < g_raft.nwaiters && g_raft.waiters[answered].index <= i; ++answered)
+            raft_answer(&g_raft.waiters[answered], r == 0 ? "OK\n" : "ERROR: No se pudo crear\n");
+    }
+    if (answered == 0) return;
+    g_raft.nwaiters -= answered;
+    memmove(g_raft.waiters, g_raft.waiters + answered, g_raft.nwaiters * sizeof *g_raft.waiters);
+}
+
+static void raft_peer_reset(int p) {
+    RaftPeer *pe = &g_raft.peers[p];
+    if (pe->snap_fd >= 0) close(pe->snap_fd);
+    *pe = (RaftPeer){ .next = raft_last() + 1, .snap_fd = -1, .retry_at = pe->retry_at };
+}
+
+static void raft_sock_close(size_t s) {
+    RaftSock *k = &g_raft.socks[s];
+    if (!k->used) return;
+    close(k->fd);
+    buf_free(&k->in);
+    buf_free(&k->out);
+    k->used = false;
+    if (k->peer < 0) return;
+    RaftPeer *pe = &g_raft.peers[k->peer];
+    if (pe->snap_fd >= 0) close(pe->snap_fd);
+    pe->snap_fd = -1;
+    pe->snap_wait = false;
+    pe->inflight = 0;
+    pe->next = raft_last() + 1;            // lo enviado pudo perderse: se vuelve a sondear
+    pe->retry_at = now_us() + RAFT_RETRY_MS * 1000ull;
+}
+
+// Envía lo pendiente sin bloquear; false si se cerró la conexión.
+static bool raft_flush(size_t s) {
+    RaftSock *k = &g_raft.socks[s];
+    size_t done = 0;
+    while (done < k->out.len) {
+        ssize_t w = send(k->fd, k->out.p + done, k->out.len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w >= 0) { done += (size_t)w; continue; }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        raft_sock_close(s);
+        return false;
+    }
+    if (done == 0) return true;
+    k->out.len -= done;
+    memmove(k->out.p, k->out.p + done, k->out.len);
+    return true;
+}
+
+static bool raft_send(size_t s, RaftMsg *m, const void *payload, size_t len) {
+    RaftSock *k = &g_raft.socks[s];
+    if (!k->used || k->connecting) return false;
+    m->from = (uint8_t)g_raft.self;
+    m->term = g_raft.term;
+    uint32_t total = (uint32_t)(sizeof *m + len);
+    if (k->out.len + sizeof total + total > RAFT_MAX_OUT || !buf_append(&k->out, &total, sizeof total) ||
+        !buf_append(&k->out, m, sizeof *m) || (len && !buf_append(&k->out, payload, len))) {
+        raft_sock_close(s);
+        return false;
+    }
+    return raft_flush(s);
+}
+
+static void raft_connect(int p) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); return; }
+    int one = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)(g_raft.ports[p] + RAFT_PORT_OFFSET));
+    int r = connect(fd, (struct sockaddr *)&addr, sizeof addr);
+    if (r != 0 && errno != EINPROGRESS) {
+        close(fd);
+        g_raft.peers[p].retry_at = now_us() + RAFT_RETRY_MS * 1000ull;
+        return;
+    }
+    g_raft.socks[p] = (RaftSock){ .used = true, .connecting = r != 0, .fd = fd, .peer = p,
+                                  .in = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_CONN_BUFFERS },
+                                  .out = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_OUTPUT } };
+}
+
+// Deja de ser líder o candidato (y adopta term si es mayor).
+static void raft_step_down(uint64_t term, int leader) {
+    if (g_raft.role == RAFT_LEADER) {
+        raft_fail_waiters("ERROR: Se perdio el liderazgo, resultado incierto\n");
+        for (int p = 0; p < g_raft.n; ++p) raft_peer_reset(p);
+    }
+    g_raft.role = RAFT_FOLLOWER;
+    g_raft.leader = leader;
+    if (term <= g_raft.term) return;
+    g_raft.term = term;
+    g_raft.voted = -1;
+    (void)raft_save_state();
+}
+
+// Mensaje válido del líder del mandato term.
+static void raft_follow(uint64_t term, int leader) {
+    if (term > g_raft.term || g_raft.role != RAFT_FOLLOWER) raft_step_down(term, leader);
+    g_raft.leader = leader;
+    g_raft.contact_us = now_us();
+    g_raft.deadline_us = raft_timeout();
+}
+
+static void raft_become_leader(void) {
+    g_raft.role = RAFT_LEADER;
+    g_raft.leader = g_raft.self;
+    g_raft.leader_since = now_us();
+    for (int p = 0; p < g_raft.n; ++p) raft_peer_reset(p);
+    const char noop = 'N';
+    if (!raft_log_append(g_raft.term, &noop, 1)) {
+        raft_step_down(g_raft.term, -1);
+        return;
+    }
+    g_raft.noop_index = raft_last();
+    printf("Raft: lider del mandato %llu\n", (unsigned long long)g_raft.term);
+}
+
+static void raft_start_election(void) {
+    g_raft.role = RAFT_CANDIDATE;
+    g_raft.leader = -1;
+    ++g_raft.term;
+    g_raft.voted = g_raft.self;
+    g_raft.votes = 1u << g_raft.self;
+    g_raft.deadline_us = raft_timeout();
+    ++g_raft.elections;
+    if (!raft_save_state()) return;
+    if (g_raft.n == 1) { raft_become_leader(); return; }
+    RaftMsg m = { .type = RAFT_VOTE, .a = raft_last(), .b = raft_term_at(raft_last()) };
+    for (int p = 0; p < g_raft.n; ++p)
+        if (p != g_raft.self) (void)raft_send((size_t)p, &m, NULL, 0);
+}
+
+// Lecturas con lease: sólo el líder, con lo confirmado ya aplicado.
+static bool raft_can_read(void) {
+    if (g_raft.role != RAFT_LEADER || g_raft.commit < g_raft.noop_index || g_raft.applied < g_raft.commit)
+        return false;
+    uint64_t v[RAFT_MAX_NODES], now = now_us();
+    for (int p = 0; p < g_raft.n; ++p) v[p] = p == g_raft.self ? now : g_raft.peers[p].ack_us;
+    return raft_quorum(v) + RAFT_LEASE_MS * 1000ull > now;
+}
+
+static void raft_advance_commit(void) {
+    uint64_t v[RAFT_MAX_NODES];
+    for (int p = 0; p < g_raft.n; ++p) v[p] = p == g_raft.self ? g_raft.synced : g_raft.peers[p].match;
+    uint64_t q = raft_quorum(v);
+    // sólo entradas del mandato actual (las anteriores quedan confirmadas con ellas)
+    if (q > g_raft.commit && raft_term_at(q) == g_raft.term) g_raft.commit = q;
+    raft_apply();
+}
+
+static bool raft_send_append(int p, uint64_t now) {
+    RaftPeer *pe = &g_raft.peers[p];
+    uint64_t prev = pe->next - 1, i = pe->next;
+    RaftMsg m = { .type = RAFT_APPEND, .a = prev, .b = raft_term_at(prev), .c = g_raft.commit, .sent_us = now };
+    Buf *b = &g_raft.scratch;
+    b->len = 0;
+    for (; i <= raft_last(); ++i) {
+        const RaftEntry *e = raft_entry(i);
+        if (i > pe->next && b->len + sizeof(RaftWire) + e->len > RAFT_BATCH_BYTES) break;
+        RaftWire w = { e->term, e->len };
+        if (!buf_append(b, &w, sizeof w) || !buf_append(b, e->data, e->len)) return false;
+    }
+    m.n = (uint32_t)(i - pe->next);
+    if (!raft_send((size_t)p, &m, b->p, b->len)) return false;
+    pe->last_send = now;
+    ++g_raft.append_msgs;
+    if (m.n > 0) {
+        pe->next = i;
+        ++pe->inflight;
+        g_raft.append_entries += m.n;
+    }
+    return true;
+}
+
+// Un tramo del snapshot por vez: el siguiente sale con la respuesta.
+static void raft_send_snapshot(int p, uint64_t now) {
+    RaftPeer *pe = &g_raft.peers[p];
+    if (pe->snap_fd < 0) {
+        pe->snap_fd = open(RAFT_SNAP_FILE, O_RDONLY | O_CLOEXEC);
+        if (pe->snap_fd < 0) { perror(RAFT_SNAP_FILE); return; }
+        pe->snap_index = g_raft.snap_index;
+        pe->snap_term = g_raft.snap_term;
+        pe->snap_off = 0;
+        pe->snap_wait = false;
+        ++g_raft.snaps_sent;
+    }
+    if (pe->snap_wait) return;
+    if (!buf_reserve(&g_raft.scratch, RAFT_SNAP_CHUNK)) return;
+    ssize_t r = pread(pe->snap_fd, g_raft.scratch.p, RAFT_SNAP_CHUNK, (off_t)pe->snap_off);
+    if (r < 0) {
+        perror(RAFT_SNAP_FILE);
+        close(pe->snap_fd);
+        pe->snap_fd = -1;
+        return;
+    }
+    RaftMsg m = { .type = RAFT_SNAP, .ok = r < (ssize_t)RAFT_SNAP_CHUNK, .a = pe->snap_index,
+                  .b = pe->snap_term, .c = pe->snap_off, .sent_us = now };
+    if (!raft_send((size_t)p, &m, g_raft.scratch.p, (size_t)r)) return;
+    pe->snap_wait = true;
+    pe->last_send = now;
+}
+
+// Manda a p lo que le falta, en lotes y sin esperar las respuestas (hasta
+// RAFT_MAX_INFLIGHT), o un latido si no hubo nada en RAFT_HEARTBEAT_MS.
+static void raft_replicate(int p, uint64_t now) {
+    RaftPeer *pe = &g_raft.peers[p];
+    const RaftSock *k = &g_raft.socks[p];
+    if (!k->used || k->connecting) return;
+    if (pe->next <= g_raft.snap_index || pe->snap_fd >= 0) {
+        raft_send_snapshot(p, now);
+        return;
+    }
+    bool sent = false;
+    while (pe->inflight < RAFT_MAX_INFLIGHT && pe->next <= raft_last()) {
+        if (!raft_send_append(p, now)) return;
+        sent = true;
+    }
+    if (!sent && now - pe->last_send >= RAFT_HEARTBEAT_MS * 1000ull) (void)raft_send_append(p, now);
+}
+
+static void raft_on_vote(size_t s, const RaftMsg *m) {
+    RaftMsg r = { .type = RAFT_VOTE_R };
+    // Con un líder vivo (o recién arrancado) no se vota: es lo que sostiene el lease.
+    bool sticky = g_raft.role == RAFT_LEADER || now_us() - g_raft.contact_us < RAFT_ELECTION_MIN_MS * 1000ull;
+    if (!sticky && m->term > g_raft.term) raft_step_down(m->term, -1);
+    uint64_t last = raft_last(), lterm = raft_term_at(last);
+    bool uptodate = m->b > lterm || (m->b == lterm && m->a >= last);
+    if (!sticky && m->term == g_raft.term && (g_raft.voted < 0 || g_raft.voted == m->from) && uptodate) {
+        g_raft.voted = m->from;
+        if (raft_save_state()) {
+            r.ok = 1;
+            g_raft.deadline_us = raft_timeout();
+        }
+    }
+    (void)raft_send(s, &r, NULL, 0);
+}
+
+static void raft_on_append(size_t s, const RaftMsg *m, const char *p, size_t len) {
+    RaftMsg r = { .type = RAFT_APPEND_R, .n = m->n, .sent_us = m->sent_us };
+    if (m->term < g_raft.term) { (void)raft_send(s, &r, NULL, 0); return; }
+    raft_follow(m->term, m->from);
+    if (m->a > raft_last()) {
+        r.a = raft_last() + 1;
+        (void)raft_send(s, &r, NULL, 0);
+        return;
+    }
+    if (m->a > g_raft.snap_index && raft_term_at(m->a) != m->b) {
+        // reintentar desde la primera entrada del mandato que no coincide
+        uint64_t t = raft_term_at(m->a), i = m->a;
+        while (i > g_raft.snap_index + 1 && raft_term_at(i - 1) == t) --i;
+        r.a = i;
+        (void)raft_send(s, &r, NULL, 0);
+        return;
+    }
+    uint64_t idx = m->a;
+    size_t off = 0;
+    for (uint32_t k = 0; k < m->n; ++k) {
+        RaftWire w;
+        if (len - off < sizeof w) break;
+        memcpy(&w, p + off, sizeof w);
+        off += sizeof w;
+        if (w.len > len - off || w.len == 0) break;
+        const char *data = p + off;
+        off += (size_t)w.len;
+        if (++idx <= g_raft.snap_index) continue;
+        if (idx <= raft_last()) {
+            if (raft_term_at(idx) == w.term) continue;
+            raft_log_truncate(idx);        // nunca algo confirmado: el líder lo tiene igual
+        }
+        if (!raft_log_append(w.term, data, (size_t)w.len)) break;
+    }
+    if (idx != m->a + m->n || !raft_log_sync()) {
+        r.a = (idx < raft_last() ? idx : raft_last()) + 1;
+        (void)raft_send(s, &r, NULL, 0);
+        return;
+    }
+    r.ok = 1;
+    r.a = idx;
+    uint64_t c = m->c < idx ? m->c : idx;
+    if (c > g_raft.commit) g_raft.commit = c;
+    (void)raft_send(s, &r, NULL, 0);
+    raft_apply();
+}
+
+// Snapshot del líder ya recibido en RAFT_SNAP_FILE: reemplaza al almacén.
+static bool raft_install(uint64_t index, uint64_t term) {
+    if (index <= g_raft.applied) return true;
+    return raft_set_snapshot(index, term, true) && raft_load_snapshot();
+}
+
+static void raft_on_snapshot(size_t s, const RaftMsg *m, const char *p, size_t len) {
+    RaftMsg r = { .type = RAFT_SNAP_R, .sent_us = m->sent_us };
+    if (m->term < g_raft.term) { (void)raft_send(s, &r, NULL, 0); return; }
+    raft_follow(m->term, m->from);
+    if (m->c == 0) {
+        if (g_raft.recv_fd >= 0) close(g_raft.recv_fd);
+        g_raft.recv_fd = open(RAFT_RECV_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (g_raft.recv_fd < 0) perror(RAFT_RECV_FILE);
+        g_raft.recv_off = 0;
+    }
+    if (g_raft.recv_fd < 0 || m->c != g_raft.recv_off || (len && write_all(g_raft.recv_fd, p, len) < 0)) {
+        (void)raft_send(s, &r, NULL, 0);   // volver a empezar
+        return;
+    }
+    g_raft.recv_off += len;
+    r.ok = 1;
+    r.a = g_raft.recv_off;
+    if (m->ok) {
+        bool ok = fsync(g_raft.recv_fd) == 0;
+        close(g_raft.recv_fd);
+        g_raft.recv_fd = -1;
+        if (ok && rename(RAFT_RECV_FILE, RAFT_SNAP_FILE) == 0 && raft_install(m->a, m->b)) {
+            r.b = m->a;
+        } else {
+            perror(RAFT_SNAP_FILE);
+            r.ok = 0;
+            r.a = 0;
+        }
+    }
+    (void)raft_send(s, &r, NULL, 0);
+}
+
+static void raft_on_reply(int p, const RaftMsg *m) {
+    if (m->term > g_raft.term) {
+        raft_step_down(m->term, -1);
+        return;
+    }
+    if (m->term != g_raft.term) return;
+    if (m->type == RAFT_VOTE_R) {
+        if (g_raft.role != RAFT_CANDIDATE || !m->ok) return;
+        g_raft.votes |= 1u << p;
+        if (__builtin_popcount(g_raft.votes) > g_raft.n / 2) raft_become_leader();
+        return;
+    }
+    if (g_raft.role != RAFT_LEADER) return;
+    RaftPeer *pe = &g_raft.peers[p];
+    // la respuesta a un pedido de este liderazgo: p no vota a otro por un rato
+    if (m->sent_us >= g_raft.leader_since && m->sent_us > pe->ack_us) pe->ack_us = m->sent_us;
+    if (m->type == RAFT_SNAP_R) {
+        if (pe->snap_fd < 0) return;
+        pe->snap_wait = false;
+        pe->snap_off = m->a;
+        if (m->b != 0) {
+            close(pe->snap_fd);
+            pe->snap_fd = -1;
+            if (m->b > pe->match) pe->match = m->b;
+            pe->next = pe->match + 1;
+        }
+    } else {
+        if (m->n > 0 && pe->inflight > 0) --pe->inflight;
+        if (m->ok) {
+            if (m->a > pe->match) pe->match = m->a;
+            if (pe->next <= pe->match) pe->next = pe->match + 1;
+        } else if (m->a < pe->next) {
+            pe->next = m->a > pe->match ? m->a : pe->match + 1;
+            pe->inflight = 0;
+        }
+    }
+    raft_advance_commit();
+    if (g_raft.role == RAFT_LEADER) raft_replicate(p, now_us());
+}
+
+static void raft_dispatch(size_t s, const RaftMsg *m, const char *p, size_t len) {
+    int peer = g_raft.socks[s].peer;
+    if (m->from >= g_raft.n || m->from == g_raft.self) return;
+    switch (m->type) {
+        case RAFT_VOTE: if (peer < 0) raft_on_vote(s, m); break;
+        case RAFT_APPEND: if (peer < 0) raft_on_append(s, m, p, len); break;
+        case RAFT_SNAP: if (peer < 0) raft_on_snapshot(s, m, p, len); break;
+        case RAFT_VOTE_R:
+        case RAFT_APPEND_R:
+        case RAFT_SNAP_R: if (peer == m->from) raft_on_reply(peer, m); break;
+        default: break;
+    }
+}
+
+static void raft_read(size_t s) {
+    RaftSock *k = &g_raft.socks[s];
+    for (;;) {
+        if (!buf_reserve(&k->in, RAFT_SNAP_CHUNK)) { raft_sock_close(s); return; }
+        ssize_t r = recv(k->fd, k->in.p + k->in.len, k->in.cap - k->in.len, MSG_DONTWAIT);
+        if (r > 0) { k->in.len += (size_t)r; continue; }
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) { raft_sock_close(s); return; }
+        break;
+    }
+    size_t off = 0;
+    while (k->in.len - off >= sizeof(uint32_t)) {
+        uint32_t total;
+        memcpy(&total, k->in.p + off, sizeof total);
+        if (total < sizeof(RaftMsg) || total > RAFT_MAX_MSG) { raft_sock_close(s); return; }
+        if (k->in.len - off - sizeof total < total) break;
+        RaftMsg m;
+        memcpy(&m, k->in.p + off + sizeof total, sizeof m);
+        raft_dispatch(s, &m, k->in.p + off + sizeof total + sizeof m, total - sizeof m);
+        if (!k->used) return;              // la respuesta pudo cerrar la conexión
+        off += sizeof total + total;
+    }
+    k->in.len -= off;
+    memmove(k->in.p, k->in.p + off, k->in.len);
+}
+
+static void raft_accept(void) {
+    for (int n = 0; n < ACCEPT_BATCH; ++n) {
+        int fd = accept4(g_raft.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+        size_t s = RAFT_MAX_NODES;
+        while (s < RAFT_MAX_SOCKS && g_raft.socks[s].used) ++s;
+        if (s == RAFT_MAX_SOCKS) { close(fd); continue; }
+        int one = 1;
+        (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        g_raft.socks[s] = (RaftSock){ .used = true, .connecting = false, .fd = fd, .peer = -1,
+                                      .in = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_CONN_BUFFERS },
+                                      .out = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_OUTPUT } };
+    }
+}
+
+// Para el poll() de main(): el socket s (RAFT_MAX_SOCKS es el listener).
+static bool raft_poll_slot(size_t s, struct pollfd *pfd) {
+    if (s == RAFT_MAX_SOCKS) {
+        if (g_raft.listen_fd < 0) return false;
+        *pfd = (struct pollfd){ .fd = g_raft.listen_fd, .events = POLLIN, .revents = 0 };
+        return true;
+    }
+    const RaftSock *k = &g_raft.socks[s];
+    if (!k->used) return false;
+    *pfd = (struct pollfd){ .fd = k->fd, .events = (short)(POLLIN | (k->connecting || k->out.len ? POLLOUT : 0)),
+                            .revents = 0 };
+    return true;
+}
+
+static void raft_on_event(size_t s, int fd, short revents) {
+    if (s == RAFT_MAX_SOCKS) { raft_accept(); return; }
+    RaftSock *k = &g_raft.socks[s];
+    if (!k->used || k->fd != fd) return;   // se cerró (y quizás se reusó) en esta vuelta
+    if (k->connecting) {
+        int err = 0;
+        socklen_t elen = sizeof err;
+        if (getsockopt(k->fd, SOL_SOCKET, SO_ERROR, &err, &elen) != 0) err = errno;
+        if (err != 0 || (revents & (POLLERR | POLLHUP))) { raft_sock_close(s); return; }
+        if (!(revents & POLLOUT)) return;
+        k->connecting = false;
+    }
+    if ((revents & POLLOUT) && !raft_flush(s)) return;
+    if (revents & (POLLIN | POLLHUP | POLLERR)) raft_read(s);
+}
+
+// Compactación: pasadas --raft-snap entradas aplicadas desde el último
+// snapshot se exporta el almacén (de a tramos, como EXPORT) y al terminar se
+// descartan del registro las entradas que cubre.
+static void raft_snapshot_step(void) {
+    if (g_raft.snapping) {
+        if (g_export.running) return;
+        g_raft.snapping = false;
+        if (g_exports_done == g_raft.exports_before || g_raft.snapping_index <= g_raft.snap_index) return;
+        if (raft_sync_store() && raft_set_snapshot(g_raft.snapping_index, g_raft.snapping_term, false))
+            ++g_raft.snaps_taken;
+        return;
+    }
+    if (g_raft.loading || g_export.running || g_raft.applied - g_raft.snap_index < (uint64_t)g_cfg.raft_snap) return;
+    uint64_t id;
+    g_raft.exports_before = g_exports_done;
+    if (export_begin(RAFT_SNAP_FILE, true, &id) != 0) return;
+    g_raft.snapping = true;
+    g_raft.snapping_index = g_raft.applied;
+    g_raft.snapping_term = raft_term_at(g_raft.applied);
+}
+
+// Una vez por vuelta del bucle (y en reposo).
+static void raft_tick(void) {
+    if (g_raft.n == 0) return;
+    uint64_t now = now_us();
+    raft_snapshot_step();
+    for (int p = 0; p < g_raft.n; ++p)
+        if (p != g_raft.self && !g_raft.socks[p].used && now >= g_raft.peers[p].retry_at) raft_connect(p);
+    if (g_raft.role != RAFT_LEADER) {
+        if (now >= g_raft.deadline_us) raft_start_election();
+        return;
+    }
+    (void)raft_log_sync();
+    // sin noticias de la mayoría durante una elección entera: puede haber otro líder
+    uint64_t v[RAFT_MAX_NODES];
+    for (int p = 0; p < g_raft.n; ++p) {
+        uint64_t ack = g_raft.peers[p].ack_us;
+        v[p] = p == g_raft.self ? now : ack > g_raft.leader_since ? ack : g_raft.leader_since;
+    }
+    if (now - raft_quorum(v) > RAFT_ELECTION_MAX_MS * 1000ull) {
+        fprintf(stderr, "Raft: sin contacto con la mayoria, deja de ser lider\n");
+        raft_step_down(g_raft.term, -1);
+        g_raft.deadline_us = raft_timeout();
+        return;
+    }
+    for (int p = 0; p < g_raft.n && g_raft.role == RAFT_LEADER; ++p)
+        if (p != g_raft.self) raft_replicate(p, now);
+    if (g_raft.role == RAFT_LEADER) raft_advance_commit();
+}
+
+// Lee el estado y el registro de .raft/ (recortando una entrada a medias al
+// final) y termina de cargar un snapshot interrumpido; main() abre el puerto
+// entre nodos. Al arrancar no se vota durante RAFT_ELECTION_MIN_MS: el nodo pudo
+// haber sostenido un lease antes de caerse.
+static bool raft_open(void) {
+    char list[128];
+    if ((size_t)snprintf(list, sizeof list, "%s", g_cfg.raft_peers) >= sizeof list) {
+        fprintf(stderr, "--raft: lista demasiado larga\n");
+        return false;
+    }
+    for (int p = 0; p < RAFT_MAX_NODES; ++p) g_raft.peers[p].snap_fd = -1;
+    g_raft.self = -1;
+    for (char *t = list, *next; t; t = next) {   // sin strtok: "5001,,5002" no vale
+        next = strchr(t, ',');
+        if (next) *next++ = '\0';
+        char *end;
+        errno = 0;
+        long port = strtol(t, &end, 10);
+        if (end == t || *end != '\0' || errno != 0 || g_raft.n == RAFT_MAX_NODES || port < 1 ||
+            port + RAFT_PORT_OFFSET > 65535) {
+            fprintf(stderr, "--raft: hasta %d puertos entre 1 y %d (no '%s')\n", RAFT_MAX_NODES,
+                    65535 - RAFT_PORT_OFFSET, t);
+            g_raft.n = 0;
+            return false;
+        }
+        for (int p = 0; p < g_raft.n; ++p)
+            if (g_raft.ports[p] == port) {
+                fprintf(stderr, "--raft: puerto repetido %ld\n", port);
+                g_raft.n = 0;
+                return false;
+            }
+        if (port == g_cfg.port) g_raft.self = g_raft.n;
+        g_raft.ports[g_raft.n++] = (int)port;
+    }
+    // Con 1 nodo no hay replicación, con 2 cualquier caída frena las
+    // escrituras y con 4 se tolera una caída, igual que con 3.
+    if (g_raft.n != 3 && g_raft.n != 5) {
+        fprintf(stderr, "--raft: hacen falta 3 o 5 puertos (hay %d)\n", g_raft.n);
+        g_raft.n = 0;
+        return false;
+    }
+    if (g_raft.self < 0) {
+        fprintf(stderr, "--raft: falta el puerto propio (%d)\n", g_cfg.port);
+        g_raft.n = 0;
+        return false;
+    }
+    if (mkdir(RAFT_DIR, 0755) != 0 && errno != EEXIST) { perror(RAFT_DIR); return false; }
+    FILE *fp = fopen(RAFT_STATE_FILE, "r");
+    if (fp) {
+        unsigned long long term, si, st;
+        int voted, loading;
+        if (fscanf(fp, "%llu %d %llu %llu %d", &term, &voted, &si, &st, &loading) == 5) {
+            g_raft.term = term;
+            g_raft.voted = voted;
+            g_raft.snap_index = si;
+            g_raft.snap_term = st;
+            g_raft.loading = loading != 0;
+        }
+        fclose(fp);
+    }
+
+    int fd = open(RAFT_LOG_FILE, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) != 0) {
+        perror(RAFT_LOG_FILE);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    g_raft.log_fd = fd;
+    uint64_t off = 0, size = (uint64_t)sb.st_size;
+    RaftRec r;
+    while (size - off >= sizeof r && pread(fd, &r, sizeof r, (off_t)off) == (ssize_t)sizeof r &&
+           r.len > 0 && r.len <= size - off - sizeof r && r.len <= RAFT_MAX_MSG) {
+        if (r.index > g_raft.snap_index) {
+            char *data = r.index == raft_last() + 1 ? mem_alloc(MEM_REPL_BACKLOG, (size_t)r.len) : NULL;
+            if (!data || pread(fd, data, (size_t)r.len, (off_t)(off + sizeof r)) != (ssize_t)r.len ||
+                !raft_log_push(r.term, off, data, (size_t)r.len)) {
+                mem_free(MEM_REPL_BACKLOG, data);
+                break;
+            }
+        }
+        off += sizeof r + r.len;
+    }
+    if (off < size) {
+        fprintf(stderr, RAFT_LOG_FILE ": entrada incompleta en el byte %llu, se recorta\n", (unsigned long long)off);
+        if (ftruncate(fd, (off_t)off) != 0) perror(RAFT_LOG_FILE);
+    }
+    g_raft.log_bytes = off;
+    g_raft.synced = raft_last();
+    g_raft.commit = g_raft.applied = g_raft.snap_index;
+    if (g_raft.loading && !raft_load_snapshot()) return false;
+
+    srand((unsigned)(getpid() ^ now_us()));
+    g_raft.contact_us = now_us();
+    g_raft.deadline_us = raft_timeout();
+    printf("Raft: nodo %d de %d (puerto %d), mandato %llu, registro hasta %llu, snapshot hasta %llu\n",
+           g_raft.self + 1, g_raft.n, g_cfg.port + RAFT_PORT_OFFSET, (unsigned long long)g_raft.term,
+           (unsigned long long)raft_last(), (unsigned long long)g_raft.snap_index);
+    return true;
+}
+
+static void raft_close(void) {
+    if (g_raft.n == 0) return;
+    raft_fail_waiters("ERROR: Servidor cerrando, resultado incierto\n");
+    for (size_t s = 0; s < RAFT_MAX_SOCKS; ++s) raft_sock_close(s);
+    for (int p = 0; p < RAFT_MAX_NODES; ++p)
+        if (g_raft.peers[p].snap_fd >= 0) close(g_raft.peers[p].snap_fd);
+    if (g_raft.listen_fd >= 0) close(g_raft.listen_fd);
+    if (g_raft.recv_fd >= 0) close(g_raft.recv_fd);
+    (void)raft_log_sync();
+    if (g_raft.log_fd >= 0) close(g_raft.log_fd);
+    for (size_t k = 0; k < g_raft.nlog; ++k) mem_free(MEM_REPL_BACKLOG, g_raft.log[k].data);
+    mem_free(MEM_REPL_BACKLOG, g_raft.log);
+    buf_free(&g_raft.scratch);
+    g_raft.n = 0;
+}
+
+static void raft_not_leader(char *response, size_t cap) {
+    if (g_raft.role == RAFT_LEADER)
+        (void)snprintf(response, cap, "ERROR: Sin lease, reintentar\n");
+    else if (g_raft.leader >= 0)
+        (void)snprintf(response, cap, "ERROR: No soy lider, probar el puerto %d\n", g_raft.ports[g_raft.leader]);
+    else
+        (void)snprintf(response, cap, "ERROR: Sin lider, reintentar\n");
+}
+
+// Con --raft: SET/DEL/UNLINK van al registro y el cliente queda esperando la
+// confirmación (*keep), las lecturas necesitan el lease y las demás
+// escrituras no se replican. true si el pedido ya se atendió.
+static bool raft_request(int client_fd, const Request *req, char *response, size_t cap, bool *keep) {
+    switch (req->cmd) {
+        case CMD_SET:
+        case CMD_DEL:
+        case CMD_UNLINK:
+            break;
+        case CMD_GET:
+        case CMD_MGET:
+        case CMD_SNAPSHOT:
+        case CMD_PFCOUNT:
+        case CMD_GETBIT:
+        case CMD_BITCOUNT:
+            if (raft_can_read()) { ++g_raft.lease_reads; return false; }
+            ++g_raft.lease_misses;
+            raft_not_leader(response, cap);
+            return true;
+        case CMD_FLUSHALL:
+        case CMD_DELPREFIX:
+        case CMD_DELRANGE:
+        case CMD_PFADD:
+        case CMD_PFMERGE:
+        case CMD_SETBIT:
+        case CMD_BITOP:
+            (void)snprintf(response, cap, "ERROR: No disponible con --raft\n");
+            return true;
+        default:
+            return false;
+    }
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return true;
+    }
+    if (g_raft.role != RAFT_LEADER) {
+        raft_not_leader(response, cap);
+        return true;
+    }
+    if (g_raft.nwaiters == RAFT_MAX_WAITERS) {
+        (void)snprintf(response, cap, "ERROR: Demasiadas escrituras pendientes\n");
+        return true;
+    }
+    char entry[2 + sizeof req->key + sizeof req->value];
+    size_t klen = strlen(req->key), vlen = req->cmd == CMD_SET ? strlen(req->value) : 0;
+    entry[0] = req->cmd == CMD_SET ? 'S' : req->cmd == CMD_DEL ? 'D' : 'U';
+    memcpy(entry + 1, req->key, klen + 1);
+    memcpy(entry + 2 + klen, req->value, vlen);
+    if (!raft_log_append(g_raft.term, entry, 2 + klen + vlen)) {
+        (void)snprintf(response, cap, "ERROR: No se pudo escribir el registro\n");
+        return true;
+    }
+    g_raft.waiters[g_raft.nwaiters++] = (RaftWaiter){ client_fd, raft_last() };
+    *keep = true;
+    return true;
+}
+
+// ---------- parseo ----------
+static Command parse_cmd(const char *cmd_str) {
+    if (strcmp(cmd_str, "SET") == 0) return CMD_SET;
+    if (strcmp(cmd_str, "GET") == 0) return CMD_GET;
+    if (strcmp(cmd_str, "DEL") == 0) return CMD_DEL;
+    if (strcmp(cmd_str, "HOTKEYS") == 0) return CMD_HOTKEYS;
+    if (strcmp(cmd_str, "MEMORY") == 0) return CMD_MEMORY_STATS;   // subcomando en parse_request
+    if (strcmp(cmd_str, "TRACKING") == 0) return CMD_TRACKING;
+    if (strcmp(cmd_str, "STATS") == 0) return CMD_STATS;
+    if (strcmp(cmd_str, "MGET") == 0) return CMD_MGET;
+    if (strcmp(cmd_str, "RELOAD") == 0) return CMD_RELOAD;
+    if (strcmp(cmd_str, "SNAPSHOT") == 0) return CMD_SNAPSHOT;
+    if (strcmp(cmd_str, "SNAPGET") == 0) return CMD_SNAPGET;
+    if (strcmp(cmd_str, "RELEASE") == 0) return CMD_RELEASE;
+    if (strcmp(cmd_str, "EXPORT") == 0) return CMD_EXPORT;
+    if (strcmp(cmd_str, "UNLINK") == 0) return CMD_UNLINK;
+    if (strcmp(cmd_str, "FLUSHALL") == 0) return CMD_FLUSHALL;
+    if (strcmp(cmd_str, "DELPREFIX") == 0) return CMD_DELPREFIX;
+    if (strcmp(cmd_str, "DELRANGE") == 0) return CMD_DELRANGE;
+    if (strcmp(cmd_str, "PFADD") == 0) return CMD_PFADD;
+    if (strcmp(cmd_str, "PFCOUNT") == 0) return CMD_PFCOUNT;
+    if (strcmp(cmd_str, "PFMERGE") == 0) return CMD_PFMERGE;
+    if (strcmp(cmd_str, "SETBIT") == 0) return CMD_SETBIT;
+    if (strcmp(cmd_str, "GETBIT") == 0) return CMD_GETBIT;
+    if (strcmp(cmd_str, "BITCOUNT") == 0) return CMD_BITCOUNT;
+    if (strcmp(cmd_str, "BITOP") == 0) return CMD_BITOP;
+    if (strcmp(cmd_str, "CDCREAD") == 0) return CMD_CDCREAD;
+    if (strcmp(cmd_str, "CDCCOMMIT") == 0) return CMD_CDCCOMMIT;
+    if (strcmp(cmd_str, "CDCINFO") == 0) return CMD_CDCINFO;
+    return CMD_INVALID;
+}
+
+// 0 ok; <0 error de formato/parámetros
+static int parse_request(const char *buffer, Request *req) {
+    if (!buffer || !req) return -1;
+
+    char cmd_str[10] = {0};
+    memset(req, 0, sizeof *req);
+
+    // Formatos:
+    //   SET <key> <value...>
+    //   GET <key>
+    //   DEL <key>
+    //   HOTKEYS
+    //   MEMORY STATS
+    //   MEMORY USAGE <key>
+    //   TRACKING ON | TRACKING PREFIX <prefijo>
+    //   STATS
+    //   MGET <key> [<key>...]
+    //   RELOAD
+    //   SNAPSHOT
+    //   SNAPGET <id> <key>
+    //   RELEASE <id>
+    //   EXPORT <nombre>
+    //   UNLINK <key>
+    //   FLUSHALL [ASYNC]
+    //   DELPREFIX <prefijo>
+    //   DELRANGE <desde> <hasta>
+    //   PFADD <key> [<elemento>...]
+    //   PFCOUNT <key> [<key>...]
+    //   PFMERGE <destino> [<key>...]
+    //   SETBIT <key> <offset> <0|1>
+    //   GETBIT <key> <offset>
+    //   BITCOUNT <key> [<desde> <hasta>]
+    //   BITOP AND|OR|XOR <destino> <key> [<key>...]
+    //   CDCREAD <consumidor> [<max_bytes>]
+    //   CDCCOMMIT <consumidor> <seq>
+    //   CDCINFO
+    int matched = sscanf(buffer, "%9s %99s %1023[^\n]", cmd_str, req->key, req->value);
+    if (matched < 1) return -2; // sin comando
+
+    req->cmd = parse_cmd(cmd_str);
+    if (req->cmd == CMD_INVALID) return -3;
+
+    if (req->cmd == CMD_MEMORY_STATS) {
+        if (matched < 2) return -3;
+        if (strcmp(req->key, "USAGE") == 0) {
+            req->cmd = CMD_MEMORY_USAGE;
+            char key[100] = {0};
+            if (matched < 3 || sscanf(req->value, "%99s", key) != 1) return -4;
+            memcpy(req->key, key, sizeof key);
+            req->value[0] = '\0';
+        } else if (strcmp(req->key, "STATS") == 0) {
+            req->key[0] = '\0';
+        } else {
+            return -3;
+        }
+    }
+
+    if ((req->cmd == CMD_GET || req->cmd == CMD_DEL || req->cmd == CMD_MGET || req->cmd == CMD_UNLINK) && matched < 2) return -4; // falta clave
+    if (req->cmd == CMD_FLUSHALL && (matched > 2 || (matched == 2 && strcmp(req->key, "ASYNC") != 0))) return -3;
+    if ((req->cmd == CMD_RELEASE || req->cmd == CMD_EXPORT) && matched < 2) return -4;
+    if (req->cmd == CMD_SNAPGET && matched < 3) return -4;
+    if (req->cmd == CMD_DELPREFIX && matched < 2) return -4;
+    if (req->cmd == CMD_DELRANGE && matched < 3) return -4;
+    if ((req->cmd == CMD_PFADD || req->cmd == CMD_PFCOUNT || req->cmd == CMD_PFMERGE) && matched < 2) return -4;
+    if ((req->cmd == CMD_SETBIT || req->cmd == CMD_GETBIT || req->cmd == CMD_BITOP) && matched < 3) return -4;
+    if (req->cmd == CMD_BITCOUNT && matched < 2) return -4;
+    if (req->cmd == CMD_CDCREAD && matched < 2) return -4;
+    if (req->cmd == CMD_CDCCOMMIT && matched < 3) return -4;
+    if (req->cmd == CMD_TRACKING && matched < 2) return -3;
+    if (req->cmd == CMD_SET && matched < 3) return -5;                          // falta valor
+
+    return 0;
+}
+
+// ---------- handlers ----------
+static void handle_set(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    if (kv_set(req->key, req->value, strlen(req->value)) != 0) {
+        (void)snprintf(response, cap, "ERROR: No se pudo crear\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// Valor demasiado grande para la caché: respuesta truncada como siempre.
+static void get_truncated(const char *key, char *response, size_t cap) {
+    char contenido[BUFFER_SIZE];
+    ssize_t n = kv_get(key, contenido, BUFFER_SIZE - 1);
+    if (n < 0) {
+        (void)snprintf(response, cap, "NOTFOUND\n");
+        return;
+    }
+    contenido[n] = '\0';
+
+    // "OK\n" + contenido + "\n" => limitar explícitamente el %s
+    (void)snprintf(response, cap, "OK\n%.*s\n", (int)(BUFFER_SIZE - 5), contenido);
+}
+
+// Si el valor está en memoria devuelve una referencia a su respuesta ya armada
+// (no se copia a response); si no, arma la respuesta en response y devuelve NULL.
+static Value *handle_get(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return NULL;
+    }
+    bool found = false;
+    Value *v = kv_get_value(req->key, &found);
+    if (v) return v;
+    if (!found) {
+        (void)snprintf(response, cap, "NOTFOUND\n");
+        return NULL;
+    }
+    get_truncated(req->key, response, cap);
+    return NULL;
+}
+
+// MGET <clave>...: la respuesta de GET de cada clave, en orden, en un solo
+// envío. Las claves se buscan juntas con kv_get_values().
+#define MGET_MAX_KEYS 128
+
+static void handle_mget(int client_fd, const Request *req, char *response, size_t cap) {
+    char rest[BUFFER_SIZE];
+    const char *keys[MGET_MAX_KEYS];
+    size_t n = 0;
+    keys[n++] = req->key;
+    memcpy(rest, req->value, sizeof rest);
+    char *save = NULL;
+    for (char *t = strtok_r(rest, " \t\r", &save); t; t = strtok_r(NULL, " \t\r", &save)) {
+        if (n == MGET_MAX_KEYS) {
+            (void)snprintf(response, cap, "ERROR: Demasiadas claves\n");
+            return;
+        }
+        keys[n++] = t;
+    }
+
+    // Las claves inválidas no se buscan: se responde su error en su lugar.
+    const char *valid[MGET_MAX_KEYS];
+    size_t nvalid = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!clave_valida(keys[i]) || strlen(keys[i]) >= sizeof req->key) continue;
+        hotkeys_sample(keys[i]);
+        valid[nvalid++] = keys[i];
+    }
+    Value *vals[MGET_MAX_KEYS];
+    bool found[MGET_MAX_KEYS];
+    kv_get_values(valid, nvalid, vals, found);
+
+    OutQ q = OUTQ_INIT;
+    for (size_t i = 0, j = 0; i < n; ++i) {
+        if (j == nvalid || keys[i] != valid[j]) {
+            (void)outq_printf(&q, "ERROR: Clave invalida\n");
+            continue;
+        }
+        if (found[j]) tracking_note_read(client_fd, valid[j]);
+        if (vals[j]) {
+            (void)outq_value(&q, vals[j], 0, VALUE_HDR + vals[j]->len + 1);
+            value_unref(vals[j]);
+        } else if (found[j]) {
+            char one[BUFFER_SIZE];
+            get_truncated(valid[j], one, sizeof one);
+            (void)outq_bytes(&q, one, strlen(one));
+        } else {
+            (void)outq_printf(&q, "NOTFOUND\n");
+        }
+        ++j;
+    }
+    size_t sent = 0;
+    (void)outq_send(client_fd, &q, &sent, 0, NULL, NULL);
+    outq_free(&q);
+}
+
+static void handle_del(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    (void)kv_del(req->key); // ignorar resultado
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// UNLINK <clave>: como DEL, pero el valor se libera en segundo plano.
+static void handle_unlink(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    (void)kv_unlink(req->key); // como DEL: ignorar resultado
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// Respuesta: OK y una línea "<clave> <accesos estimados>" por clave, de mayor a menor.
+static void handle_hotkeys(char *response, size_t cap) {
+    HotKey sorted[HOTKEYS_TOPK];
+    size_t n = g_topk_len;
+    memcpy(sorted, g_topk, n * sizeof sorted[0]);
+    for (size_t i = 1; i < n; ++i) {
+        HotKey k = sorted[i];
+        size_t j = i;
+        while (j > 0 && sorted[j - 1].count < k.count) { sorted[j] = sorted[j - 1]; --j; }
+        sorted[j] = k;
+    }
+    size_t off = (size_t)snprintf(response, cap, "OK\n");
+    for (size_t i = 0; i < n && off < cap; ++i) {
+        unsigned long long est = (unsigned long long)sorted[i].count * HOTKEYS_SAMPLE;
+        off += (size_t)snprintf(response + off, cap - off, "%s %llu\n", sorted[i].key, est);
+    }
+}
+
+// Memoria por categoría + fragmentación del allocator (mallinfo2):
+// bytes pedidos al SO / bytes en uso por el programa.
+static void handle_memory_stats(char *response, size_t cap) {
+    size_t used[MEM_CAT_COUNT];
+    memcpy(used, g_mem_used, sizeof used);
+    used[MEM_CONN_BUFFERS] += g_clients_active * (BUFFER_SIZE + sizeof(Request));
+    used[MEM_OUTPUT] += g_clients_active * BUFFER_SIZE;
+    used[MEM_OTHER] += sizeof g_cms + sizeof g_topk;
+
+    size_t total = 0;
+    size_t off = (size_t)snprintf(response, cap, "OK\n");
+    for (size_t i = 0; i < MEM_CAT_COUNT && off < cap; ++i) {
+        total += used[i];
+        off += (size_t)snprintf(response + off, cap - off, "%s %zu\n", g_mem_names[i], used[i]);
+    }
+
+    struct mallinfo2 mi = mallinfo2();
+    size_t heap_os = mi.arena + mi.hblkhd;
+    size_t heap_used = mi.uordblks + mi.hblkhd;
+    double frag = heap_used ? (double)heap_os / (double)heap_used : 1.0;
+    if (off < cap)
+        (void)snprintf(response + off, cap - off,
+                       "total %zu\nheap_os %zu\nheap_used %zu\nrss %zu\nfragmentation_ratio %.2f\n"
+                       "defrag_runs %llu\ndefrag_released %llu\n",
+                       total, heap_os, heap_used, mem_rss(), frag,
+                       (unsigned long long)g_defrag_runs, (unsigned long long)g_defrag_released);
+}
+
+// Bytes que ocupa <key>: nombre + bloques asignados en disco + su entrada en la caché.
+static void handle_memory_usage(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    uint32_t len = 0;
+    if (g_ro) {                                     // registro + su ranura en el índice
+        if (!ro_find(g_ro, req->key, &len)) (void)snprintf(response, cap, "NOTFOUND\n");
+        else (void)snprintf(response, cap, "OK\n%llu\n",
+                            (unsigned long long)(8 + strlen(req->key) + len + RO_REPLY_EXTRA + sizeof(uint64_t)));
+        return;
+    }
+    ssize_t disk = store_disk_usage(req->key);
+    CacheEntry *e = cache_find(req->key);          // con write-back puede no estar aún en disco
+    if (disk < 0 && !e) {
+        (void)snprintf(response, cap, "NOTFOUND\n");
+        return;
+    }
+    unsigned long long bytes = (unsigned long long)strlen(req->key);
+    if (disk > 0) bytes += (unsigned long long)disk;
+    if (e) bytes += entry_bytes(e) + malloc_usable_size(e->val);
+    (void)snprintf(response, cap, "OK\n%llu\n", bytes);
+}
+
+// Contadores del servidor, una línea "<nombre> <valor>" por contador.
+static void handle_stats(char *response, size_t cap) {
+    pthread_mutex_lock(&g_lazy.mu);
+    size_t lazy_pending = g_lazy.pending_bytes;
+    uint64_t lazy_bytes = g_lazy.freed_bytes, lazy_files = g_lazy.freed_files, lazy_disk = g_lazy.freed_disk;
+    uint64_t tomb_moved = g_lazy.scan_moved;
+    pthread_mutex_unlock(&g_lazy.mu);
+    (void)snprintf(response, cap,
+                   "OK\n"
+                   "zerocopy_threshold %d\n"
+                   "zerocopy_sends %llu\n"
+                   "zerocopy_bytes %llu\n"
+                   "zerocopy_completions %llu\n"
+                   "zerocopy_copied %llu\n"
+                   "zerocopy_fallbacks %llu\n"
+                   "cache_limit %zu\n"
+                   "cache_bytes %zu\n"
+                   "cache_keys %zu\n"
+                   "cache_hits %llu\n"
+                   "cache_misses %llu\n"
+                   "cache_evictions %llu\n"
+                   "singleflight_shared %llu\n"
+                   "tier_promote %d\n"
+                   "tier_stubs %zu\n"
+                   "tier_demotions %llu\n"
+                   "tier_promotions %llu\n"
+                   "tier_cold_reads %llu\n"
+                   "dedup_min %d\n"
+                   "dedup_mem_hits %llu\n"
+                   "dedup_mem_saved %zu\n"
+                   "dedup_disk_hits %llu\n"
+                   "dedup_disk_blobs %llu\n"
+                   "dedup_disk_saved %llu\n"
+                   "writeback_ms %d\n"
+                   "writeback_dirty %zu\n"
+                   "writeback_absorbed %llu\n"
+                   "writeback_flushed %llu\n"
+                   "ro_keys %llu\n"
+                   "ro_bytes %zu\n"
+                   "ro_reloads %llu\n"
+                   "ehash_keys %llu\n"
+                   "ehash_buckets %llu\n"
+                   "ehash_overflow_pages %llu\n"
+                   "ehash_splits %llu\n"
+                   "ehash_page_reads %llu\n"
+                   "ehash_page_hits %llu\n"
+                   "mvcc_seq %llu\n"
+                   "mvcc_snapshots %zu\n"
+                   "mvcc_snapshots_expired %llu\n"
+                   "mvcc_versions %zu\n"
+                   "mvcc_versions_freed %llu\n"
+                   "export_running %d\n"
+                   "exports_done %llu\n"
+                   "exports_failed %llu\n"
+                   "lazy_pending_bytes %zu\n"
+                   "lazy_freed_bytes %llu\n"
+                   "lazy_freed_files %llu\n"
+                   "lazy_freed_disk %llu\n"
+                   "flushes %llu\n"
+                   "tombstones %zu\n"
+                   "tombstones_created %llu\n"
+                   "tombstones_done %llu\n"
+                   "tombstone_moved %llu\n"
+                   "tombstone_erased %llu\n"
+                   "hll_dense_conversions %llu\n"
+                   "bit_avx2 %d\n"
+                   "bit_simd_bytes %llu\n"
+                   "cdc_seq %llu\n"
+                   "cdc_segments %zu\n"
+                   "cdc_bytes %llu\n"
+                   "cdc_appends %llu\n"
+                   "cdc_errors %llu\n"
+                   "cdc_broken %llu\n"
+                   "cdc_syncs %llu\n"
+                   "cdc_segments_dropped %llu\n"
+                   "cdc_reads %llu\n"
+                   "cdc_read_bytes %llu\n"
+                   "raft_role %s\n"
+                   "raft_term %llu\n"
+                   "raft_leader_port %d\n"
+                   "raft_commit_index %llu\n"
+                   "raft_applied_index %llu\n"
+                   "raft_log_entries %zu\n"
+                   "raft_snapshot_index %llu\n"
+                   "raft_elections %llu\n"
+                   "raft_append_msgs %llu\n"
+                   "raft_append_entries %llu\n"
+                   "raft_log_syncs %llu\n"
+                   "raft_lease_reads %llu\n"
+                   "raft_lease_misses %llu\n"
+                   "raft_snapshots_taken %llu\n"
+                   "raft_snapshots_sent %llu\n"
+                   "raft_snapshots_installed %llu\n"
+                   "busy_poll_us %d\n"
+                   "busy_poll_spins %llu\n"
+                   "busy_poll_hits %llu\n"
+                   "busy_poll_sleeps %llu\n",
+                   g_cfg.zc_threshold,
+                   (unsigned long long)g_zc_sends, (unsigned long long)g_zc_bytes,
+                   (unsigned long long)g_zc_completions, (unsigned long long)g_zc_copied,
+                   (unsigned long long)g_zc_fallbacks,
+                   g_cfg.cache_bytes, g_cache_bytes, g_cache_count,
+                   (unsigned long long)g_cache_hits, (unsigned long long)g_cache_misses,
+                   (unsigned long long)g_cache_evictions, (unsigned long long)g_flight_shared,
+                   g_cfg.tier_promote, g_tier_stubs, (unsigned long long)g_tier_demotions,
+                   (unsigned long long)g_tier_promotions, (unsigned long long)g_tier_cold_reads,
+                   g_cfg.dedup_min, (unsigned long long)g_dedup_mem_hits, g_dedup_mem_saved,
+                   (unsigned long long)g_dedup_disk_hits, (unsigned long long)g_dedup_blobs,
+                   (unsigned long long)g_dedup_disk_saved,
+                   g_cfg.writeback_ms, g_ndirty, (unsigned long long)g_wb_absorbed, (unsigned long long)g_wb_flushed,
+                   (unsigned long long)(g_ro ? g_ro->nkeys : 0), g_ro ? g_ro->size : (size_t)0,
+                   (unsigned long long)g_ro_reloads,
+                   (unsigned long long)(g_eh.fd >= 0 ? g_eh.h.keys : 0),
+                   (unsigned long long)(g_eh.fd >= 0 ? eh_buckets() : 0),
+                   (unsigned long long)g_eh.h.ovf_pages, (unsigned long long)g_eh.splits,
+                   (unsigned long long)g_eh.reads, (unsigned long long)g_eh.hits,
+                   (unsigned long long)g_seq, g_nsnaps, (unsigned long long)g_snap_expired,
+                   g_ver_count, (unsigned long long)g_ver_freed, g_export.running ? 1 : 0,
+                   (unsigned long long)g_exports_done, (unsigned long long)g_exports_failed,
+                   lazy_pending, (unsigned long long)lazy_bytes,
+                   (unsigned long long)lazy_files, (unsigned long long)lazy_disk,
+                   (unsigned long long)g_flushes, g_ntombs, (unsigned long long)g_tombs_created,
+                   (unsigned long long)g_tombs_done, (unsigned long long)tomb_moved, (unsigned long long)g_tomb_erased,
+                   (unsigned long long)g_hll_dense, bit_use_avx2() ? 1 : 0, (unsigned long long)g_bit_simd_bytes,
+                   (unsigned long long)g_cdc.seq, g_cdc.nsegs, (unsigned long long)g_cdc.bytes,
+                   (unsigned long long)g_cdc.appends, (unsigned long long)g_cdc.errors,
+                   (unsigned long long)g_cdc.broken, (unsigned long long)g_cdc.syncs,
+                   (unsigned long long)g_cdc.dropped, (unsigned long long)g_cdc.reads, (unsigned long long)g_cdc.read_bytes,
+                   g_raft.n == 0 ? "off" : g_raft.role == RAFT_LEADER ? "leader" :
+                   g_raft.role == RAFT_CANDIDATE ? "candidate" : "follower",
+                   (unsigned long long)g_raft.term, g_raft.n > 0 && g_raft.leader >= 0 ? g_raft.ports[g_raft.leader] : 0,
+                   (unsigned long long)g_raft.commit, (unsigned long long)g_raft.applied, g_raft.nlog,
+                   (unsigned long long)g_raft.snap_index, (unsigned long long)g_raft.elections,
+                   (unsigned long long)g_raft.append_msgs, (unsigned long long)g_raft.append_entries,
+                   (unsigned long long)g_raft.syncs, (unsigned long long)g_raft.lease_reads,
+                   (unsigned long long)g_raft.lease_misses, (unsigned long long)g_raft.snaps_taken,
+                   (unsigned long long)g_raft.snaps_sent, (unsigned long long)g_raft.snaps_installed,
+                   g_cfg.busy_poll_us, (unsigned long long)g_bp_spins,
+                   (unsigned long long)g_bp_hits, (unsigned long long)g_bp_sleeps);
+}
+
+// TRACKING ON | TRACKING PREFIX <p>: la conexión pasa a ser un canal de push.
+static bool handle_tracking(int client_fd, const Request *req, char *response, size_t cap) {
+    bool broadcast = strcmp(req->key, "PREFIX") == 0;
+    if (!broadcast && strcmp(req->key, "ON") != 0) {
+        (void)snprintf(response, cap, "ERROR: Uso TRACKING ON | TRACKING PREFIX <prefijo>\n");
+        return false;
+    }
+    char prefix[100] = {0};
+    if (broadcast && sscanf(req->value, "%99s", prefix) != 1) {
+        (void)snprintf(response, cap, "ERROR: Falta prefijo\n");
+        return false;
+    }
+    if (!tracking_register(client_fd, broadcast, prefix)) {
+        (void)snprintf(response, cap, "ERROR: Sin lugar para tracking\n");
+        return false;
+    }
+    (void)snprintf(response, cap, "OK\n");
+    return true;
+}
+
+// RELOAD: vuelve a mapear --ro-dataset (reemplazado con rename()). Si el
+// archivo nuevo no es válido se sigue sirviendo el anterior.
+static void handle_reload(char *response, size_t cap) {
+    if (!g_cfg.ro_path) {
+        (void)snprintf(response, cap, "ERROR: Sin dataset de solo lectura\n");
+        return;
+    }
+    RoSet *ro = ro_open(g_cfg.ro_path);
+    if (!ro) {
+        (void)snprintf(response, cap, "ERROR: Dataset invalido\n");
+        return;
+    }
+    RoSet *old = g_ro;
+    g_ro = ro;
+    ro_unref(old);                                  // las respuestas en vuelo lo mantienen
+    ++g_ro_reloads;
+    (void)snprintf(response, cap, "OK\n%llu\n", (unsigned long long)ro->nkeys);
+}
+
+// SNAPSHOT: id de un snapshot para leer con SNAPGET hasta RELEASE (o hasta
+// SNAP_TTL_US sin usarlo).
+static void handle_snapshot(char *response, size_t cap) {
+    uint64_t id = snap_open(false);
+    if (id == 0) {
+        (void)snprintf(response, cap, "ERROR: Demasiados snapshots\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n%llu\n", (unsigned long long)id);
+}
+
+static Snapshot *snap_arg(const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long long id = strtoull(arg, &end, 10);
+    return (errno || *end || end == arg) ? NULL : snap_find(id);
+}
+
+// SNAPGET <id> <key>: como GET, pero con el valor que ve el snapshot.
+static Value *handle_snapget(const Request *req, char *response, size_t cap) {
+    char key[100] = {0};
+    if (sscanf(req->value, "%99s", key) != 1 || !clave_valida(key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return NULL;
+    }
+    const Snapshot *sn = snap_arg(req->key);
+    if (!sn) {
+        (void)snprintf(response, cap, "ERROR: Snapshot inexistente\n");
+        return NULL;
+    }
+    bool found = false;
+    Value *v = snap_get_value(sn->seq, key, &found);
+    if (v) return v;
+    if (!found) {
+        (void)snprintf(response, cap, "NOTFOUND\n");
+        return NULL;
+    }
+    get_truncated(key, response, cap);
+    return NULL;
+}
+
+static void handle_release(const Request *req, char *response, size_t cap) {
+    const Snapshot *sn = snap_arg(req->key);
+    if (!sn || sn->pinned) {
+        (void)snprintf(response, cap, "ERROR: Snapshot inexistente\n");
+        return;
+    }
+    (void)snap_release(sn->id);
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// FLUSHALL [ASYNC]: sin ASYNC responde recién cuando terminó de borrar.
+static void handle_flushall(const Request *req, char *response, size_t cap) {
+    if (kv_flushall(req->key[0] == '\0') != 0) {
+        (void)snprintf(response, cap, errno == EROFS ? "ERROR: Solo lectura\n" :
+                                      errno == EBUSY ? "ERROR: Hay snapshots abiertos\n" :
+                                                       "ERROR: No se pudo vaciar\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// DELPREFIX <prefijo> / DELRANGE <desde> <hasta> (hasta excluido).
+static void handle_delrange(const Request *req, char *response, size_t cap) {
+    bool range = req->cmd == CMD_DELRANGE;
+    char hi[100] = "";
+    if (range && sscanf(req->value, "%99s", hi) != 1) hi[0] = '\0';
+    if (!clave_valida(req->key) || (range && !clave_valida(hi))) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (range && strcmp(req->key, hi) >= 0) {
+        (void)snprintf(response, cap, "ERROR: Rango vacio\n");
+        return;
+    }
+    if (kv_delrange(range, req->key, hi) != 0) {
+        (void)snprintf(response, cap, errno == EROFS ? "ERROR: Solo lectura\n" :
+                                      errno == EBUSY ? "ERROR: Hay snapshots abiertos\n" :
+                                                       "ERROR: Demasiados borrados en curso\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// Claves de PFCOUNT/PFMERGE: req->key y las palabras de req->value. Devuelve
+// cuántas, o 0 con el error ya escrito en response.
+static size_t hll_keys(const Request *req, char *rest, const char **keys, char *response, size_t cap) {
+    size_t n = 0;
+    keys[n++] = req->key;
+    memcpy(rest, req->value, BUFFER_SIZE);
+    char *save = NULL;
+    for (char *t = strtok_r(rest, " \t\r", &save); t; t = strtok_r(NULL, " \t\r", &save)) {
+        if (n == HLL_MAX_KEYS) {
+            (void)snprintf(response, cap, "ERROR: Demasiadas claves\n");
+            return 0;
+        }
+        keys[n++] = t;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (!clave_valida(keys[i]) || strlen(keys[i]) >= sizeof req->key) {
+            (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+            return 0;
+        }
+    }
+    return n;
+}
+
+// PFADD <clave> [<elemento>...]: OK y 1 si algún registro cambió (o se creó
+// la clave), 0 si no.
+static void handle_pfadd(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    Hll h;
+    bool found = false;
+    if (!hll_load(req->key, &h, &found)) {
+        (void)snprintf(response, cap, "ERROR: No es un HyperLogLog\n");
+        return;
+    }
+    bool changed = !found;
+    char rest[BUFFER_SIZE];
+    memcpy(rest, req->value, sizeof rest);
+    char *save = NULL;
+    for (char *t = strtok_r(rest, " \t\r", &save); t; t = strtok_r(NULL, " \t\r", &save))
+        if (hll_add(&h, t, strlen(t))) changed = true;
+    if (changed && hll_store(req->key, &h) != 0) {
+        (void)snprintf(response, cap, "ERROR: No se pudo crear\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n%d\n", changed ? 1 : 0);
+}
+
+// PFCOUNT <clave>...: elementos distintos estimados de la unión (las claves
+// que no existen cuentan como vacías).
+static void handle_pfcount(const Request *req, char *response, size_t cap) {
+    char rest[BUFFER_SIZE];
+    const char *keys[HLL_MAX_KEYS];
+    size_t n = hll_keys(req, rest, keys, response, cap);
+    if (n == 0) return;
+    Hll acc, h;
+    hll_init(&acc);
+    for (size_t i = 0; i < n; ++i) {
+        bool found = false;
+        if (!hll_load(keys[i], n == 1 ? &acc : &h, &found)) {
+            (void)snprintf(response, cap, "ERROR: No es un HyperLogLog\n");
+            return;
+        }
+        if (n > 1 && found) hll_merge(&acc, &h);
+    }
+    (void)snprintf(response, cap, "OK\n%llu\n", (unsigned long long)hll_count(&acc));
+}
+
+// PFMERGE <destino> [<clave>...]: destino pasa a ser la unión de sí mismo y
+// de las demás.
+static void handle_pfmerge(const Request *req, char *response, size_t cap) {
+    char rest[BUFFER_SIZE];
+    const char *keys[HLL_MAX_KEYS];
+    size_t n = hll_keys(req, rest, keys, response, cap);
+    if (n == 0) return;
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    Hll acc, h;
+    for (size_t i = 0; i < n; ++i) {
+        bool found = false;
+        if (!hll_load(keys[i], i == 0 ? &acc : &h, &found)) {
+            (void)snprintf(response, cap, "ERROR: No es un HyperLogLog\n");
+            return;
+        }
+        if (i > 0 && found) hll_merge(&acc, &h);
+    }
+    if (hll_store(req->key, &acc) != 0) {
+        (void)snprintf(response, cap, "ERROR: No se pudo crear\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// SETBIT <clave> <offset> <0|1>: OK y el valor anterior del bit.
+static void handle_setbit(const Request *req, char *response, size_t cap) {
+    char off_s[32] = "", bit_s[4] = "";
+    uint64_t off = 0;
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (sscanf(req->value, "%31s %3s", off_s, bit_s) != 2 || !bit_offset(off_s, &off)) {
+        (void)snprintf(response, cap, "ERROR: Offset invalido\n");
+        return;
+    }
+    if (strcmp(bit_s, "0") != 0 && strcmp(bit_s, "1") != 0) {
+        (void)snprintf(response, cap, "ERROR: Bit invalido\n");
+        return;
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    int old = kv_setbit(req->key, off, bit_s[0] == '1');
+    if (old < 0) {
+        (void)snprintf(response, cap, errno == EFBIG ? "ERROR: Valor demasiado grande\n" : "ERROR: No se pudo crear\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n%d\n", old);
+}
+
+// GETBIT <clave> <offset>: OK y el bit (0 si la clave o el byte no existen).
+static void handle_getbit(const Request *req, char *response, size_t cap) {
+    char off_s[32] = "";
+    uint64_t off = 0;
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    if (sscanf(req->value, "%31s", off_s) != 1 || !bit_offset(off_s, &off)) {
+        (void)snprintf(response, cap, "ERROR: Offset invalido\n");
+        return;
+    }
+    bool too_big = false;
+    Value *v = bit_load(req->key, &too_big);
+    if (too_big) {
+        (void)snprintf(response, cap, "ERROR: Valor demasiado grande\n");
+        return;
+    }
+    size_t byte = (size_t)(off / 8);
+    int bit = v && byte < v->len && ((const uint8_t*)value_bytes(v))[byte] & (0x80u >> (off % 8)) ? 1 : 0;
+    value_unref(v);
+    (void)snprintf(response, cap, "OK\n%d\n", bit);
+}
+
+// BITCOUNT <clave> [<desde> <hasta>]: bits en 1, opcionalmente sólo en los
+// bytes desde..hasta (incluidos; negativos cuentan desde el final).
+static void handle_bitcount(const Request *req, char *response, size_t cap) {
+    if (!clave_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        return;
+    }
+    long long from = 0, to = -1;
+    char extra[2];
+    int nargs = req->value[0] ? sscanf(req->value, "%lld %lld %1s", &from, &to, extra) : 0;
+    if (nargs != 0 && nargs != 2) {
+        (void)snprintf(response, cap, "ERROR: Uso BITCOUNT <clave> [<desde> <hasta>]\n");
+        return;
+    }
+    bool too_big = false;
+    Value *v = bit_load(req->key, &too_big);
+    if (too_big) {
+        (void)snprintf(response, cap, "ERROR: Valor demasiado grande\n");
+        return;
+    }
+    long long len = v ? (long long)v->len : 0;
+    if (from < 0) from = from + len < 0 ? 0 : from + len;
+    if (to < 0) to += len;
+    if (to >= len) to = len - 1;
+    uint64_t n = from <= to ? bit_popcount((const uint8_t*)value_bytes(v) + from, (size_t)(to - from + 1)) : 0;
+    value_unref(v);
+    (void)snprintf(response, cap, "OK\n%llu\n", (unsigned long long)n);
+}
+
+// BITOP AND|OR|XOR <destino> <clave>...: destino = la operación bit a bit de
+// las claves. Las más cortas (o inexistentes) cuentan como rellenas con ceros.
+// Responde OK y el largo del resultado; con largo 0 destino se borra.
+static void handle_bitop(const Request *req, char *response, size_t cap) {
+    BitOp op;
+    if (strcmp(req->key, "AND") == 0) op = BITOP_AND;
+    else if (strcmp(req->key, "OR") == 0) op = BITOP_OR;
+    else if (strcmp(req->key, "XOR") == 0) op = BITOP_XOR;
+    else {
+        (void)snprintf(response, cap, "ERROR: Uso BITOP AND|OR|XOR <destino> <clave>...\n");
+        return;
+    }
+    char rest[BUFFER_SIZE];
+    const char *keys[BITOP_MAX_KEYS + 1];
+    size_t n = 0;
+    memcpy(rest, req->value, sizeof rest);
+    char *save = NULL;
+    for (char *t = strtok_r(rest, " \t\r", &save); t; t = strtok_r(NULL, " \t\r", &save)) {
+        if (n == BITOP_MAX_KEYS + 1) {
+            (void)snprintf(response, cap, "ERROR: Demasiadas claves\n");
+            return;
+        }
+        keys[n++] = t;
+    }
+    if (n < 2) {
+        (void)snprintf(response, cap, "ERROR: Falta clave\n");
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (!clave_valida(keys[i]) || strlen(keys[i]) >= sizeof req->key) {
+            (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+            return;
+        }
+    }
+    if (g_ro) {
+        (void)snprintf(response, cap, "ERROR: Solo lectura\n");
+        return;
+    }
+    const char *dest = keys[0], *const *src = keys + 1;
+    size_t nsrc = n - 1, len = 0;
+    Value *vals[BITOP_MAX_KEYS];
+    bool found[BITOP_MAX_KEYS], too_big = false;
+    kv_get_values(src, nsrc, vals, found);
+    for (size_t i = 0; i < nsrc; ++i) {
+        if (found[i] && (!vals[i] || vals[i]->len > BIT_MAX_BYTES)) too_big = true;
+        else if (vals[i] && vals[i]->len > len) len = vals[i]->len;
+    }
+    uint8_t *buf = !too_big && len > 0 ? mem_alloc(MEM_VALUES, len) : NULL;
+    if (buf) {
+        size_t l0 = vals[0] ? vals[0]->len : 0;
+        if (l0) memcpy(buf, value_bytes(vals[0]), l0);
+        memset(buf + l0, 0, len - l0);
+        for (size_t i = 1; i < nsrc; ++i) {
+            size_t li = vals[i] ? vals[i]->len : 0;
+            if (li) bit_apply(op, buf, (const uint8_t*)value_bytes(vals[i]), li);
+            if (op == BITOP_AND) memset(buf + li, 0, len - li);
+        }
+    }
+    for (size_t i = 0; i < nsrc; ++i) value_unref(vals[i]);
+    if (too_big) {
+        (void)snprintf(response, cap, "ERROR: Valor demasiado grande\n");
+        return;
+    }
+    if (len > 0 && !buf) {
+        (void)snprintf(response, cap, "ERROR: Sin memoria\n");
+        return;
+    }
+    int r = len > 0 ? kv_set(dest, buf, len) : 0;
+    if (len == 0) (void)kv_del(dest);
+    mem_free(MEM_VALUES, buf);
+    if (r != 0) {
+        (void)snprintf(response, cap, "ERROR: No se pudo crear\n");
+        return;
+    }
+    (void)snprintf(response, cap, "OK\n%zu\n", len);
+}
+
+static bool cdc_name_valida(const char *name) {
+    return clave_valida(name) && strlen(name) < CDC_NAME_MAX;
+}
+
+// CDCREAD <consumidor> [<max_bytes>]: los registros siguientes al offset del
+// consumidor (si no tiene, desde el más viejo), hasta max_bytes y sin cruzar
+// de segmento. Responde "OK\n<desde> <hasta> <bytes>\n" y los registros tal
+// como están en el segmento (sendfile). No mueve el offset: eso es CDCCOMMIT.
+// El socket pasa a no bloqueante: lo que no entra lo sigue enviando main()
+// (true: la conexión quedó en g_cdc.senders).
+static bool handle_cdcread(int client_fd, const Request *req, char *response, size_t cap) {
+    if (g_cdc.fd < 0) {
+        (void)snprintf(response, cap, "ERROR: Sin registro de cambios (--cdc)\n");
+        return false;
+    }
+    if (!cdc_name_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Consumidor invalido\n");
+        return false;
+    }
+    long long max = CDC_READ_DEFAULT;
+    if (req->value[0] && (sscanf(req->value, "%lld", &max) != 1 || max < 1)) {
+        (void)snprintf(response, cap, "ERROR: Tope invalido\n");
+        return false;
+    }
+    if (max > CDC_READ_MAX) max = CDC_READ_MAX;
+    const CdcConsumer *cons = cdc_consumer(req->key);
+    uint64_t oldest = g_cdc.segs[0].first, from = cons ? cons->offset + 1 : oldest;
+    if (from < oldest) {
+        (void)snprintf(response, cap, "ERROR: Offset vencido (el primero es %llu)\n", (unsigned long long)oldest);
+        return false;
+    }
+    if (from > g_cdc.seq && g_cdc.broken) {     // lo anterior a la marca se puede leer
+        (void)snprintf(response, cap, "ERROR: Registro de cambios roto desde la secuencia %llu\n",
+                       (unsigned long long)g_cdc.broken);
+        return false;
+    }
+    if (from > g_cdc.seq) {
+        (void)snprintf(response, cap, "OK\n%llu %llu 0\n", (unsigned long long)from, (unsigned long long)(from - 1));
+        return false;
+    }
+    CdcSender *sd = NULL;
+    for (size_t k = 0; k < CDC_MAX_SENDERS && !sd; ++k)
+        if (!g_cdc.senders[k].used) sd = &g_cdc.senders[k];
+    if (!sd) {
+        (void)snprintf(response, cap, "ERROR: Demasiadas lecturas en curso\n");
+        return false;
+    }
+    size_t lo = 0, hi = g_cdc.nsegs;           // segmento con la secuencia from
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (g_cdc.segs[mid].first <= from) lo = mid;
+        else hi = mid;
+    }
+    const CdcSeg *s = &g_cdc.segs[lo];
+    char path[64];
+    cdc_path(path, sizeof path, s->first);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    uint64_t start = 0, end = 0, last = 0;
+    if (fd < 0 || !cdc_span(s, fd, from, (size_t)max, &start, &end, &last)) {
+        if (fd >= 0) close(fd);
+        (void)snprintf(response, cap, "ERROR: No se pudo leer el registro\n");
+        return false;
+    }
+    char head[80];
+    int n = snprintf(head, sizeof head, "OK\n%llu %llu %llu\n", (unsigned long long)from,
+                     (unsigned long long)last, (unsigned long long)(end - start));
+    ++g_cdc.reads;
+    int fl = fcntl(client_fd, F_GETFL);
+    if (write_all(client_fd, head, (size_t)n) < 0 || fl < 0 || fcntl(client_fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        close(fd);
+        return false;
+    }
+    *sd = (CdcSender){ .used = true, .fd = client_fd, .file = fd, .off = (off_t)start, .end = (off_t)end,
+                       .start = start };
+    (void)cdc_send_step(sd);                   // si terminó, ya la cerró
+    return true;
+}
+
+// CDCCOMMIT <consumidor> <seq>: guarda hasta dónde procesó el consumidor
+// (puede volver atrás para releer).
+static void handle_cdccommit(const Request *req, char *response, size_t cap) {
+    if (g_cdc.fd < 0) {
+        (void)snprintf(response, cap, "ERROR: Sin registro de cambios (--cdc)\n");
+        return;
+    }
+    unsigned long long seq = 0;
+    char extra[2];
+    if (!cdc_name_valida(req->key)) {
+        (void)snprintf(response, cap, "ERROR: Consumidor invalido\n");
+        return;
+    }
+    if (sscanf(req->value, "%llu %1s", &seq, extra) != 1 || seq > g_cdc.seq) {
+        (void)snprintf(response, cap, "ERROR: Offset invalido\n");
+        return;
+    }
+    CdcConsumer *c = cdc_consumer(req->key);
+    if (!c && g_cdc.nconsumers == CDC_MAX_CONSUMERS) {
+        (void)snprintf(response, cap, "ERROR: Demasiados consumidores\n");
+        return;
+    }
+    if (!c) {
+        c = &g_cdc.consumers[g_cdc.nconsumers++];
+        memcpy(c->name, req->key, strlen(req->key) + 1);   // cdc_name_valida: entra
+    }
+    c->offset = seq;
+    cdc_save_consumers();
+    (void)snprintf(response, cap, "OK\n");
+}
+
+// CDCINFO: secuencias disponibles, tamaño y el offset de cada consumidor.
+static void handle_cdcinfo(char *response, size_t cap) {
+    if (g_cdc.fd < 0) {
+        (void)snprintf(response, cap, "ERROR: Sin registro de cambios (--cdc)\n");
         return;
     }
-    FILE *fp = fopen(req->key, "w");
-    if (!fp) {
-        (void)snprintf(response, cap, "ERROR: No se pudo crear\n");
+    if (g_cdc.broken) {
+        (void)snprintf(response, cap, "ERROR: Registro de cambios roto desde la secuencia %llu\n",
+                       (unsigned long long)g_cdc.broken);
         return;
     }
-    fputs(req->value, fp);
-    fclose(fp);
-    (void)snprintf(response, cap, "OK\n");
+    int n = snprintf(response, cap, "OK\nfirst %llu\nlast %llu\nsegments %zu\nbytes %llu\n",
+                     (unsigned long long)g_cdc.segs[0].first, (unsigned long long)g_cdc.seq,
+                     g_cdc.nsegs, (unsigned long long)g_cdc.bytes);
+    for (size_t i = 0; i < g_cdc.nconsumers && n > 0 && (size_t)n < cap; ++i)
+        n += snprintf(response + n, cap - (size_t)n, "consumer %s %llu\n", g_cdc.consumers[i].name,
+                      (unsigned long long)g_cdc.consumers[i].offset);
 }
 
-static void handle_get(const Request *req, char *response, size_t cap) {
+// EXPORT <nombre>: arranca la exportación en línea y responde el id de su
+// snapshot; el archivo aparece en EXPORT_DIR cuando termina.
+static void handle_export(const Request *req, char *response, size_t cap) {
     if (!clave_valida(req->key)) {
-        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
+        (void)snprintf(response, cap, "ERROR: Nombre invalido\n");
         return;
     }
-    FILE *fp = fopen(req->key, "r");
-    if (!fp) {
-        (void)snprintf(response, cap, "NOTFOUND\n");
+    uint64_t id;
+    if (export_start(req->key, &id) != 0) {
+        (void)snprintf(response, cap, errno == EBUSY ? "ERROR: Exportacion en curso\n" :
+                                      errno == EAGAIN ? "ERROR: Demasiados snapshots\n" :
+                                                        "ERROR: No se pudo exportar\n");
         return;
     }
-    char contenido[BUFFER_SIZE];
-    size_t n = fread(contenido, 1, BUFFER_SIZE - 1, fp);
-    contenido[n] = '\0';
-    fclose(fp);
+    (void)snprintf(response, cap, "OK\n%llu\n", (unsigned long long)id);
+}
 
-    // "OK\n" + contenido + "\n" => limitar explícitamente el %s
-    (void)snprintf(response, cap, "OK\n%.*s\n", (int)(BUFFER_SIZE - 5), contenido);
+// ---------- tareas en reposo ----------
+// Sin conexiones pendientes durante IDLE_TICK_MS, main() corre idle_tasks().
+#define IDLE_TICK_MS 100
+
+static void idle_tasks(void) {
+    writeback_tick();
+    mvcc_tick();
+    lazy_tick();
+    cdc_tick();
+    raft_tick();
+    dedup_sweep_step();
+    defrag_step();
 }
 
-static void handle_del(const Request *req, char *response, size_t cap) {
-    if (!clave_valida(req->key)) {
-        (void)snprintf(response, cap, "ERROR: Clave invalida\n");
-        return;
+// ---------- busy polling ----------
+// Con --busy-poll el bucle llama a poll() con timeout 0 mientras hubo actividad
+// en los últimos busy_poll_us; pasado ese lapso sin eventos vuelve a bloquearse.
+// Los sockets piden además al kernel que sondee la NIC (SO_BUSY_POLL) en lugar
+// de esperar la interrupción.
+#define BUSY_POLL_SOCK_US 50
+
+static void busy_poll_socket(int fd) {
+    if (g_cfg.busy_poll_us <= 0) return;
+    static bool warned = false;
+    int us = BUSY_POLL_SOCK_US, one = 1;
+    bool ok = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof us) == 0;
+#ifdef SO_PREFER_BUSY_POLL
+    ok = ok && setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof one) == 0;
+#else
+    (void)one;
+#endif
+    if (!ok && !warned) {
+        perror("Aviso: setsockopt(SO_BUSY_POLL)");   // sin CAP_NET_ADMIN sólo gira el bucle
+        warned = true;
     }
-    (void)remove(req->key); // ignorar resultado
-    (void)snprintf(response, cap, "OK\n");
+}
+
+// Timeout para el próximo poll(): 0 mientras dure la ventana de giro.
+static int busy_poll_timeout(uint64_t last_event_us) {
+    static bool spinning = false;
+    if (g_cfg.busy_poll_us <= 0) return IDLE_TICK_MS;
+    if (now_us() - last_event_us < (uint64_t)g_cfg.busy_poll_us) {
+        spinning = true;
+        return 0;
+    }
+    if (spinning) ++g_bp_sleeps;
+    spinning = false;
+    return IDLE_TICK_MS;
 }
 
 // ---------- orquestador por cliente ----------
-static void run_request(int client_fd, const Request *req) {
-    char response[BUFFER_SIZE] = {0};
+// true si client_fd quedó en uso (canal de TRACKING, escritura esperando
+// confirmación de Raft) y no debe cerrarse.
+static bool run_request(int client_fd, const Request *req) {
+    char response[RESPONSE_SIZE] = {0};
+    bool keep = false;
+    if ((req->cmd == CMD_SET || req->cmd == CMD_GET || req->cmd == CMD_DEL || req->cmd == CMD_UNLINK) && clave_valida(req->key))
+        hotkeys_sample(req->key);
+    if (g_raft.n > 0 && raft_request(client_fd, req, response, sizeof response, &keep)) {
+        (void)write_all(client_fd, response, strlen(response));
+        return keep;
+    }
     switch (req->cmd) {
         case CMD_SET: handle_set(req, response, sizeof response); break;
-        case CMD_GET: handle_get(req, response, sizeof response); break;
+        case CMD_GET: {
+            Value *v = handle_get(req, response, sizeof response);
+            if (v || strncmp(response, "OK\n", 3) == 0) tracking_note_read(client_fd, req->key);
+            if (v) {
+                (void)write_all(client_fd, v->wire, VALUE_HDR + v->len + 1);
+                value_unref(v);
+            }
+            break;
+        }
         case CMD_DEL: handle_del(req, response, sizeof response); break;
+        case CMD_HOTKEYS: handle_hotkeys(response, sizeof response); break;
+        case CMD_MEMORY_STATS: handle_memory_stats(response, sizeof response); break;
+        case CMD_MEMORY_USAGE: handle_memory_usage(req, response, sizeof response); break;
+        case CMD_STATS: handle_stats(response, sizeof response); break;
+        case CMD_MGET: handle_mget(client_fd, req, response, sizeof response); break;
+        case CMD_RELOAD: handle_reload(response, sizeof response); break;
+        case CMD_SNAPSHOT: handle_snapshot(response, sizeof response); break;
+        case CMD_SNAPGET: {
+            Value *v = handle_snapget(req, response, sizeof response);
+            if (v) {
+                (void)write_all(client_fd, v->wire, VALUE_HDR + v->len + 1);
+                value_unref(v);
+            }
+            break;
+        }
+        case CMD_RELEASE: handle_release(req, response, sizeof response); break;
+        case CMD_EXPORT: handle_export(req, response, sizeof response); break;
+        case CMD_UNLINK: handle_unlink(req, response, sizeof response); break;
+        case CMD_FLUSHALL: handle_flushall(req, response, sizeof response); break;
+        case CMD_DELPREFIX:
+        case CMD_DELRANGE: handle_delrange(req, response, sizeof response); break;
+        case CMD_PFADD: handle_pfadd(req, response, sizeof response); break;
+        case CMD_PFCOUNT: handle_pfcount(req, response, sizeof response); break;
+        case CMD_PFMERGE: handle_pfmerge(req, response, sizeof response); break;
+        case CMD_SETBIT: handle_setbit(req, response, sizeof response); break;
+        case CMD_GETBIT: handle_getbit(req, response, sizeof response); break;
+        case CMD_BITCOUNT: handle_bitcount(req, response, sizeof response); break;
+        case CMD_BITOP: handle_bitop(req, response, sizeof response); break;
+        case CMD_CDCREAD: keep = handle_cdcread(client_fd, req, response, sizeof response); break;
+        case CMD_CDCCOMMIT: handle_cdccommit(req, response, sizeof response); break;
+        case CMD_CDCINFO: handle_cdcinfo(response, sizeof response); break;
+        case CMD_TRACKING: keep = handle_tracking(client_fd, req, response, sizeof response); break;
         default: (void)snprintf(response, sizeof response, "ERROR: Comando invalido\n"); break;
     }
     (void)write_all(client_fd, response, strlen(response));
+    return keep;
 }
 
 // Atiende a un cliente: lee, parsea, ejecuta, responde.
@@ -171,64 +6235,1301 @@ static void handle_client(int client_fd) {
         return;
     }
 
-    run_request(client_fd, &req);
-    close(client_fd);
+    if (!run_request(client_fd, &req)) close(client_fd);
+}
+
+// ---------- conexiones persistentes ----------
+// Las conexiones de protocolos con sesión (memcached, HTTP) quedan en el poll() de
+// main(); cada una acumula lo recibido en 'in' y se procesan todos los
+// comandos completos que haya. Lo incompleto espera al próximo read.
+// Los sockets son no bloqueantes: lo que el kernel no acepta queda en 'pend'
+// (y un archivo a medio enviar en file_fd) y sale con POLLOUT. Mientras tanto
+// la conexión no lee ni procesa más pedidos, así un cliente que no lee no
+// frena el bucle y sus respuestas no se acumulan.
+#define MAX_CONNS 64
+#define CONN_READ_CHUNK 4096
+#define MC_MAX_VALUE (1u << 20)
+#define CONN_MAX_INPUT (MC_MAX_VALUE + 4096)
+#define ZC_MAX_PENDING 8              // buffers fijados por conexión
+#define ZC_CLOSE_WAIT_MS 1000        // tope de espera de los avisos tras cerrar
+
+typedef enum {
+    PROTO_MEMCACHED = 0,
+    PROTO_HTTP
+} Proto;
+
+typedef struct {
+    bool used;
+    int fd;
+    Proto proto;
+    bool expect_sent;      // HTTP: ya se respondió "100 Continue" al pedido en curso
+    size_t skip;           // memcached: lo que falta descartar de un bloque demasiado grande
+    bool eof, quit;        // se cierra al terminar de enviar lo pendiente
+    Buf in;
+    OutQ pend;             // respuestas que el kernel todavía no aceptó
+    size_t pend_sent;      // bytes de pend ya enviados
+    int file_fd;           // HTTP GET por sendfile() sin terminar (-1: ninguno)
+    off_t file_off, file_size;
+    // MSG_ZEROCOPY: buffers enviados que el kernel todavía puede leer
+    bool zerocopy;
+    uint32_t zc_next;      // número del próximo send() con MSG_ZEROCOPY
+    uint32_t zc_done;      // sends [0, zc_done) ya completados
+    size_t zc_npending;
+    struct { OutQ q; uint32_t last; } zc_pending[ZC_MAX_PENDING];
+    uint64_t zc_deadline;  // cerrada: hasta cuándo esperar los avisos
+} Conn;
+
+static Conn g_conns[MAX_CONNS];
+// Conexiones cerradas con envíos MSG_ZEROCOPY sin completar: el cliente ya vio
+// el cierre (shutdown) y el descriptor sigue abierto sólo para leer los avisos.
+static Conn g_zc_closing[MAX_CONNS];
+
+static bool conn_open(int fd, Proto proto) {
+    for (size_t i = 0; i < MAX_CONNS; ++i) {
+        if (g_conns[i].used) continue;
+        g_conns[i] = (Conn){ .used = true, .fd = fd, .proto = proto, .expect_sent = false, .skip = 0,
+                             .eof = false, .quit = false,
+                             .in = { .p = NULL, .len = 0, .cap = 0, .cat = MEM_CONN_BUFFERS },
+                             .pend = OUTQ_INIT, .pend_sent = 0, .file_fd = -1, .file_off = 0, .file_size = 0,
+                             .zerocopy = false, .zc_next = 0, .zc_done = 0, .zc_npending = 0,
+                             .zc_deadline = 0 };
+        int one = 1;
+        if (g_cfg.zc_threshold > 0 && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0)
+            g_conns[i].zerocopy = true;
+        return true;
+    }
+    close(fd);
+    return false;
+}
+
+// Lee las notificaciones de la cola de errores y libera los buffers ya completados.
+static void zc_reap(Conn *c) {
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof ee);
+            if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t n = ee.ee_data - ee.ee_info + 1;   // rango [ee_info, ee_data]
+            g_zc_completions += n;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) g_zc_copied += n;
+            if (ee.ee_data + 1 > c->zc_done) c->zc_done = ee.ee_data + 1;
+        }
+    }
+    size_t keep = 0;
+    for (size_t k = 0; k < c->zc_npending; ++k) {
+        if (c->zc_pending[k].last < c->zc_done) outq_free(&c->zc_pending[k].q);
+        else c->zc_pending[keep++] = c->zc_pending[k];
+    }
+    c->zc_npending = keep;
+}
+
+static bool conn_blocked(const Conn *c) {
+    return c->pend.total > 0 || c->file_fd >= 0;
+}
+
+// Lo que el kernel no aceptó de out (desde sent) pasa a pend; vacía out.
+static bool conn_keep(Conn *c, OutQ *out, size_t sent) {
+    if (sent < out->total && c->pend.total == 0) {   // se queda con la cola entera
+        c->pend = *out;
+        c->pend_sent = sent;
+        *out = (OutQ)OUTQ_INIT;
+        return true;
+    }
+    bool ok = sent == out->total || outq_append(&c->pend, out, sent);
+    outq_free(out);
+    return ok;
+}
+
+// Envía y vacía out. Si es grande y hay lugar, lo hace con MSG_ZEROCOPY y la
+// conexión se queda con la cola (y las referencias a sus valores) hasta la
+// notificación de fin.
+static bool conn_send(Conn *c, OutQ *out) {
+    if (out->total == 0) { outq_free(out); return true; }
+    if (conn_blocked(c)) return conn_keep(c, out, 0);    // detrás de lo pendiente
+    bool fallback = false;
+    size_t sent = 0;
+    if (!c->zerocopy || out->total < (size_t)g_cfg.zc_threshold) {
+        if (outq_send(c->fd, out, &sent, 0, NULL, &fallback)) return conn_keep(c, out, sent);
+        outq_free(out);
+        return false;
+    }
+    zc_reap(c);
+    if (c->zc_npending == ZC_MAX_PENDING) {
+        ++g_zc_fallbacks;
+        if (outq_send(c->fd, out, &sent, 0, NULL, &fallback)) return conn_keep(c, out, sent);
+        outq_free(out);
+        return false;
+    }
+
+    uint32_t calls = 0;
+    bool ok = outq_send(c->fd, out, &sent, MSG_ZEROCOPY, &calls, &fallback);
+    if (fallback) ++g_zc_fallbacks;
+    if (!ok) {
+        outq_free(out);
+        return false;
+    }
+    if (calls == 0) return conn_keep(c, out, sent);
+    // calls puede incluir envíos copiados tras ENOBUFS; esperar de más es inofensivo
+    c->zc_next += calls;
+    ++g_zc_sends;
+    g_zc_bytes += sent;
+    OutQ *q = &c->zc_pending[c->zc_npending].q;
+    *q = *out;
+    c->zc_pending[c->zc_npending].last = c->zc_next - 1;
+    ++c->zc_npending;
+    *out = (OutQ)OUTQ_INIT;
+    // lo que no entró sale después copiando, con sus propias referencias
+    return sent == q->total || outq_append(&c->pend, q, sent);
+}
+
+// Con POLLOUT: sigue con pend y después con el archivo. false ante un error.
+static bool conn_flush(Conn *c) {
+    if (c->pend.total > 0) {
+        if (!outq_send(c->fd, &c->pend, &c->pend_sent, 0, NULL, NULL)) return false;
+        if (c->pend_sent < c->pend.total) return true;
+        outq_free(&c->pend);
+        c->pend_sent = 0;
+    }
+    while (c->file_fd >= 0 && c->file_off < c->file_size) {
+        ssize_t w = sendfile(c->fd, c->file_fd, &c->file_off, (size_t)(c->file_size - c->file_off));
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (w <= 0) return false;
+    }
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+    return true;
+}
+
+// Suelta los buffers que quedan y cierra el descriptor.
+static void zc_finish(Conn *c) {
+    for (size_t k = 0; k < c->zc_npending; ++k) outq_free(&c->zc_pending[k].q);
+    c->zc_npending = 0;
+    close(c->fd);
+    c->used = false;
+}
+
+// Pasa c a g_zc_closing; si está lleno, termina la que vence primero.
+static void zc_defer(Conn *c) {
+    (void)shutdown(c->fd, SHUT_RDWR);
+    size_t slot = 0;
+    for (size_t k = 0; k < MAX_CONNS; ++k) {
+        if (!g_zc_closing[k].used) { slot = k; break; }
+        if (g_zc_closing[k].zc_deadline < g_zc_closing[slot].zc_deadline) slot = k;
+    }
+    if (g_zc_closing[slot].used) zc_finish(&g_zc_closing[slot]);
+    g_zc_closing[slot] = *c;
+    g_zc_closing[slot].zc_deadline = now_us() + ZC_CLOSE_WAIT_MS * 1000ull;
+}
+
+// Una vez por vuelta del bucle (y en reposo): libera lo que ya completó el
+// kernel y cierra las que terminaron o vencieron.
+static void zc_closing_tick(void) {
+    uint64_t now = 0;
+    for (size_t k = 0; k < MAX_CONNS; ++k) {
+        Conn *c = &g_zc_closing[k];
+        if (!c->used) continue;
+        zc_reap(c);
+        if (now == 0) now = now_us();
+        if (c->zc_npending == 0 || now >= c->zc_deadline) zc_finish(c);
+    }
+}
+
+// El kernel puede seguir leyendo los buffers fijados: si quedan, la conexión
+// espera sus avisos en g_zc_closing sin frenar el bucle.
+static void conn_close(size_t i) {
+    Conn *c = &g_conns[i];
+    if (!c->used) return;
+    buf_free(&c->in);
+    outq_free(&c->pend);
+    if (c->file_fd >= 0) close(c->file_fd);
+    if (c->zc_npending > 0) zc_reap(c);
+    if (c->zc_npending > 0) zc_defer(c);
+    else close(c->fd);
+    c->used = false;
+}
+
+// ---------- protocolo memcached (texto) ----------
+// get/gets <clave>*, set/add/replace <clave> <flags> <exptime> <bytes> [noreply],
+// delete <clave> [noreply], incr/decr <clave> <delta> [noreply], version, quit.
+// Los flags no se persisten (se devuelven como 0) y exptime solo se respeta
+// si es negativo (expira ya). El cas de gets es un hash del valor.
+#define MC_MAX_LINE 2048
+#define MC_MAX_TOKENS (MC_MAX_LINE / 2)   // una línea no puede tener más: get no pierde claves
+
+static bool mc_key(const char *tok, char *key) {
+    if (strlen(tok) >= 100 || !clave_valida(tok)) return false;
+    strcpy(key, tok);
+    return true;
+}
+
+static void mc_get(int fd, char **tok, size_t ntok, bool with_cas, OutQ *out) {
+    const char *keys[MC_MAX_TOKENS];
+    size_t n = 0;
+    for (size_t i = 1; i < ntok; ++i) {
+        char key[100];
+        if (!mc_key(tok[i], key)) continue;
+        hotkeys_sample(key);
+        keys[n++] = tok[i];
+    }
+    Value *vals[MC_MAX_TOKENS];
+    bool found[MC_MAX_TOKENS];
+    kv_get_values(keys, n, vals, found);
+    for (size_t i = 0; i < n; ++i) {
+        const char *key = keys[i];
+        Value *v = vals[i];
+        if (!v) continue;
+        tracking_note_read(fd, key);
+        if (with_cas)
+            (void)outq_printf(out, "VALUE %s 0 %u %llu\r\n", key, v->len,
+                              (unsigned long long)hash_bytes(value_bytes(v), v->len, 0));
+        else
+            (void)outq_printf(out, "VALUE %s 0 %u\r\n", key, v->len);
+        (void)outq_value(out, v, VALUE_HDR, v->len);
+        (void)outq_bytes(out, "\r\n", 2);
+        value_unref(v);
+    }
+    (void)outq_bytes(out, "END\r\n", 5);
+}
+
+static void mc_incr(char **tok, size_t ntok, bool incr, bool noreply, OutQ *out) {
+    char key[100];
+    char *end = NULL;
+    if (ntok < 3 || !mc_key(tok[1], key)) { (void)outq_printf(out, "CLIENT_ERROR bad command line format\r\n"); return; }
+    errno = 0;
+    unsigned long long delta = strtoull(tok[2], &end, 10);
+    if (errno || *end != '\0' || tok[2][0] == '-') { (void)outq_printf(out, "CLIENT_ERROR invalid numeric delta argument\r\n"); return; }
+    hotkeys_sample(key);
+    if (g_ro) { (void)outq_printf(out, "SERVER_ERROR read-only dataset\r\n"); return; }
+
+    char cur[32];
+    ssize_t n = kv_get(key, cur, sizeof cur - 1);
+    if (n < 0) { if (!noreply) (void)outq_printf(out, "NOT_FOUND\r\n"); return; }
+    cur[n] = '\0';
+    errno = 0;
+    unsigned long long v = strtoull(cur, &end, 10);
+    if (n == 0 || errno || *end != '\0' || cur[0] == '-') {
+        (void)outq_printf(out, "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+        return;
+    }
+    v = incr ? v + delta : (delta > v ? 0 : v - delta);   // incr da la vuelta en 2^64, decr se queda en 0
+    int len = snprintf(cur, sizeof cur, "%llu", v);
+    if (kv_set(key, cur, (size_t)len) != 0) { (void)outq_printf(out, "SERVER_ERROR store failed\r\n"); return; }
+    if (!noreply) (void)outq_printf(out, "%s\r\n", cur);
+}
+
+// Procesa los comandos completos de data[0..len); devuelve los bytes consumidos.
+static size_t mc_process(Conn *c, bool *quit) {
+    int fd = c->fd;
+    const char *data = c->in.p;
+    size_t len = c->in.len;
+    OutQ out = OUTQ_INIT;
+    size_t pos = 0;
+    while (pos < len && !*quit) {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        if (!nl) break;
+        size_t linelen = (size_t)(nl - (data + pos));
+        size_t next = pos + linelen + 1;
+        if (linelen > 0 && data[pos + linelen - 1] == '\r') --linelen;
+        if (linelen >= MC_MAX_LINE) {
+            (void)outq_printf(&out, "CLIENT_ERROR line too long\r\n");
+            pos = next;
+            continue;
+        }
+        char line[MC_MAX_LINE];
+        memcpy(line, data + pos, linelen);
+        line[linelen] = '\0';
+
+        char *tok[MC_MAX_TOKENS];
+        size_t ntok = 0;
+        char *save = NULL;
+        for (char *t = strtok_r(line, " ", &save); t && ntok < MC_MAX_TOKENS; t = strtok_r(NULL, " ", &save))
+            tok[ntok++] = t;
+        if (ntok == 0) { (void)outq_printf(&out, "ERROR\r\n"); pos = next; continue; }
+        bool noreply = strcmp(tok[ntok - 1], "noreply") == 0;
+
+        if (strcmp(tok[0], "set") == 0 || strcmp(tok[0], "add") == 0 || strcmp(tok[0], "replace") == 0) {
+            char key[100], *end = NULL;
+            unsigned long bytes = ntok >= 5 ? strtoul(tok[4], &end, 10) : 0;
+            if (ntok < 5 || *end != '\0' || bytes > SIZE_MAX - 2) {
+                (void)outq_printf(&out, "CLIENT_ERROR bad command line format\r\n");
+                pos = next;
+                continue;
+            }
+            if (bytes > MC_MAX_VALUE) {                   // se descarta el bloque, llegue cuando llegue
+                (void)outq_printf(&out, "SERVER_ERROR object too large for cache\r\n");
+                size_t n = len - next < bytes + 2 ? len - next : bytes + 2;
+                c->skip = bytes + 2 - n;
+                pos = next + n;
+                continue;
+            }
+            if (len - next < bytes + 2) break;            // falta el bloque de datos
+            const char *block = data + next;
+            pos = next + bytes + 2;
+            if (block[bytes] != '\r' || block[bytes + 1] != '\n') {
+                (void)outq_printf(&out, "CLIENT_ERROR bad data chunk\r\n");
+                continue;
+            }
+            if (!mc_key(tok[1], key)) {
+                (void)outq_printf(&out, "CLIENT_ERROR bad key\r\n");
+                continue;
+            }
+            hotkeys_sample(key);
+            bool exists = (tok[0][0] == 's') ? true : kv_exists(key);
+            const char *reply;
+            if (g_ro) {
+                reply = "SERVER_ERROR read-only dataset\r\n";
+            } else if ((tok[0][0] == 'a' && exists) || (tok[0][0] == 'r' && !exists)) {
+                reply = "NOT_STORED\r\n";
+            } else if (atol(tok[3]) < 0) {                // ya expirado
+                (void)kv_del(key);
+                reply = "STORED\r\n";
+            } else {
+                reply = kv_set(key, block, bytes) == 0 ? "STORED\r\n" : "SERVER_ERROR store failed\r\n";
+            }
+            if (!noreply) (void)outq_printf(&out, "%s", reply);
+            continue;
+        }
+
+        pos = next;
+        if (strcmp(tok[0], "get") == 0 || strcmp(tok[0], "gets") == 0) {
+            mc_get(fd, tok, ntok, tok[0][3] == 's', &out);
+        } else if (strcmp(tok[0], "delete") == 0) {
+            char key[100];
+            if (ntok < 2 || !mc_key(tok[1], key)) { (void)outq_printf(&out, "CLIENT_ERROR bad key\r\n"); continue; }
+            hotkeys_sample(key);
+            if (g_ro) { (void)outq_printf(&out, "SERVER_ERROR read-only dataset\r\n"); continue; }
+            bool found = kv_exists(key);
+            if (found) (void)kv_del(key);
+            if (!noreply) (void)outq_printf(&out, found ? "DELETED\r\n" : "NOT_FOUND\r\n");
+        } else if (strcmp(tok[0], "incr") == 0 || strcmp(tok[0], "decr") == 0) {
+            mc_incr(tok, ntok, tok[0][0] == 'i', noreply, &out);
+        } else if (strcmp(tok[0], "version") == 0) {
+            (void)outq_printf(&out, "VERSION server2\r\n");
+        } else if (strcmp(tok[0], "quit") == 0) {
+            *quit = true;
+        } else {
+            (void)outq_printf(&out, "ERROR\r\n");
+        }
+    }
+    if (!conn_send(c, &out)) *quit = true;
+    return pos;
+}
+
+// ---------- gateway HTTP/1.1 ----------
+// GET/PUT/DELETE /kv/<clave> sobre conexiones keep-alive; varios pedidos en
+// el mismo read (pipelining) se responden en orden. GET envía el archivo con
+// sendfile() (sin copiar el valor a espacio de usuario). Sin chunked.
+#define HTTP_MAX_HEADER 8192
+#define HTTP_MAX_BODY MC_MAX_VALUE        // cabe en el buffer de entrada de la conexión
+
+// Valor del encabezado <name> (sin distinguir mayúsculas) dentro de hdr.
+static bool http_header(const char *hdr, size_t len, const char *name, char *val, size_t cap) {
+    size_t nlen = strlen(name);
+    const char *p = hdr, *end = hdr + len;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        if ((size_t)(eol - p) > nlen && strncasecmp(p, name, nlen) == 0 && p[nlen] == ':') {
+            const char *v = p + nlen + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) ++v;
+            size_t vlen = (size_t)(eol - v);
+            while (vlen > 0 && (v[vlen - 1] == '\r' || v[vlen - 1] == ' ')) --vlen;
+            if (vlen >= cap) vlen = cap - 1;
+            memcpy(val, v, vlen);
+            val[vlen] = '\0';
+            return true;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+static void http_status(OutQ *out, int code, const char *reason, bool keep) {
+    (void)outq_printf(out, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s\r\n",
+                      code, reason, keep ? "" : "Connection: close\r\n");
+}
+
+static void http_ok_header(OutQ *out, size_t size, bool keep) {
+    (void)outq_printf(out, "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                           "Content-Length: %zu\r\n%s\r\n", size, keep ? "" : "Connection: close\r\n");
+}
+
+// GET: el valor en memoria se encola por referencia; si es demasiado grande
+// para la caché, se envían los encabezados y el archivo con sendfile().
+static bool http_get(Conn *c, const char *key, bool keep, OutQ *out) {
+    bool found = false;
+    Value *v = kv_get_value(key, &found);
+    if (v) {
+        tracking_note_read(c->fd, key);
+        http_ok_header(out, v->len, keep);
+        (void)outq_value(out, v, VALUE_HDR, v->len);
+        value_unref(v);
+        return true;
+    }
+    size_t size = 0;
+    int vfd = found ? kv_open(key, &size) : -1;
+    if (vfd < 0) {
+        http_status(out, 404, "Not Found", keep);
+        return true;
+    }
+    tracking_note_read(c->fd, key);
+    http_ok_header(out, size, keep);
+    if (!conn_send(c, out)) {
+        close(vfd);
+        return false;
+    }
+    c->file_fd = vfd;                  // conn_flush lo envía (y lo cierra) detrás de los encabezados
+    c->file_off = 0;
+    c->file_size = (off_t)size;
+    return conn_flush(c);
+}
+
+// Procesa los pedidos completos de c->in; devuelve los bytes consumidos.
+static size_t http_process(Conn *c, bool *quit) {
+    const char *data = c->in.p;
+    size_t len = c->in.len;
+    OutQ out = OUTQ_INIT;
+    size_t pos = 0;
+    while (pos < len && !*quit) {
+        const char *req = data + pos;
+        size_t avail = len - pos;
+        const char *hend = memmem(req, avail, "\r\n\r\n", 4);
+        if (!hend) {
+            if (avail > HTTP_MAX_HEADER) { http_status(&out, 431, "Request Header Fields Too Large", false); *quit = true; }
+            break;
+        }
+        size_t hlen = (size_t)(hend - req) + 4;
+
+        char method[8] = {0}, target[128] = {0}, version[16] = {0};
+        if (sscanf(req, "%7s %127s %15s", method, target, version) != 3 || strncmp(version, "HTTP/1.", 7) != 0) {
+            http_status(&out, 400, "Bad Request", false);
+            *quit = true;
+            break;
+        }
+        char val[64];
+        bool keep = strcmp(version, "HTTP/1.0") != 0;
+        if (http_header(req, hlen, "Connection", val, sizeof val))
+            keep = strcasecmp(val, "close") != 0 && (keep || strcasecmp(val, "keep-alive") == 0);
+        if (http_header(req, hlen, "Transfer-Encoding", val, sizeof val)) {
+            http_status(&out, 501, "Not Implemented", false);
+            *quit = true;
+            break;
+        }
+        unsigned long body = 0;
+        if (http_header(req, hlen, "Content-Length", val, sizeof val)) body = strtoul(val, NULL, 10);
+        if (body > HTTP_MAX_BODY) {
+            http_status(&out, 413, "Payload Too Large", false);
+            *quit = true;
+            break;
+        }
+        if (avail - hlen < body) {                   // cuerpo incompleto
+            if (!c->expect_sent && http_header(req, hlen, "Expect", val, sizeof val) &&
+                strcasecmp(val, "100-continue") == 0) {
+                (void)outq_printf(&out, "HTTP/1.1 100 Continue\r\n\r\n");
+                c->expect_sent = true;
+            }
+            break;
+        }
+        const char *payload = req + hlen;
+        pos += hlen + body;
+        c->expect_sent = false;
+        if (!keep) *quit = true;
+
+        char key[100];
+        if (strncmp(target, "/kv/", 4) != 0 || strlen(target + 4) >= sizeof key || !clave_valida(target + 4)) {
+            http_status(&out, 404, "Not Found", keep);
+            continue;
+        }
+        strcpy(key, target + 4);
+        hotkeys_sample(key);
+
+        if (strcmp(method, "GET") == 0) {
+            if (!http_get(c, key, keep, &out)) *quit = true;
+            if (conn_blocked(c)) break;            // el resto, cuando el cliente lea
+        } else if (g_ro) {
+            http_status(&out, 405, "Method Not Allowed", keep);   // dataset de solo lectura
+        } else if (strcmp(method, "PUT") == 0) {
+            if (kv_set(key, payload, body) == 0) http_status(&out, 204, "No Content", keep);
+            else                                 http_status(&out, 500, "Internal Server Error", keep);
+        } else if (strcmp(method, "DELETE") == 0) {
+            bool found = kv_exists(key);
+            if (found) (void)kv_del(key);
+            if (found) http_status(&out, 204, "No Content", keep);
+            else       http_status(&out, 404, "Not Found", keep);
+        } else {
+            http_status(&out, 405, "Method Not Allowed", keep);
+        }
+    }
+    if (!conn_send(c, &out)) *quit = true;
+    return pos;
+}
+
+// Lee todo lo disponible en la conexión i y procesa los comandos completos.
+static void conn_on_readable(size_t i) {
+    Conn *c = &g_conns[i];
+    while (!c->eof && !c->quit && !conn_blocked(c)) {
+        if (!buf_reserve(&c->in, CONN_READ_CHUNK)) { conn_close(i); return; }
+        ssize_t r = recv(c->fd, c->in.p + c->in.len, CONN_READ_CHUNK, MSG_DONTWAIT);
+        if (r > 0) {
+            c->in.len += (size_t)r;
+            if (c->skip > 0) {             // con skip pendiente, in estaba vacío
+                size_t n = c->skip < c->in.len ? c->skip : c->in.len;
+                memmove(c->in.p, c->in.p + n, c->in.len - n);
+                c->in.len -= n;
+                c->skip -= n;
+            }
+            if (c->in.len > CONN_MAX_INPUT) { conn_close(i); return; }
+            continue;
+        }
+        if (r == 0) { c->eof = true; break; }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        conn_close(i);
+        return;
+    }
+
+    if (!c->quit && !conn_blocked(c)) {
+        size_t used = c->proto == PROTO_HTTP ? http_process(c, &c->quit)
+                                             : mc_process(c, &c->quit);
+        memmove(c->in.p, c->in.p + used, c->in.len - used);
+        c->in.len -= used;
+        if (c->in.len == 0 && c->in.cap > 4 * CONN_READ_CHUNK) buf_free(&c->in);   // no retener valores grandes
+    }
+    if ((c->quit || c->eof) && !conn_blocked(c)) conn_close(i);
+}
+
+static void conns_shutdown(void) {
+    for (size_t i = 0; i < MAX_CONNS; ++i) conn_close(i);
+    for (size_t i = 0; i < MAX_CONNS; ++i)
+        if (g_zc_closing[i].used) zc_finish(&g_zc_closing[i]);
+}
+
+// ---------- carga y exportación masiva (modo offline) ----------
+//   server2 import <archivo> [procesos]
+//   server2 export <archivo | ->
+// CSV: una línea "<clave>,<valor>" por clave (el valor llega hasta el fin de
+// línea y puede contener comas). Si el archivo termina en ".kvb" se usa el
+// formato binario: "KVB1" + registros [u32 largo clave][u32 largo valor][clave][valor].
+// La importación mapea el archivo y lo reparte en rangos entre procesos hijos
+// (fork); cada hijo escribe directamente los archivos de sus claves.
+//
+//   server2 build-ro <archivo> <dataset>
+// Lee el mismo formato y arma un dataset de solo lectura (ver --ro-dataset)
+// en un solo proceso; las claves repetidas se quedan con el último valor.
+#define BULK_MAX_PROCS 64
+#define BULK_MAX_VALUE (1u << 20)
+#define BULK_MAGIC "KVB1"
+
+// Registros juntados por build-ro (apuntan al archivo de entrada mapeado).
+typedef struct {
+    const char *k, *v;
+    uint32_t klen, vlen;
+    uint64_t h;
+} RoRec;
+
+typedef struct {
+    RoRec *rec;
+    size_t n, cap;
+} RoBuild;
+
+typedef struct {
+    unsigned long long ok;
+    unsigned long long bad;
+    RoBuild *build;        // != NULL: build-ro junta los registros en lugar de escribirlos
+} BulkCount;
+
+static bool bulk_is_binary(const char *path) {
+    size_t n = strlen(path);
+    return n >= 4 && strcmp(path + n - 4, ".kvb") == 0;
+}
+
+static bool ro_build_add(RoBuild *b, const char *k, size_t klen, const char *v, size_t vlen) {
+    if (vlen > UINT32_MAX - RO_REPLY_EXTRA) return false;
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        RoRec *rec = realloc(b->rec, cap * sizeof *rec);
+        if (!rec) return false;
+        b->rec = rec;
+        b->cap = cap;
+    }
+    b->rec[b->n++] = (RoRec){ .k = k, .v = v, .klen = (uint32_t)klen, .vlen = (uint32_t)vlen, .h = 0 };
+    return true;
+}
+
+static void bulk_put(const char *k, size_t klen, const char *v, size_t vlen, BulkCount *c) {
+    char key[100];
+    if (klen == 0 || klen >= sizeof key) { c->bad++; return; }
+    memcpy(key, k, klen);
+    key[klen] = '\0';
+    if (!clave_valida(key)) { c->bad++; return; }
+    if (c->build ? !ro_build_add(c->build, k, klen, v, vlen) : store_write(key, v, vlen) != 0) { c->bad++; return; }
+    c->ok++;
+}
+
+// Registros CSV cuya línea empieza en [begin, end).
+static void bulk_import_csv(const char *data, size_t size, size_t begin, size_t end, BulkCount *c) {
+    size_t pos = begin;
+    if (pos > 0) {   // la línea que cruza 'begin' la procesa el rango anterior
+        const char *nl = memchr(data + pos - 1, '\n', size - pos + 1);
+        pos = nl ? (size_t)(nl - data) + 1 : size;
+    }
+    while (pos < end) {
+        const char *line = data + pos;
+        const char *nl = memchr(line, '\n', size - pos);
+        size_t len = nl ? (size_t)(nl - line) : size - pos;
+        size_t text = (len > 0 && line[len - 1] == '\r') ? len - 1 : len;
+        const char *comma = memchr(line, ',', text);
+        if (comma) {
+            size_t klen = (size_t)(comma - line);
+            bulk_put(line, klen, comma + 1, text - klen - 1, c);
+        } else if (text > 0) {
+            c->bad++;
+        }
+        pos += len + 1;
+    }
+}
+
+// Lee un encabezado binario en pos; false si el registro está truncado.
+static bool bulk_bin_record(const char *data, size_t size, size_t pos, uint32_t *klen, uint32_t *vlen) {
+    if (size - pos < 8) return false;
+    memcpy(klen, data + pos, 4);
+    memcpy(vlen, data + pos + 4, 4);
+    return (uint64_t)*klen + *vlen <= (uint64_t)(size - pos - 8);
+}
+
+// Registros binarios en [begin, end); los límites ya caen en registros.
+static void bulk_import_bin(const char *data, size_t size, size_t begin, size_t end, BulkCount *c) {
+    size_t pos = begin;
+    uint32_t klen, vlen;
+    while (pos < end && bulk_bin_record(data, size, pos, &klen, &vlen)) {
+        bulk_put(data + pos + 8, klen, data + pos + 8 + klen, vlen, c);
+        pos += 8 + (size_t)klen + vlen;
+    }
+    if (pos < end) c->bad++;   // cola truncada
+}
+
+// Mapea el archivo de entrada. *start: primer registro (saltea el encabezado
+// binario). Devuelve false ante un error; un archivo vacío da *data = NULL.
+static bool bulk_map(const char *path, const char **data, size_t *size, size_t *start) {
+    *data = NULL;
+    *size = *start = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { perror("open"); return false; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { perror("fstat"); close(fd); return false; }
+    *size = (size_t)st.st_size;
+    if (*size == 0) { close(fd); return true; }
+
+    const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); return false; }
+    (void)madvise((void*)map, *size, MADV_SEQUENTIAL);
+
+    if (bulk_is_binary(path)) {
+        if (*size < 4 || memcmp(map, BULK_MAGIC, 4) != 0) {
+            fprintf(stderr, "%s no es un volcado " BULK_MAGIC "\n", path);
+            munmap((void*)map, *size);
+            return false;
+        }
+        *start = 4;
+    }
+    *data = map;
+    return true;
+}
+
+static int bulk_import(const char *path, int nprocs) {
+    const char *data;
+    size_t size, start;
+    if (!bulk_map(path, &data, &size, &start)) return EXIT_FAILURE;
+    if (!data) { printf("Importadas 0 claves\n"); return EXIT_SUCCESS; }
+    bool binary = bulk_is_binary(path);
+
+    if (nprocs <= 0) nprocs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nprocs <= 0 || g_eh.fd >= 0) nprocs = 1;   // el índice en disco admite un solo escritor
+    if (nprocs > BULK_MAX_PROCS) nprocs = BULK_MAX_PROCS;
+
+    // Límites de cada rango; en binario se ajustan al registro siguiente.
+    size_t bounds[BULK_MAX_PROCS + 1];
+    for (int i = 0; i <= nprocs; ++i) bounds[i] = start + (size - start) * (size_t)i / (size_t)nprocs;
+    if (binary) {
+        size_t pos = start;
+        uint32_t klen, vlen;
+        for (int i = 1; i < nprocs; ++i) {
+            while (pos < bounds[i] && bulk_bin_record(data, size, pos, &klen, &vlen))
+                pos += 8 + (size_t)klen + vlen;
+            if (pos < bounds[i]) pos = size;   // truncado: el resto no se reparte
+            bounds[i] = pos;
+        }
+    }
+
+    BulkCount *counts = mmap(NULL, sizeof(BulkCount) * (size_t)nprocs, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counts == MAP_FAILED) { perror("mmap"); munmap((void*)data, size); return EXIT_FAILURE; }
+    memset(counts, 0, sizeof(BulkCount) * (size_t)nprocs);
+
+    int started = 0;
+    bool in_process = g_eh.fd >= 0;                  // sin fork: el padre cierra el índice al final
+    for (int i = 0; i < nprocs && in_process; ++i, ++started) {
+        if (binary) bulk_import_bin(data, size, bounds[i], bounds[i + 1], &counts[i]);
+        else        bulk_import_csv(data, size, bounds[i], bounds[i + 1], &counts[i]);
+    }
+    for (int i = 0; i < nprocs && !in_process; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); break; }
+        if (pid == 0) {
+            if (binary) bulk_import_bin(data, size, bounds[i], bounds[i + 1], &counts[i]);
+            else        bulk_import_csv(data, size, bounds[i], bounds[i + 1], &counts[i]);
+            _exit(0);
+        }
+        ++started;
+    }
+    int status = started == nprocs ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (int i = 0; i < started && !in_process; ++i) {
+        int ws;
+        if (wait(&ws) < 0 || !WIFEXITED(ws) || WEXITSTATUS(ws) != 0) status = EXIT_FAILURE;
+    }
+
+    BulkCount total = {0, 0, NULL};
+    for (int i = 0; i < started; ++i) { total.ok += counts[i].ok; total.bad += counts[i].bad; }
+    printf("Importadas %llu claves (%llu invalidas) con %d procesos\n", total.ok, total.bad, started);
+    munmap(counts, sizeof(BulkCount) * (size_t)nprocs);
+    munmap((void*)data, size);
+    return status;
+}
+
+static int bulk_export(const char *path) {
+    bool to_stdout = strcmp(path, "-") == 0;
+    FILE *out = to_stdout ? stdout : fopen(path, "wb");
+    if (!out) { perror("fopen"); return EXIT_FAILURE; }
+    static char obuf[1u << 20];
+    setvbuf(out, obuf, _IOFBF, sizeof obuf);
+
+    char *val = malloc(BULK_MAX_VALUE + 1);
+    StoreIter it;
+    if (!val || !store_iter_open(&it)) {
+        perror("export");
+        free(val);
+        if (!to_stdout) fclose(out);
+        return EXIT_FAILURE;
+    }
+
+    bool binary = !to_stdout && bulk_is_binary(path);
+    if (binary) fwrite(BULK_MAGIC, 1, 4, out);
+
+    unsigned long long ok = 0, skipped = 0;
+    char key[100];
+    while (store_iter_next(&it, key, sizeof key)) {
+        ssize_t n = store_read(key, val, BULK_MAX_VALUE + 1);
+        if (n < 0) continue;                       // borrada mientras recorríamos
+        if ((size_t)n > BULK_MAX_VALUE || (!binary && memchr(val, '\n', (size_t)n))) {
+            ++skipped;                             // no representable en este formato
+            continue;
+        }
+        if (binary) {
+            uint32_t hdr[2] = { (uint32_t)strlen(key), (uint32_t)n };
+            fwrite(hdr, sizeof hdr, 1, out);
+            fwrite(key, 1, hdr[0], out);
+        } else {
+            fputs(key, out);
+            fputc(',', out);
+        }
+        fwrite(val, 1, (size_t)n, out);
+        if (!binary) fputc('\n', out);
+        ++ok;
+    }
+    store_iter_close(&it);
+    free(val);
+
+    int status = EXIT_SUCCESS;
+    if (fflush(out) != 0 || ferror(out)) { perror("export"); status = EXIT_FAILURE; }
+    if (!to_stdout && fclose(out) != 0) status = EXIT_FAILURE;
+    fprintf(stderr, "Exportadas %llu claves (%llu omitidas)\n", ok, skipped);
+    return status;
+}
+
+// Hash perfecto mínimo (CHD): las claves se reparten en buckets de ~RO_LAMBDA
+// claves y, del bucket más grande al más chico, se busca para cada uno el
+// primer desplazamiento que lleva todas sus claves a ranuras libres. Si dos
+// claves distintas comparten hash, o un bucket no encuentra lugar, se prueba
+// con otra semilla.
+#define RO_LAMBDA 4
+#define RO_MAX_DISP (1u << 30)
+#define RO_MAX_SEEDS 16
+
+static const RoRec *g_ro_sort;        // para los comparadores de qsort
+
+static int ro_cmp_hash(const void *a, const void *b) {
+    const RoRec *ra = &g_ro_sort[*(const size_t *)a], *rb = &g_ro_sort[*(const size_t *)b];
+    if (ra->h != rb->h) return ra->h < rb->h ? -1 : 1;
+    return *(const size_t *)a < *(const size_t *)b ? -1 : 1;   // a igual hash, orden de llegada
+}
+
+// Intenta armar el índice con seed. live: registros únicos (n); disp[nb];
+// rec_of_slot[n]. false si hay que probar otra semilla.
+static bool ro_place(RoRec *rec, size_t *live, size_t n, uint64_t nb, uint32_t *disp, size_t *rec_of_slot) {
+    size_t *bstart = calloc(nb + 1, sizeof *bstart);
+    size_t *members = malloc((n ? n : 1) * sizeof *members);
+    size_t *border = malloc(nb * sizeof *border);
+    uint8_t *taken = calloc(n ? n : 1, 1);
+    uint64_t *tmp = NULL;
+    bool ok = bstart && members && border && taken;
+
+    // Agrupar por bucket (conteo + prefijos) y ordenar buckets por tamaño.
+    size_t maxb = 0;
+    for (size_t i = 0; ok && i < n; ++i) bstart[ro_bucket(rec[live[i]].h, nb) + 1]++;
+    for (uint64_t b = 0; ok && b < nb; ++b) {
+        if (bstart[b + 1] > maxb) maxb = bstart[b + 1];
+        bstart[b + 1] += bstart[b];
+    }
+    if (ok) {
+        size_t *fill = border;                 // prestado: posición de llenado por bucket
+        for (uint64_t b = 0; b < nb; ++b) fill[b] = bstart[b];
+        for (size_t i = 0; i < n; ++i) members[fill[ro_bucket(rec[live[i]].h, nb)]++] = live[i];
+        // orden por tamaño descendente con un conteo (los tamaños son chicos)
+        size_t *cnt = calloc(maxb + 2, sizeof *cnt);
+        ok = cnt != NULL;
+        for (uint64_t b = 0; ok && b < nb; ++b) cnt[maxb - (bstart[b + 1] - bstart[b])]++;
+        for (size_t k = 0, acc = 0; ok && k <= maxb; ++k) { size_t c = cnt[k]; cnt[k] = acc; acc += c; }
+        for (uint64_t b = 0; ok && b < nb; ++b) border[cnt[maxb - (bstart[b + 1] - bstart[b])]++] = b;
+        free(cnt);
+        tmp = malloc((maxb ? maxb : 1) * sizeof *tmp);
+        ok = ok && tmp;
+    }
+
+    for (uint64_t k = 0; ok && k < nb; ++k) {
+        uint64_t b = border[k];
+        size_t m = bstart[b + 1] - bstart[b];
+        if (m == 0) { disp[b] = 0; continue; }
+        uint32_t d = 0;
+        for (; d < RO_MAX_DISP; ++d) {
+            bool fits = true;
+            for (size_t j = 0; j < m && fits; ++j) {
+                tmp[j] = ro_slot(rec[members[bstart[b] + j]].h, d, n);
+                if (taken[tmp[j]]) fits = false;
+                for (size_t q = 0; q < j && fits; ++q) if (tmp[q] == tmp[j]) fits = false;
+            }
+            if (fits) break;
+        }
+        if (d == RO_MAX_DISP) { ok = false; break; }
+        disp[b] = d;
+        for (size_t j = 0; j < m; ++j) {
+            taken[tmp[j]] = 1;
+            rec_of_slot[tmp[j]] = members[bstart[b] + j];
+        }
+    }
+    free(bstart); free(members); free(border); free(taken); free(tmp);
+    return ok;
+}
+
+static bool ro_write(const char *path, const RoRec *rec, size_t n, uint64_t nb, uint64_t seed,
+                     const uint32_t *disp, const size_t *rec_of_slot) {
+    size_t slot_off = ro_slot_offset(nb);
+    uint64_t size = slot_off + (uint64_t)n * sizeof(uint64_t);
+    for (size_t s = 0; s < n; ++s) size += 8 + (uint64_t)rec[rec_of_slot[s]].klen + rec[rec_of_slot[s]].vlen + RO_REPLY_EXTRA;
+
+    char tmp[4096];
+    if (snprintf(tmp, sizeof tmp, "%s.tmp", path) >= (int)sizeof tmp) return false;
+    FILE *out = fopen(tmp, "wb");
+    if (!out) { perror(tmp); return false; }
+    static char obuf[1u << 20];
+    setvbuf(out, obuf, _IOFBF, sizeof obuf);
+
+    RoHeader h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, RO_MAGIC, 8);
+    h.nkeys = n;
+    h.nbuckets = nb;
+    h.seed = seed;
+    h.size = size;
+    fwrite(&h, sizeof h, 1, out);
+    fwrite(disp, sizeof *disp, nb, out);
+    static const char pad[8] = {0};
+    fwrite(pad, 1, slot_off - sizeof h - nb * sizeof *disp, out);
+    uint64_t off = slot_off + (uint64_t)n * sizeof(uint64_t);
+    for (size_t s = 0; s < n; ++s) {            // los registros van en orden de ranura
+        fwrite(&off, sizeof off, 1, out);
+        const RoRec *r = &rec[rec_of_slot[s]];
+        off += 8 + (uint64_t)r->klen + r->vlen + RO_REPLY_EXTRA;
+    }
+    for (size_t s = 0; s < n; ++s) {
+        const RoRec *r = &rec[rec_of_slot[s]];
+        uint32_t hdr[2] = { r->klen, r->vlen };
+        fwrite(hdr, sizeof hdr, 1, out);
+        fwrite(r->k, 1, r->klen, out);
+        fwrite("OK\n", 1, VALUE_HDR, out);
+        fwrite(r->v, 1, r->vlen, out);
+        fputc('\n', out);
+    }
+    bool ok = fflush(out) == 0 && !ferror(out) && fsync(fileno(out)) == 0;
+    if (fclose(out) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;    // reemplazo atómico del dataset
+    if (!ok) { perror(path); unlink(tmp); }
+    return ok;
+}
+
+static int ro_build(const char *in_path, const char *out_path) {
+    const char *data;
+    size_t size, start;
+    if (!bulk_map(in_path, &data, &size, &start)) return EXIT_FAILURE;
+    RoBuild b = { NULL, 0, 0 };
+    BulkCount c = { 0, 0, &b };
+    if (data && bulk_is_binary(in_path)) bulk_import_bin(data, size, start, size, &c);
+    else if (data)                       bulk_import_csv(data, size, start, size, &c);
+
+    size_t *order = malloc((b.n ? b.n : 1) * sizeof *order);
+    size_t *live = malloc((b.n ? b.n : 1) * sizeof *live);
+    size_t n = 0;
+    uint64_t nb = 1;
+    uint32_t *disp = NULL;
+    size_t *rec_of_slot = NULL;
+    uint64_t seed = 0;
+    bool ok = false;
+    for (int attempt = 0; order && live && attempt < RO_MAX_SEEDS && !ok; ++attempt) {
+        seed = ro_mix(0x6b76726f00000000ULL + (uint64_t)attempt);
+        for (size_t i = 0; i < b.n; ++i) {
+            b.rec[i].h = hash_bytes(b.rec[i].k, b.rec[i].klen, seed);
+            order[i] = i;
+        }
+        g_ro_sort = b.rec;
+        qsort(order, b.n, sizeof *order, ro_cmp_hash);
+        // Repetidas: gana la última. Hash igual con clave distinta: otra semilla.
+        bool collision = false;
+        n = 0;
+        for (size_t i = 0; i < b.n && !collision; ++i) {
+            const RoRec *r = &b.rec[order[i]];
+            if (i + 1 < b.n && b.rec[order[i + 1]].h == r->h) {
+                const RoRec *q = &b.rec[order[i + 1]];
+                if (q->klen != r->klen || memcmp(q->k, r->k, r->klen) != 0) collision = true;
+                continue;
+            }
+            live[n++] = order[i];
+        }
+        if (collision) continue;
+        nb = n / RO_LAMBDA + 1;
+        free(disp); free(rec_of_slot);
+        disp = malloc(nb * sizeof *disp);
+        rec_of_slot = malloc((n ? n : 1) * sizeof *rec_of_slot);
+        if (!disp || !rec_of_slot) break;
+        ok = ro_place(b.rec, live, n, nb, disp, rec_of_slot);
+    }
+
+    if (ok) ok = ro_write(out_path, b.rec, n, nb, seed, disp, rec_of_slot);
+    if (ok) printf("Dataset %s: %zu claves (%llu repetidas, %llu invalidas)\n",
+                   out_path, n, (unsigned long long)(c.ok - n), c.bad);
+    else    fprintf(stderr, "build-ro: no se pudo armar %s\n", out_path);
+    free(order); free(live); free(disp); free(rec_of_slot); free(b.rec);
+    if (data) munmap((void*)data, size);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 // ---------- main ----------
-int main(void) {
-    // stdout sin buffer: ayuda a Valgrind a no reportar "still reachable" por stdio
-    setvbuf(stdout, NULL, _IONBF, 0);
-    signal(SIGINT, on_sigint);
+// "--nombre" => def; "--nombre=N" => N en [min, max]. false si no es esa opción.
+static bool int_option(const char *arg, const char *name, int def, int min, int max, int *out, bool *bad) {
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) != 0) return false;
+    if (arg[n] == '\0') { *out = def; return true; }
+    if (arg[n] != '=') return false;
+    *out = atoi(arg + n + 1);
+    if (*out < min || *out > max) *bad = true;
+    return true;
+}
+
+static bool parse_options(int argc, char **argv) {
+    bool bad = false;
+    for (int i = 1; i < argc && !bad; ++i) {
+        if (int_option(argv[i], "--memcached", 11211, 1, 65535, &g_cfg.mc_port, &bad)) continue;
+        if (int_option(argv[i], "--http", 8080, 1, 65535, &g_cfg.http_port, &bad)) continue;
+        if (int_option(argv[i], "--tfo", 256, 1, 65535, &g_cfg.tfo_qlen, &bad)) continue;
+        if (int_option(argv[i], "--defer-accept", 1, 1, 3600, &g_cfg.defer_accept, &bad)) continue;
+        if (int_option(argv[i], "--zerocopy", 16384, 1, INT32_MAX, &g_cfg.zc_threshold, &bad)) continue;
+        if (int_option(argv[i], "--busy-poll", 1000, 1, 10000000, &g_cfg.busy_poll_us, &bad)) continue;
+        if (int_option(argv[i], "--write-back", 100, 1, 3600000, &g_cfg.writeback_ms, &bad)) continue;
+        if (int_option(argv[i], "--tiering", 2, 1, UINT16_MAX, &g_cfg.tier_promote, &bad)) continue;
+        if (int_option(argv[i], "--dedup", 1024, 1, INT32_MAX, &g_cfg.dedup_min, &bad)) continue;
+        if (int_option(argv[i], "--cdc", 256, 1, 1 << 20, &g_cfg.cdc_mb, &bad)) continue;
+        if (int_option(argv[i], "--port", PORT, 1, 65535, &g_cfg.port, &bad)) continue;
+        if (int_option(argv[i], "--raft-snap", 10000, 16, INT32_MAX, &g_cfg.raft_snap, &bad)) continue;
+        if (strncmp(argv[i], "--raft=", 7) == 0 && argv[i][7]) { g_cfg.raft_peers = argv[i] + 7; continue; }
+        if (strncmp(argv[i], "--ro-dataset=", 13) == 0 && argv[i][13]) { g_cfg.ro_path = argv[i] + 13; continue; }
+        int mb = 0;
+        if (int_option(argv[i], "--cache-mb", 64, 0, 1 << 20, &mb, &bad)) { g_cfg.cache_bytes = (size_t)mb << 20; continue; }
+        if (int_option(argv[i], "--engine-cache-mb", 16, 1, 1 << 20, &mb, &bad)) {
+            g_eh_cache_pages = ((size_t)mb << 20) / EH_PAGE;
+            continue;
+        }
+        if (strcmp(argv[i], "--engine=ehash") == 0) { g_cfg.ehash = true; continue; }
+        if (strcmp(argv[i], "--engine=files") == 0) { g_cfg.ehash = false; continue; }
+        return false;
+    }
+    return !bad;
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) { perror("socket"); return EXIT_FAILURE; }
+// Socket TCP no bloqueante escuchando en todas las interfaces; -1 si falla.
+// TFO y DEFER_ACCEPT son opcionales: si el kernel no los admite sólo se avisa.
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { perror("socket"); return -1; }
 
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         perror("setsockopt");
-        close(server_fd);
-        return EXIT_FAILURE;
+        close(fd);
+        return -1;
     }
 
     struct sockaddr_in address;
     memset(&address, 0, sizeof address);
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons((uint16_t)port);
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("bind");
-        close(server_fd);
-        return EXIT_FAILURE;
+        close(fd);
+        return -1;
     }
 
-    if (listen(server_fd, 8) < 0) {
+    if (g_cfg.tfo_qlen > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &g_cfg.tfo_qlen, sizeof g_cfg.tfo_qlen) < 0)
+        perror("setsockopt(TCP_FASTOPEN)");
+    if (g_cfg.defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g_cfg.defer_accept, sizeof g_cfg.defer_accept) < 0)
+        perror("setsockopt(TCP_DEFER_ACCEPT)");
+    busy_poll_socket(fd);
+
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
         perror("listen");
-        close(server_fd);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "import") == 0)
+    {
+        if (!eh_open(false) || !dedup_open(false) || !tomb_load()) return EXIT_FAILURE;    // si el directorio ya usa el índice o blobs
+        tomb_finish();                                  // los procesos de la carga no ven lápidas
+        int r = bulk_import(argv[2], argc >= 4 ? atoi(argv[3]) : 0);
+        tomb_shutdown();
+        eh_close();
+        return r;
+    }
+    if (argc >= 3 && strcmp(argv[1], "export") == 0)
+    {
+        if (!eh_open(false) || !dedup_open(false) || !tomb_load()) return EXIT_FAILURE;
+        int r = bulk_export(argv[2]);
+        tomb_shutdown();
+        eh_close();
+        return r;
+    }
+    if (argc >= 4 && strcmp(argv[1], "build-ro") == 0)
+        return ro_build(argv[2], argv[3]);
+    if (!parse_options(argc, argv)) {
+        fprintf(stderr, "uso: %s [--memcached[=PUERTO]] [--http[=PUERTO]] [--tfo[=COLA]] [--defer-accept[=SEG]]\n"
+                        "          [--zerocopy[=BYTES]] [--cache-mb=N] [--busy-poll[=USEC]]\n"
+                        "          [--write-back[=MS]] [--tiering[=LECTURAS]] [--ro-dataset=ARCHIVO]\n"
+                        "          [--engine=files|ehash] [--engine-cache-mb=N] [--dedup[=BYTES]] [--cdc[=MB]]\n"
+                        "          [--port=N] [--raft=PUERTO,PUERTO,PUERTO[,PUERTO,PUERTO]] [--raft-snap=ENTRADAS]\n"
+                        "     %s import <archivo> [procesos]\n"
+                        "     %s export <archivo | ->\n"
+                        "     %s build-ro <archivo> <dataset>\n", argv[0], argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (g_cfg.raft_peers && (g_cfg.ro_path || g_cfg.writeback_ms > 0 || g_cfg.mc_port || g_cfg.http_port)) {
+        fprintf(stderr, "--raft no se combina con --ro-dataset, --write-back, --memcached ni --http\n");
         return EXIT_FAILURE;
     }
 
-    printf("Servidor clave-valor escuchando en el puerto %d...\n", PORT);
+    // stdout sin buffer: ayuda a Valgrind a no reportar "still reachable" por stdio
+    setvbuf(stdout, NULL, _IONBF, 0);
+    signal(SIGINT, on_sigint);
+    if (g_cfg.ro_path && !(g_ro = ro_open(g_cfg.ro_path))) return EXIT_FAILURE;
+    if (!eh_open(g_cfg.ehash) || !dedup_open(g_cfg.dedup_min > 0)) return EXIT_FAILURE;
+    if (!g_ro && !tomb_load()) return EXIT_FAILURE;
+    if (!g_ro && g_cfg.cdc_mb > 0 && !cdc_open()) return EXIT_FAILURE;
+    if (!g_ro) lazy_start();
+    if (g_cfg.raft_peers) {
+        if (raft_open()) g_raft.listen_fd = open_listener(g_cfg.port + RAFT_PORT_OFFSET);
+        if (g_raft.listen_fd < 0) {
+            raft_close();
+            lazy_stop();
+            return EXIT_FAILURE;
+        }
+    }
+
+    int server_fd = open_listener(g_cfg.port);
+    if (server_fd < 0) return EXIT_FAILURE;
+    // listeners[0]: nativo; [1]: memcached; [2]: HTTP (-1 = desactivado)
+    enum { LISTEN_NATIVE, LISTEN_MEMCACHED, LISTEN_HTTP, LISTEN_COUNT };
+    int listeners[LISTEN_COUNT] = { server_fd, -1, -1 };
+    const int ports[LISTEN_COUNT] = { g_cfg.port, g_cfg.mc_port, g_cfg.http_port };
+    for (size_t l = 1; l < LISTEN_COUNT; ++l) {
+        if (!ports[l]) continue;
+        listeners[l] = open_listener(ports[l]);
+        if (listeners[l] < 0) {
+            for (size_t k = 0; k < l; ++k) if (listeners[k] >= 0) close(listeners[k]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("Servidor clave-valor escuchando en el puerto %d...\n", g_cfg.port);
+    if (listeners[LISTEN_MEMCACHED] >= 0) printf("Protocolo memcached en el puerto %d\n", g_cfg.mc_port);
+    if (listeners[LISTEN_HTTP] >= 0) printf("Gateway HTTP en el puerto %d\n", g_cfg.http_port);
+    if (g_eh.fd >= 0) printf("Índice en disco " EH_FILE " (%llu claves, %llu buckets)\n",
+                             (unsigned long long)g_eh.h.keys, (unsigned long long)eh_buckets());
+    if (g_ro) printf("Dataset de solo lectura %s (%llu claves)\n", g_cfg.ro_path, (unsigned long long)g_ro->nkeys);
 
-    socklen_t addrlen = (socklen_t)sizeof(address);
+    // pfds: listeners, canales de TRACKING (para detectar cierres), conexiones
+    // persistentes y sockets de Raft
+    enum { SLOT_LISTEN, SLOT_TRACKER, SLOT_CONN, SLOT_RAFT, SLOT_CDC };
+    struct pollfd pfds[LISTEN_COUNT + TRACK_MAX_CLIENTS + MAX_CONNS + RAFT_MAX_SOCKS + 1 + CDC_MAX_SENDERS];
+    int kind[LISTEN_COUNT + TRACK_MAX_CLIENTS + MAX_CONNS + RAFT_MAX_SOCKS + 1 + CDC_MAX_SENDERS];
+    size_t owner[LISTEN_COUNT + TRACK_MAX_CLIENTS + MAX_CONNS + RAFT_MAX_SOCKS + 1 + CDC_MAX_SENDERS];
+    uint64_t last_event = now_us();
     while (!g_stop) {
-        int client_fd = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (client_fd < 0) {
-            if (errno == EINTR && g_stop) break; // interrupción por SIGINT
-            perror("accept");
+        nfds_t nfds = 0;
+        for (size_t l = 0; l < LISTEN_COUNT; ++l) {
+            if (listeners[l] < 0) continue;
+            kind[nfds] = SLOT_LISTEN; owner[nfds] = l;
+            pfds[nfds++] = (struct pollfd){ .fd = listeners[l], .events = POLLIN, .revents = 0 };
+        }
+        for (size_t t = 0; t < TRACK_MAX_CLIENTS; ++t) {
+            if (!g_trackers[t].used) continue;
+            kind[nfds] = SLOT_TRACKER; owner[nfds] = t;
+            pfds[nfds++] = (struct pollfd){ .fd = g_trackers[t].fd, .events = POLLIN, .revents = 0 };
+        }
+        for (size_t c = 0; c < MAX_CONNS; ++c) {
+            if (!g_conns[c].used) continue;
+            kind[nfds] = SLOT_CONN; owner[nfds] = c;
+            short ev = conn_blocked(&g_conns[c]) ? POLLOUT : POLLIN;   // bloqueada: no lee más pedidos
+            pfds[nfds++] = (struct pollfd){ .fd = g_conns[c].fd, .events = ev, .revents = 0 };
+        }
+        for (size_t r = 0; g_raft.n > 0 && r <= RAFT_MAX_SOCKS; ++r) {
+            if (!raft_poll_slot(r, &pfds[nfds])) continue;
+            kind[nfds] = SLOT_RAFT; owner[nfds++] = r;
+        }
+        for (size_t k = 0; k < CDC_MAX_SENDERS; ++k) {
+            if (!g_cdc.senders[k].used) continue;
+            kind[nfds] = SLOT_CDC; owner[nfds] = k;
+            pfds[nfds++] = (struct pollfd){ .fd = g_cdc.senders[k].fd, .events = POLLOUT, .revents = 0 };
+        }
+
+        // con una exportación, una caché por liberar (FLUSHALL) o un borrado por
+        // rango sobre el índice no se duerme: cada vuelta sin eventos avanza un tramo
+        bool exporting = g_export.running || g_retired != NULL || tomb_sweeping();
+        int timeout = exporting ? 0 : busy_poll_timeout(last_event);
+        if (g_raft.n > 0 && timeout > RAFT_TICK_MS) timeout = RAFT_TICK_MS;   // latidos y elecciones
+        int ready = poll(pfds, nfds, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;   // SIGINT: el while revisa g_stop
+            perror("poll");
+            break;
+        }
+        if (timeout == 0 && !exporting) {
+            ++g_bp_spins;
+            if (ready == 0) continue;       // sigue girando sin correr las tareas en reposo
+            ++g_bp_hits;
+        }
+        if (ready == 0) {
+            idle_tasks();
+            zc_closing_tick();
             continue;
         }
-        handle_client(client_fd);
+        last_event = now_us();
+
+        for (nfds_t i = 0; i < nfds; ++i) {
+            if (pfds[i].revents == 0) continue;
+            // un handler anterior de esta vuelta pudo cerrar el canal o la conexión
+            if (kind[i] == SLOT_TRACKER && !g_trackers[owner[i]].used) continue;
+            if (kind[i] == SLOT_CONN && !g_conns[owner[i]].used) continue;
+            if (kind[i] == SLOT_TRACKER) {
+                char discard[256];
+                ssize_t r = recv(pfds[i].fd, discard, sizeof discard, MSG_DONTWAIT);
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) tracking_drop(owner[i]);
+                continue;
+            }
+            if (kind[i] == SLOT_RAFT) {
+                raft_on_event(owner[i], pfds[i].fd, pfds[i].revents);
+                continue;
+            }
+            if (kind[i] == SLOT_CDC) {
+                (void)cdc_send_step(&g_cdc.senders[owner[i]]);
+                continue;
+            }
+            if (kind[i] == SLOT_CONN) {
+                Conn *c = &g_conns[owner[i]];
+                if (pfds[i].revents & POLLERR) zc_reap(c);
+                if (conn_blocked(c) && !conn_flush(c)) {
+                    conn_close(owner[i]);
+                    continue;
+                }
+                conn_on_readable(owner[i]);
+                continue;
+            }
+
+            // Vaciar la cola de aceptación en tandas (el listener es no bloqueante).
+            // Los clientes nativos quedan bloqueantes (los handlers leen y
+            // escriben con write_all()/read()); las conexiones persistentes,
+            // no bloqueantes (ver conexiones persistentes).
+            for (int n = 0; n < ACCEPT_BATCH; ++n) {
+                int flags = SOCK_CLOEXEC | (owner[i] != LISTEN_NATIVE ? SOCK_NONBLOCK : 0);
+                int client_fd = accept4(pfds[i].fd, NULL, NULL, flags);
+                if (client_fd < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+                    break;
+                }
+                busy_poll_socket(client_fd);
+                if (owner[i] != LISTEN_NATIVE) {
+                    (void)conn_open(client_fd, owner[i] == LISTEN_HTTP ? PROTO_HTTP : PROTO_MEMCACHED);
+                    continue;
+                }
+                ++g_clients_active;
+                handle_client(client_fd);
+                --g_clients_active;
+            }
+        }
+        flights_end();
+        writeback_tick();
+        mvcc_tick();
+        lazy_tick();
+        cdc_tick();
+        raft_tick();
+        zc_closing_tick();
     }
 
-    close(server_fd);
+    conns_shutdown();
+    tracking_shutdown();
+    raft_close();
+    if (g_export.running) export_finish(false);
+    mvcc_shutdown();
+    cache_shutdown();
+    lazy_stop();
+    tomb_shutdown();
+    cdc_close();
+    eh_close();
+    dedup_close();
+    ro_unref(g_ro);
+    g_ro = NULL;
+    for (size_t l = 0; l < LISTEN_COUNT; ++l) if (listeners[l] >= 0) close(listeners[l]);
     printf("Cerrando servidor ordenadamente.\n");
     return 0;
 
     // ===== ONE-SHOT (comentado) — pruebas Valgrind =====
     // // Acepta UNA conexión y termina limpio:
-    // int client_fd = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+    // int client_fd = accept(server_fd, NULL, NULL);
     // if (client_fd < 0) { perror("accept"); close(server_fd); return EXIT_FAILURE; }
     // handle_client(client_fd);
     // close(server_fd);
@@ -3,10 +3,19 @@
 #include <string.h>             // Para manejo de cadenas
 #include <unistd.h>             // Para funciones POSIX como close()
 #include <netinet/in.h>         // Para estructuras y constantes de sockets
+#include <netinet/tcp.h>        // Para TCP_FASTOPEN y TCP_DEFER_ACCEPT
 
 #define PORT 5000               // Puerto donde escucha el servidor
 #define BUFFER_SIZE 1024        // Tamaño del buffer de lectura/escritura
 
+// Opcionales (compilar con -DTFO_QLEN=16 -DDEFER_ACCEPT_SEG=1, por ejemplo)
+#ifndef TFO_QLEN
+#define TFO_QLEN 0              // > 0: TCP Fast Open, el comando puede viajar en el SYN
+#endif
+#ifndef DEFER_ACCEPT_SEG
+#define DEFER_ACCEPT_SEG 0      // > 0: accept() vuelve recién cuando llegan datos
+#endif
+
 // Función que valida que la clave no tenga caracteres peligrosos o inválidos
 int clave_valida(const char *clave) {
     if (strlen(clave) == 0) return 0;
@@ -101,6 +110,22 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
+    // TCP Fast Open: ahorra un RTT a los clientes que abren una conexión por comando
+    if (TFO_QLEN > 0) {
+        int qlen = TFO_QLEN;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0) {
+            perror("Aviso: TCP_FASTOPEN no disponible");
+        }
+    }
+
+    // Aceptar la conexión sólo cuando ya llegó el comando (no bloquea en read)
+    if (DEFER_ACCEPT_SEG > 0) {
+        int seg = DEFER_ACCEPT_SEG;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seg, sizeof(seg)) < 0) {
+            perror("Aviso: TCP_DEFER_ACCEPT no disponible");
+        }
+    }
+
     // Configurar dirección del servidor (IPv4, cualquier interfaz, puerto 5000)
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;